@@ -3,8 +3,236 @@
 #include <cmath>
 
 #include <array>
+
+#include <algorithm>
+
+#include <cstring>
+
+#include <cstddef>
+
+#include <limits>
+
+#include <type_traits>
+
+#include <concepts>
+#ifdef ADCS_HOST_BUILD
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h> //POSIX host, for the memory mapped replay logs
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 //here i am assuming that we will be using freeRTOS(though i am not using multitasking features of RTOS)
 //and i am assuming that we are using ARM cortex series microprocessor(and not an arduino type processor, thus i am not using setup() and loop() functions typically found in arduino code) this is pure embedded c++ implementation.
+enum class ADCSMode: uint8_t { //this stores the mode the ADCS currently is in
+    DETUMBLING,
+    SUN_ACQUISITION,
+    NOMINAL_POINTING,
+    SAFE_MODE,
+    FAULT_RECOVERY
+};
+
+constexpr uint32_t CPU_CLOCK_HZ = 80000000; //core clock, used to turn cycle counts into time
+
+inline uint32_t read_cycle_counter() {
+#ifdef ADCS_HOST_BUILD
+    return static_cast < uint32_t > (std::chrono::duration_cast < std::chrono::nanoseconds > (std::chrono::steady_clock::now().time_since_epoch()).count());
+#else
+    /*DWT->CYCCNT on the cortex-M*/
+    return 0;
+#endif
+}
+
+template < typename Storage, typename Wide, int FRACTION_BITS >
+struct Fixed { //signed Q format with saturating arithmetic, for boards without an FPU. products and quotients are formed
+    //in Wide and rounded back, anything out of range sticks at the limit instead of wrapping round
+    static_assert(sizeof(Wide) >= 2 * sizeof(Storage), "Wide has to hold a full product");
+    static constexpr Storage MAX = std::numeric_limits < Storage > ::max();
+    static constexpr Storage MIN = std::numeric_limits < Storage > ::min();
+    static constexpr float ONE = static_cast < float > (static_cast < Wide > (1) << FRACTION_BITS);
+    Storage raw;
+
+    static constexpr Fixed from_float(float value) {
+        const float scaled = value * ONE;
+        if (scaled >= static_cast < float > (MAX)) return { MAX };
+        if (scaled <= static_cast < float > (MIN)) return { MIN };
+        return { static_cast < Storage > (scaled + (scaled < 0.0f ? -0.5f : 0.5f)) };
+    }
+    constexpr float to_float() const {
+        return static_cast < float > (raw) / ONE;
+    }
+    static constexpr Storage saturate(Wide value) {
+        return value > MAX ? MAX : (value < MIN ? MIN : static_cast < Storage > (value));
+    }
+    constexpr Fixed operator + (Fixed other) const {
+        return { saturate(static_cast < Wide > (raw) + other.raw) };
+    }
+    constexpr Fixed operator - (Fixed other) const {
+        return { saturate(static_cast < Wide > (raw) - other.raw) };
+    }
+    constexpr Fixed operator - () const {
+        return { saturate(-static_cast < Wide > (raw)) };
+    }
+    constexpr Fixed operator * (Fixed other) const {
+        return { saturate((static_cast < Wide > (raw) * other.raw + (static_cast < Wide > (1) << (FRACTION_BITS - 1))) >> FRACTION_BITS) };
+    }
+    constexpr Fixed operator / (Fixed other) const {
+        if (other.raw == 0) return { (raw < 0) ? MIN : MAX };
+        return { saturate(static_cast < Wide > (static_cast < Wide > (raw) * (static_cast < Wide > (1) << FRACTION_BITS)) / other.raw) };
+    }
+    constexpr bool operator < (Fixed other) const {
+        return raw < other.raw;
+    }
+    constexpr Fixed sqrt() const { //bit by bit integer square root of raw * 2^FRACTION_BITS, no FPU and no division
+        if (raw <= 0) return { 0 };
+        using Unsigned = std::make_unsigned_t < Wide > ;
+        Unsigned value = static_cast < Unsigned > (raw) << FRACTION_BITS;
+        Unsigned root = 0;
+        Unsigned bit = static_cast < Unsigned > (1) << (sizeof(Wide) * 8 - 2);
+        while (bit > value) bit >>= 2;
+        for (; bit != 0; bit >>= 2) {
+            if (value >= root + bit) {
+                value -= root + bit;
+                root = (root >> 1) + bit;
+            } else {
+                root >>= 1;
+            }
+        }
+        return { saturate(static_cast < Wide > (root)) };
+    }
+};
+
+using Q15 = Fixed < int16_t, int32_t, 15 > ; //[-1, 1), 3e-5 steps, unit vectors and quaternions on 16 bit cores
+using Q31 = Fixed < int32_t, int64_t, 31 > ; //[-1, 1), 5e-10 steps, unit vectors, quaternions and the pointing law unscaled
+using FixedQ16 = Fixed < int32_t, int64_t, 16 > ; //Q16.16, [-32768, 32768), 1.5e-5 steps
+
+template < typename Scalar >
+struct ScalarTraits { //float and double
+    static constexpr Scalar from_float(float value) {
+        return static_cast < Scalar > (value);
+    }
+    static constexpr float to_float(Scalar value) {
+        return static_cast < float > (value);
+    }
+    static Scalar sqrt(Scalar value) {
+        return std::sqrt(value);
+    }
+};
+
+template < typename Storage, typename Wide, int FRACTION_BITS >
+struct ScalarTraits < Fixed < Storage, Wide, FRACTION_BITS >> {
+    using Type = Fixed < Storage, Wide, FRACTION_BITS > ;
+    static constexpr Type from_float(float value) {
+        return Type::from_float(value);
+    }
+    static constexpr float to_float(Type value) {
+        return value.to_float();
+    }
+    static constexpr Type sqrt(Type value) {
+        return value.sqrt();
+    }
+};
+
+//small vector/quaternion helpers for the estimator(kept as plain std::array so that they can be stored in NVM as they are).
+//they are templates on the scalar so the same source runs in float, double and the Q formats above. for the Q formats
+//every intermediate has to stay inside the range: with unit quaternions and unit vectors that holds for all of them(partial
+//sums of a product of unit vectors are bounded by 1), which is why rotate_to_body goes through the rotation matrix
+template < typename Scalar >
+using Vector3Of = std::array < Scalar, 3 > ;
+template < typename Scalar >
+using QuaternionOf = std::array < Scalar, 4 > ;
+using Vector3 = Vector3Of < float > ;
+using Quaternion = QuaternionOf < float > ; //scalar first {w, x, y, z}, rotates body frame vectors into the inertial frame
+
+template < typename Scalar >
+inline Scalar dot(const Vector3Of < Scalar > & a, const Vector3Of < Scalar > & b) {
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+template < typename Scalar >
+inline Vector3Of < Scalar > cross(const Vector3Of < Scalar > & a, const Vector3Of < Scalar > & b) {
+    return {
+        a[1] * b[2] - a[2] * b[1],
+        a[2] * b[0] - a[0] * b[2],
+        a[0] * b[1] - a[1] * b[0]
+    };
+}
+
+template < typename Scalar >
+inline Scalar norm(const Vector3Of < Scalar > & a) {
+    return ScalarTraits < Scalar > ::sqrt(dot(a, a));
+}
+
+template < typename Scalar >
+inline QuaternionOf < Scalar > quaternion_multiply(const QuaternionOf < Scalar > & p, const QuaternionOf < Scalar > & q) {
+    return {
+        p[0] * q[0] - p[1] * q[1] - p[2] * q[2] - p[3] * q[3],
+        p[0] * q[1] + p[1] * q[0] + p[2] * q[3] - p[3] * q[2],
+        p[0] * q[2] - p[1] * q[3] + p[2] * q[0] + p[3] * q[1],
+        p[0] * q[3] + p[1] * q[2] - p[2] * q[1] + p[3] * q[0]
+    };
+}
+
+template < typename Scalar >
+inline QuaternionOf < Scalar > quaternion_normalize(const QuaternionOf < Scalar > & q) {
+    //works on q / 2, so the sum of squares has room for a quaternion a little longer than 1(every propagation step makes
+    //one) instead of saturating at 1 in Q31 and letting the norm creep up
+    const Scalar half = ScalarTraits < Scalar > ::from_float(0.5f);
+    const QuaternionOf < Scalar > h { q[0] * half, q[1] * half, q[2] * half, q[3] * half };
+    const Scalar n = ScalarTraits < Scalar > ::sqrt(h[0] * h[0] + h[1] * h[1] + h[2] * h[2] + h[3] * h[3]);
+    const bool flip = q[0] < Scalar {}; //keep the scalar part positive so that q and -q are stored the same way
+    QuaternionOf < Scalar > result;
+    for (int i = 0; i < 4; i++) result[i] = (flip ? -h[i] : h[i]) / n;
+    return result;
+}
+
+template < typename Scalar >
+inline Vector3Of < Scalar > rotate_to_body(const QuaternionOf < Scalar > & q, const Vector3Of < Scalar > & v) {
+    //inertial frame vector expressed in the body frame, v' = R^T v with R the body to inertial rotation matrix of q.
+    //the off diagonal terms are 2(xy - wz) etc, |xy - wz| <= 1/2 so they are added to themselves instead of scaled by 2
+    const Scalar w = q[0], x = q[1], y = q[2], z = q[3];
+    const Scalar ww = w * w, xx = x * x, yy = y * y, zz = z * z;
+    const Scalar xy_m_wz = x * y - w * z, xy_p_wz = x * y + w * z;
+    const Scalar xz_m_wy = x * z - w * y, xz_p_wy = x * z + w * y;
+    const Scalar yz_m_wx = y * z - w * x, yz_p_wx = y * z + w * x;
+    const Scalar r00 = (ww + xx) - (yy + zz), r11 = (ww + yy) - (xx + zz), r22 = (ww + zz) - (xx + yy);
+    const Scalar r01 = xy_m_wz + xy_m_wz, r10 = xy_p_wz + xy_p_wz;
+    const Scalar r02 = xz_p_wy + xz_p_wy, r20 = xz_m_wy + xz_m_wy;
+    const Scalar r12 = yz_m_wx + yz_m_wx, r21 = yz_p_wx + yz_p_wx;
+    return {
+        r00 * v[0] + r10 * v[1] + r20 * v[2],
+        r01 * v[0] + r11 * v[1] + r21 * v[2],
+        r02 * v[0] + r12 * v[1] + r22 * v[2]
+    };
+}
+
+template < typename Scalar >
+inline QuaternionOf < Scalar > propagate_attitude(const QuaternionOf < Scalar > & q, const Vector3Of < Scalar > & rate, Scalar dt) {
+    //first order quaternion kinematics q' = q (x) [1, w dt / 2], renormalized. this is the part of the estimator that runs
+    //on every gyro sample, so it is the part with a fixed point build(the covariance needs the range of floating point)
+    const Scalar half = ScalarTraits < Scalar > ::from_float(0.5f);
+    const Scalar one = ScalarTraits < Scalar > ::from_float(1.0f); //1 - 2^-31 in Q31, the normalization takes it out
+    return quaternion_normalize(quaternion_multiply(q, { one, rate[0] * dt * half, rate[1] * dt * half, rate[2] * dt * half }));
+}
+
+inline uint16_t crc16_ccitt(const uint8_t * data, size_t length) {
+    //CRC-16-CCITT(poly 0x1021, init 0xFFFF), the CCSDS packet error control and the NVM record check
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= static_cast < uint16_t > (data[i]) << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) crc = (crc & 0x8000) ? static_cast < uint16_t > ((crc << 1) ^ 0x1021) : static_cast < uint16_t > (crc << 1);
+    }
+    return crc;
+}
+
+template < typename Record >
+inline uint16_t record_crc(const Record & record) {
+    //NVM records keep their checksum as the last field, the CRC covers every byte before it(the fields in front of it are
+    //laid out without padding, so no indeterminate byte is in the sum)
+    return crc16_ccitt(reinterpret_cast < const uint8_t * > ( & record), offsetof(Record, checksum));
+}
+
 //Hardware Abstraction layer
 class NonVolatileMemory {
     public: struct ADCSState {
@@ -12,108 +240,5364 @@ class NonVolatileMemory {
         uint32_t mode_entry_time; //time at which that state was saved(these special data types are used to be more memory efficient)
         std::array < float, 3 > angular_velocity; //in all 3 directions
         float power_level;
-        float timestamp; //this is store the time the state was saved/written in memory
-        float checksum;
+        uint32_t timestamp; //this is store the time the state was saved/written in memory(ms, same clock as get_current_time so the warm boot can tell how old it is)
+        uint16_t checksum;
         static ADCSState read_persistent_state() {
-            /* NVM read implementation */ }
+            /* NVM read implementation */
+            return {}; //until then an empty record, timestamp 0 never passes as a warm boot
+        }
+        uint16_t compute_checksum() const {
+            //CRC of the record, recomputed on read and compared with the stored one(a sum of floats misses swapped or
+            //compensating errors, and this record decides whether the diagnostics are skipped)
+            return record_crc( * this);
+        }
+    };
+
+    struct EstimatorCheckpoint { //compact copy of the attitude estimator, written on a slow cadence so that a reset does not lose the attitude and gyro biases
+        Quaternion attitude;
+        Vector3 gyro_bias; //rad/s
+        std::array < float, 6 > covariance_diagonal; //attitude error (rad^2) then bias (rad^2/s^2)
+        uint32_t timestamp; //ms, same clock as ADCSState::timestamp
+        uint16_t checksum;
+        uint16_t compute_checksum() const {
+            return record_crc( * this);
+        }
+    };
+
+    struct GyroCalibrationRecord { //gyro bias and scale factor from GyroCalibration, kept over resets(unlike the attitude they stay valid)
+        Vector3 bias; //rad/s
+        Vector3 scale;
+        std::array < float, 6 > covariance_diagonal; //bias (rad^2/s^2) then scale
+        uint32_t timestamp;
+        uint16_t checksum;
+        uint16_t compute_checksum() const {
+            return record_crc( * this);
+        }
+    };
+
+    struct MagnetometerCalibrationRecord { //hard/soft iron correction from MagnetometerCalibration
+        Vector3 hard_iron; //T
+        std::array < Vector3, 3 > soft_iron;
+        uint32_t timestamp;
+        uint16_t checksum;
+        uint16_t compute_checksum() const {
+            return record_crc( * this);
+        }
+    };
+
+    public: static ADCSState read_persistent_state() {
+        ADCSState state {};
+        /* NVM read implementation */
+        return state;
+    }
+    static void write(const ADCSState &) {
+        /* NVM write implementation */ }
+    struct WatchdogDiagnostic { //written by the watchdog supervisor just before it lets the WDT reset us, read back after the reset
+        uint32_t timestamp; //first, so the two bytes after it are not padding in front of the checksum
+        uint8_t violation; //WatchdogSupervisor::Violation
+        uint8_t missing_tokens; //bit per WatchdogToken that had not checked in
+        uint16_t checksum;
+        uint16_t compute_checksum() const {
+            return record_crc( * this);
+        }
+    };
+
+    static EstimatorCheckpoint read_estimator_checkpoint() {
+        EstimatorCheckpoint checkpoint {};
+        /* NVM read implementation(separate slot from the ADCSState) */
+        return checkpoint;
+    }
+    static void write_estimator_checkpoint(const EstimatorCheckpoint &) {
+        /* NVM write implementation(separate slot from the ADCSState) */ }
+    static GyroCalibrationRecord read_gyro_calibration() {
+        GyroCalibrationRecord record {};
+        /* NVM read implementation(own slot) */
+        return record;
+    }
+    static void write_gyro_calibration(const GyroCalibrationRecord &) {
+        /* NVM write implementation(own slot) */ }
+    static MagnetometerCalibrationRecord read_magnetometer_calibration() {
+        MagnetometerCalibrationRecord record {};
+        /* NVM read implementation(own slot) */
+        return record;
+    }
+    static void write_magnetometer_calibration(const MagnetometerCalibrationRecord &) {
+        /* NVM write implementation(own slot) */ }
+    static WatchdogDiagnostic read_watchdog_diagnostic() {
+        WatchdogDiagnostic diagnostic {};
+        /* NVM read implementation */
+        return diagnostic;
+    }
+    static void write_watchdog_diagnostic(const WatchdogDiagnostic &) {
+        /* NVM write implementation */ }
+    void save_persistent_state(ADCSState state) {
+        NonVolatileMemory::write((ADCSState) state);
+    }
+};
+
+struct ADCSState {
+    ADCSMode current_mode;
+    uint32_t mode_entry_time; //time at which that state was saved
+    std::array < float, 3 > angular_velocity; //in all 3 directions
+    float power_level;
+    std::array < float, 3 > magnetic_field; //body frame, tesla
+    std::array < float, 4 > wheel_speeds; //rad/s, one per reaction wheel(0 when there are none)
+    std::array < float, 2 > magnetometer_residual_rms; //tesla, ||B| - |B_model|| before and after the hard/soft iron correction
+    float battery_charge; //state of charge 0-1, from the EPS
+    float forecast_min_charge; //lowest state of charge PowerScheduler expects over the next orbit in the current mode
+    float avionics_power_mw; //PowerStateManager estimate for the current mode(MCU and sensors, not the actuators)
+    float idle_fraction; //share of the time the core was asleep in the current mode(TicklessIdle)
+    uint8_t isolated_sensors; //voted out units, bit per IMU then per magnetometer
+    bool sensor_anomaly; //a redundant sensor has no usable majority left, or a sensor failed its innovation test
+    std::array < float, 2 > innovation_nis_mean; //sun, magnetometer: mean normalized innovation squared over the window(~2 when healthy)
+    static ADCSState read_persistent_state() {
+        ADCSState state {};
+        /* NVM read implementation */
+        return state;
+    }
+};
+
+class FaultManager {
+    public: enum class FaultType {
+        NONE,
+        HIGH_ANGULAR_RATE,
+        LOW_POWER,
+        SENSOR_ANOMALY,
+        CRITICAL,
+        SOFTWARE_RESET_REQUIRED
+    };
+
+    static constexpr float LOW_POWER_THRESHOLD = 4.0f; // Watts
+    static constexpr uint8_t FAULT_TYPE_COUNT = 6;
+    std::array < uint16_t, FAULT_TYPE_COUNT > fault_counts {}; //how many times each fault was handled(index is the FaultType), for telemetry
+
+    FaultType check_faults(const ADCSState & state) {
+        if (check_angular_rate(state)) return FaultType::HIGH_ANGULAR_RATE;
+        if (check_power_level(state)) return FaultType::LOW_POWER;
+        if (check_sensors(state)) return FaultType::SENSOR_ANOMALY;
+        return FaultType::NONE;
+    }
+
+    void record_fault(FaultType fault) {
+        uint16_t & count = fault_counts[static_cast < uint8_t > (fault)];
+        if (count != UINT16_MAX) count++;
+    }
+
+    private: bool check_angular_rate(const ADCSState & state) {
+        constexpr float MAX_ANGULAR_RATE = 0.1f; // rad/s
+        return (std::abs(state.angular_velocity[0]) > MAX_ANGULAR_RATE) ||
+            (std::abs(state.angular_velocity[1]) > MAX_ANGULAR_RATE) ||
+            (std::abs(state.angular_velocity[2]) > MAX_ANGULAR_RATE);
+    }
+
+    bool check_power_level(const ADCSState & state) {
+        return state.power_level < LOW_POWER_THRESHOLD;
+    }
+
+    bool check_sensors(const ADCSState & state) {
+        //single unit failures are voted out and handled by the voters, only a sensor with no majority left or one that
+        //failed the estimator's innovation test gets here
+        return state.sensor_anomaly;
+    }
+};
+
+class InnovationMonitor {
+    //windowed chi-square test on the normalized innovation squared(NIS) of one measurement source. a single NIS is
+    //chi-square with 2 degrees of freedom for a unit vector(the component along the vector is second order), so the sum
+    //over WINDOW of them is chi-square with 2 WINDOW: a sensor that drifts slowly raises the sum long before a single
+    //measurement fails the gate. the test is made once per full window, not on every sliding sum(those are correlated
+    //and would multiply the false alarms), and FAIL_WINDOWS windows in a row have to fail. fixed cost per measurement
+    public:
+    static constexpr uint8_t WINDOW = 20;
+    static constexpr float WINDOW_THRESHOLD = 82.1f; //chi-square, 40 degrees of freedom, 1e-4 false alarm per window
+    static constexpr uint8_t FAIL_WINDOWS = 2;
+    static constexpr float NIS_CLAMP = 50.0f; //a rejected outlier counts, but one wild value should not fill the window alone
+
+    void add(float nis) {
+        nis = std::min(nis, NIS_CLAMP);
+        sum += nis - window[index];
+        window[index] = nis;
+        if (++index == WINDOW) {
+            index = 0;
+            sum = 0.0f; //resummed once per window so the running sum does not drift
+            for (float value: window) sum += value;
+            failed_windows = (sum > WINDOW_THRESHOLD) ? std::min < uint8_t > (failed_windows + 1, FAIL_WINDOWS) : 0;
+        }
+        if (count < WINDOW) count++;
+    }
+
+    bool failed() const {
+        return failed_windows >= FAIL_WINDOWS;
+    }
+
+    float mean() const {
+        return (count == 0) ? 0.0f : sum / count;
+    }
+
+    void reset() {
+        window = {};
+        sum = 0.0f;
+        index = 0;
+        count = 0;
+        failed_windows = 0;
+    }
+
+    private:
+    std::array < float, WINDOW > window {};
+    float sum = 0.0f;
+    uint8_t index = 0;
+    uint8_t count = 0;
+    uint8_t failed_windows = 0;
+};
+
+template < typename Real >
+class BasicAttitudeEstimator {
+    //multiplicative extended kalman filter, the state is the attitude quaternion and the gyro bias,
+    //the covariance is kept over the 3 small attitude errors and the 3 bias errors. float or double: the covariance runs
+    //from ~1e-10 to 1 so there is no fixed point build of the whole filter, only of its kinematics(propagate_attitude)
+    static_assert(std::is_floating_point_v < Real > , "the covariance needs floating point");
+
+    public:
+    using Vector = Vector3Of < Real > ;
+    using Attitude = QuaternionOf < Real > ;
+    using Covariance = std::array < std::array < Real, 6 > , 6 > ;
+
+    enum class Measurement: uint8_t {
+        SUN,
+        MAGNETOMETER,
+        COUNT
+    };
+    struct Innovation {
+        Vector normalized; //per axis, innovation over its predicted standard deviation
+        Real nis; //normalized innovation squared, v^T S^-1 v
+        bool rejected; //failed the gate and was not applied
+    };
+    static constexpr Real GATE_CHI2 = static_cast < Real > (13.8); //single measurement gate, chi-square 2 degrees of freedom, 99.9%
+
+    static constexpr Real GYRO_NOISE_DENSITY = static_cast < Real > (1.0e-4); //rad/s/sqrt(Hz), angle random walk
+    static constexpr Real BIAS_RANDOM_WALK = static_cast < Real > (1.0e-6); //rad/s^2/sqrt(Hz)
+    static constexpr Real INITIAL_ATTITUDE_VARIANCE = 1; //rad^2, basically "we dont know"
+    static constexpr Real INITIAL_BIAS_VARIANCE = static_cast < Real > (1.0e-4); //(rad/s)^2, from the gyro datasheet bias spec
+
+    Attitude attitude { 1, 0, 0, 0 };
+    Vector gyro_bias {};
+    Covariance covariance {};
+    bool initialized = false; //false until a single frame solution or a checkpoint has given us an attitude
+    std::array < Innovation, static_cast < uint8_t > (Measurement::COUNT) > last_innovation {};
+    std::array < InnovationMonitor, static_cast < uint8_t > (Measurement::COUNT) > monitors {};
+
+    BasicAttitudeEstimator() {
+        reset();
+    }
+
+    void reset() {
+        attitude = { 1, 0, 0, 0 };
+        gyro_bias = {};
+        covariance = {};
+        for (int i = 0; i < 3; i++) {
+            covariance[i][i] = INITIAL_ATTITUDE_VARIANCE;
+            covariance[i + 3][i + 3] = INITIAL_BIAS_VARIANCE;
+        }
+        initialized = false;
+        for (InnovationMonitor & monitor: monitors) monitor.reset();
+    }
+
+    void initialize(const Attitude & q, Real attitude_variance) { //start from a single frame solution, the bias is still unknown
+        reset();
+        attitude = quaternion_normalize(q);
+        for (int i = 0; i < 3; i++) covariance[i][i] = std::min(attitude_variance, INITIAL_ATTITUDE_VARIANCE);
+        initialized = true;
+    }
+
+    Vector angular_rate(const Vector & gyro) const { //gyro reading with the estimated bias taken out
+        return { gyro[0] - gyro_bias[0], gyro[1] - gyro_bias[1], gyro[2] - gyro_bias[2] };
+    }
+
+    void propagate(const Vector & gyro, Real dt) {
+        const Vector w = angular_rate(gyro);
+        attitude = propagate_attitude(attitude, w, dt);
+
+        //error state transition F = [I - [w x]dt, -I dt; 0, I]
+        Covariance F {};
+        for (int i = 0; i < 6; i++) F[i][i] = 1;
+        F[0][1] = w[2] * dt;
+        F[0][2] = -w[1] * dt;
+        F[1][0] = -w[2] * dt;
+        F[1][2] = w[0] * dt;
+        F[2][0] = w[1] * dt;
+        F[2][1] = -w[0] * dt;
+        for (int i = 0; i < 3; i++) F[i][i + 3] = -dt;
+
+        Covariance FP {};
+        for (int i = 0; i < 6; i++)
+            for (int j = 0; j < 6; j++)
+                for (int k = 0; k < 6; k++) FP[i][j] += F[i][k] * covariance[k][j];
+        for (int i = 0; i < 6; i++) {
+            for (int j = 0; j < 6; j++) {
+                Real sum = 0;
+                for (int k = 0; k < 6; k++) sum += FP[i][k] * F[j][k];
+                covariance[i][j] = sum;
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            covariance[i][i] += GYRO_NOISE_DENSITY * GYRO_NOISE_DENSITY * dt;
+            covariance[i + 3][i + 3] += BIAS_RANDOM_WALK * BIAS_RANDOM_WALK * dt;
+        }
+    }
+
+    bool update_vector(Measurement source, const Vector & measured_body, const Vector & reference_inertial, Real sigma) {
+        //unit vector measurement(sun, magnetic field), processed as 3 scalar updates so there is no matrix inverse.
+        //before that the whole innovation is checked against its covariance S = H P H^T + sigma^2 I(a 3x3 inverse, the
+        //only one), false if it failed the gate and the state was left alone
+        const Vector predicted = rotate_to_body(attitude, reference_inertial);
+        //H = [[predicted x], 0]
+        const Real H[3][3] = {
+            { 0, -predicted[2], predicted[1] },
+            { predicted[2], 0, -predicted[0] },
+            { -predicted[1], predicted[0], 0 }
+        };
+        Innovation & result = last_innovation[static_cast < uint8_t > (source)];
+        result.nis = normalized_innovation_squared(H, { measured_body[0] - predicted[0], measured_body[1] - predicted[1], measured_body[2] - predicted[2] },
+            sigma, result.normalized);
+        result.rejected = result.nis > GATE_CHI2;
+        monitors[static_cast < uint8_t > (source)].add(static_cast < float > (result.nis));
+        if (result.rejected) return false;
+
+        std::array < Real, 6 > dx {};
+        for (int axis = 0; axis < 3; axis++) {
+            std::array < Real, 6 > PH {};
+            for (int i = 0; i < 6; i++)
+                for (int k = 0; k < 3; k++) PH[i] += covariance[i][k] * H[axis][k];
+            Real innovation_variance = sigma * sigma;
+            Real predicted_dx = 0;
+            for (int k = 0; k < 3; k++) {
+                innovation_variance += H[axis][k] * PH[k];
+                predicted_dx += H[axis][k] * dx[k];
+            }
+            const Real innovation = measured_body[axis] - predicted[axis] - predicted_dx;
+            for (int i = 0; i < 6; i++) dx[i] += PH[i] / innovation_variance * innovation;
+            for (int i = 0; i < 6; i++)
+                for (int j = 0; j < 6; j++) covariance[i][j] -= PH[i] * PH[j] / innovation_variance;
+        }
+        const Real half = static_cast < Real > (0.5);
+        attitude = quaternion_normalize(quaternion_multiply(attitude, { 1, half * dx[0], half * dx[1], half * dx[2] }));
+        for (int i = 0; i < 3; i++) gyro_bias[i] += dx[i + 3];
+        return true;
+    }
+
+    Real normalized_innovation_squared(const Real H[3][3], const Vector & innovation, Real sigma, Vector & normalized) const {
+        Real HP[3][3] = {};
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                for (int k = 0; k < 3; k++) HP[i][j] += H[i][k] * covariance[k][j];
+        Real S[3][3];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                Real sum = (i == j) ? sigma * sigma : 0;
+                for (int k = 0; k < 3; k++) sum += HP[i][k] * H[j][k];
+                S[i][j] = sum;
+            }
+            normalized[i] = innovation[i] / std::sqrt(S[i][i]);
+        }
+        //S is symmetric positive definite(sigma^2 on the diagonal), cofactor inverse
+        const Real c00 = S[1][1] * S[2][2] - S[1][2] * S[2][1], c01 = S[1][2] * S[2][0] - S[1][0] * S[2][2], c02 = S[1][0] * S[2][1] - S[1][1] * S[2][0];
+        const Real c11 = S[0][0] * S[2][2] - S[0][2] * S[2][0], c12 = S[0][1] * S[2][0] - S[0][0] * S[2][1];
+        const Real c22 = S[0][0] * S[1][1] - S[0][1] * S[1][0];
+        const Real det = S[0][0] * c00 + S[0][1] * c01 + S[0][2] * c02;
+        const Real x = innovation[0], y = innovation[1], z = innovation[2];
+        return (c00 * x * x + c11 * y * y + c22 * z * z + 2 * (c01 * x * y + c02 * x * z + c12 * y * z)) / det;
+    }
+
+    NonVolatileMemory::EstimatorCheckpoint make_checkpoint(uint32_t time) const {
+        NonVolatileMemory::EstimatorCheckpoint checkpoint {};
+        for (int i = 0; i < 4; i++) checkpoint.attitude[i] = static_cast < float > (attitude[i]);
+        for (int i = 0; i < 3; i++) checkpoint.gyro_bias[i] = static_cast < float > (gyro_bias[i]);
+        for (int i = 0; i < 6; i++) checkpoint.covariance_diagonal[i] = static_cast < float > (covariance[i][i]);
+        checkpoint.timestamp = time;
+        checkpoint.checksum = checkpoint.compute_checksum();
+        return checkpoint;
+    }
+
+    void restore_checkpoint(const NonVolatileMemory::EstimatorCheckpoint & checkpoint, Real elapsed_s) {
+        //the cross correlations are not stored, so the restored covariance is diagonal. it is inflated by the process noise
+        //over the time we were not running(plus the attitude drift an uncorrected bias error would cause) so the filter trusts
+        //the old estimate only as much as it deserves and the first measurements pull it back in
+        for (int i = 0; i < 4; i++) attitude[i] = checkpoint.attitude[i];
+        attitude = quaternion_normalize(attitude);
+        for (int i = 0; i < 3; i++) gyro_bias[i] = checkpoint.gyro_bias[i];
+        covariance = {};
+        for (int i = 0; i < 3; i++) {
+            const Real bias_variance = checkpoint.covariance_diagonal[i + 3];
+            const Real attitude_variance = checkpoint.covariance_diagonal[i] +
+                GYRO_NOISE_DENSITY * GYRO_NOISE_DENSITY * elapsed_s + bias_variance * elapsed_s * elapsed_s;
+            covariance[i][i] = std::min(attitude_variance, INITIAL_ATTITUDE_VARIANCE);
+            covariance[i + 3][i + 3] = std::min(bias_variance + BIAS_RANDOM_WALK * BIAS_RANDOM_WALK * elapsed_s, INITIAL_BIAS_VARIANCE);
+        }
+        initialized = true;
+    }
+};
+
+using AttitudeEstimator = BasicAttitudeEstimator < float > ; //the flight filter, double is the reference in EstimatorPrecisionBenchmark
+
+class GyroCalibration {
+    //on line gyro bias and scale factor, per axis gyro = (1 + s) w + b. two sources feed it:
+    //- the magnetometer: the field hardly moves in inertial space, so in the body it turns at -w and two readings give the
+    //  rate perpendicular to B. the gyro minus that rate is a linear measurement of [b, s], solved by recursive least
+    //  squares. as the body turns through the field every axis gets seen, and it needs no attitude, so it works from
+    //  the first tumble in DETUMBLING. the field does turn a little in inertial space(FIELD_DRIFT_RATE), which is not
+    //  modelled: it is below the bias we are after, but it limits the scale factor to about FIELD_DRIFT_RATE / rate,
+    //  under 1% while tumbling and the separation of scale from bias comes from the rate changing during detumbling
+    //- the MEKF: once its bias has converged it beats the above and is moved over here(absorb_estimator_bias)
+    //misalignment is left out, the datasheet puts it well under the scale factor error and it would be 6 more states
+    public:
+    using Covariance = std::array < std::array < float, 6 > , 6 > ;
+
+    static constexpr uint16_t INTERVAL_MS = 500; //field readings this far apart make one measurement
+    static constexpr float FIELD_DIRECTION_NOISE = 3.0e-3f; //rad, one magnetometer reading
+    static constexpr float FIELD_DRIFT_RATE = 2.0e-3f; //rad/s, the field turns at up to ~2x orbit rate in inertial space
+    static constexpr float INITIAL_BIAS_VARIANCE = 1.0e-4f; //(rad/s)^2, same as the estimator
+    static constexpr float INITIAL_SCALE_VARIANCE = 4.0e-4f; //2% 1 sigma, datasheet
+    static constexpr float MAX_SCALE = 0.1f; //anything past this is a broken gyro, not something to calibrate out
+    static constexpr float ABSORB_BIAS_SIGMA = 2.0e-4f; //rad/s, the estimator bias is taken over once it is this good
+
+    Vector3 bias {}; //rad/s
+    Vector3 scale {}; //fraction
+    Covariance covariance {};
+
+    GyroCalibration() {
+        reset();
+    }
+
+    void reset() {
+        bias = {};
+        scale = {};
+        covariance = {};
+        for (int i = 0; i < 3; i++) {
+            covariance[i][i] = INITIAL_BIAS_VARIANCE;
+            covariance[i + 3][i + 3] = INITIAL_SCALE_VARIANCE;
+        }
+        interval_start = 0;
+    }
+
+    static Vector3 field_rate(const Vector3 & b0, const Vector3 & b1, float dt) {
+        //the field turned through angle theta about b0 x b1 in dt, so the rate perpendicular to B is -theta/dt along it
+        const Vector3 turn = cross(b0, b1);
+        const float theta = std::atan2(norm(turn), dot(b0, b1));
+        const float turn_norm = std::max(norm(turn), 1.0e-12f);
+        return { -turn[0] / turn_norm * theta / dt, -turn[1] / turn_norm * theta / dt, -turn[2] / turn_norm * theta / dt };
+    }
+
+    Vector3 correct(const Vector3 & raw) const {
+        return { (raw[0] - bias[0]) / (1.0f + scale[0]), (raw[1] - bias[1]) / (1.0f + scale[1]), (raw[2] - bias[2]) / (1.0f + scale[2]) };
+    }
+
+    void update(const Vector3 & raw_gyro, const Vector3 & magnetic_field, uint32_t now) {
+        if (norm(magnetic_field) == 0.0f) {
+            interval_start = 0; //no field, start a fresh interval once it is back
+            return;
+        }
+        if (interval_start == 0) {
+            start_interval(magnetic_field, now);
+            return;
+        }
+        for (int i = 0; i < 3; i++) gyro_sum[i] += raw_gyro[i];
+        gyro_samples++;
+        if (now - interval_start < INTERVAL_MS) return;
+
+        const float dt = (now - interval_start) * 0.001f;
+        const Vector3 rate_from_field = field_rate(interval_field, magnetic_field, dt);
+        const Vector3 gyro { gyro_sum[0] / gyro_samples, gyro_sum[1] / gyro_samples, gyro_sum[2] / gyro_samples };
+        Vector3 mid_field { interval_field[0] + magnetic_field[0], interval_field[1] + magnetic_field[1], interval_field[2] + magnetic_field[2] };
+        const float mid_norm = norm(mid_field);
+        for (float & value: mid_field) value /= mid_norm;
+        start_interval(magnetic_field, now);
+
+        //y = P(gyro) - field rate = P [I, diag(gyro)] [b; s] with P = I - u u^T the projection off the field direction u.
+        //the scale term uses the raw gyro for the true rate, fine to first order. 3 scalar updates, like the estimator
+        const float variance = 2.0f * (FIELD_DIRECTION_NOISE / dt) * (FIELD_DIRECTION_NOISE / dt) + FIELD_DRIFT_RATE * FIELD_DRIFT_RATE;
+        for (int axis = 0; axis < 3; axis++) {
+            std::array < float, 6 > h {};
+            float y = -rate_from_field[axis];
+            for (int k = 0; k < 3; k++) {
+                const float p = ((axis == k) ? 1.0f : 0.0f) - mid_field[axis] * mid_field[k];
+                h[k] = p;
+                h[k + 3] = p * gyro[k];
+                y += p * gyro[k];
+            }
+            float predicted = 0.0f;
+            for (int k = 0; k < 3; k++) predicted += h[k] * bias[k] + h[k + 3] * scale[k];
+            std::array < float, 6 > ph {};
+            float innovation_variance = variance;
+            for (int i = 0; i < 6; i++) {
+                for (int k = 0; k < 6; k++) ph[i] += covariance[i][k] * h[k];
+                innovation_variance += h[i] * ph[i];
+            }
+            const float innovation = y - predicted;
+            for (int i = 0; i < 3; i++) {
+                bias[i] += ph[i] / innovation_variance * innovation;
+                scale[i] += ph[i + 3] / innovation_variance * innovation;
+            }
+            for (int i = 0; i < 6; i++)
+                for (int j = 0; j < 6; j++) covariance[i][j] -= ph[i] * ph[j] / innovation_variance;
+        }
+        for (float & value: scale) value = std::min(std::max(value, -MAX_SCALE), MAX_SCALE);
+    }
+
+    void absorb_estimator_bias(AttitudeEstimator & estimator) {
+        //the estimator runs on corrected rates, so what it holds is the bias left over after us, in corrected units.
+        //raw = (1 + s)(w + b') + b, so b' moves over as (1 + s) b' and the estimator restarts its bias at 0
+        if (!estimator.initialized) return;
+        for (int i = 0; i < 3; i++) {
+            if (estimator.covariance[i + 3][i + 3] > ABSORB_BIAS_SIGMA * ABSORB_BIAS_SIGMA) return;
+        }
+        for (int i = 0; i < 3; i++) {
+            bias[i] += (1.0f + scale[i]) * estimator.gyro_bias[i];
+            estimator.gyro_bias[i] = 0.0f;
+            for (int j = 0; j < 6; j++) covariance[i][j] = covariance[j][i] = 0.0f;
+            covariance[i][i] = estimator.covariance[i + 3][i + 3];
+        }
+    }
+
+    NonVolatileMemory::GyroCalibrationRecord make_record(uint32_t time) const {
+        NonVolatileMemory::GyroCalibrationRecord record {};
+        record.bias = bias;
+        record.scale = scale;
+        for (int i = 0; i < 6; i++) record.covariance_diagonal[i] = covariance[i][i];
+        record.timestamp = time;
+        record.checksum = record.compute_checksum();
+        return record;
+    }
+
+    void restore(const NonVolatileMemory::GyroCalibrationRecord & record) {
+        //the gyro does not forget its bias over a reset, only the cross correlations are lost
+        reset();
+        bias = record.bias;
+        for (int i = 0; i < 3; i++) scale[i] = std::min(std::max(record.scale[i], -MAX_SCALE), MAX_SCALE);
+        for (int i = 0; i < 6; i++) covariance[i][i] = record.covariance_diagonal[i];
+    }
+
+    private:
+    void start_interval(const Vector3 & magnetic_field, uint32_t now) {
+        interval_field = magnetic_field;
+        interval_start = std::max < uint32_t > (now, 1);
+        gyro_sum = {};
+        gyro_samples = 0;
+    }
+
+    Vector3 interval_field {};
+    Vector3 gyro_sum {};
+    uint16_t gyro_samples = 0;
+    uint32_t interval_start = 0;
+};
+
+class MagnetometerCalibration {
+    //hard and soft iron: B = W (raw - h) with W symmetric. the corrected field has to have the magnitude the field
+    //model gives, (raw - h)^T A (raw - h) = |B_ref|^2 with A = W^T W, which is linear in
+    //theta = [A11 A22 A33 A12 A13 A23, -A h, h^T A h] for the regressor [x^2 y^2 z^2 2xy 2xz 2yz 2x 2y 2z 1].
+    //theta comes from recursive least squares, one sample at a time in constant memory(a 10x10 covariance). samples are
+    //only taken while tumbling and once the field has turned far enough in the body since the last one, so a spread of
+    //directions goes in. every SOLVE_PERIOD samples the fit is turned into W and h, and correct() applies them at read time
+    public:
+    static constexpr uint8_t PARAMETER_COUNT = 10;
+    static constexpr float FIELD_UNIT = 5.0e-5f; //T, the fit runs in these units so the squares stay near 1 in float
+    static constexpr float MIN_TUMBLE_RATE = 0.02f; //rad/s
+    static constexpr float MIN_SAMPLE_SEPARATION = 0.1f; //rad, field direction change between accepted samples
+    static constexpr float FORGETTING_FACTOR = 0.999f; //per accepted sample, so the fit follows slow changes(temperature, magnetized parts)
+    static constexpr float INITIAL_VARIANCE = 1.0f; //prior on theta around "no correction"
+    static constexpr float MEASUREMENT_VARIANCE = 1.0e-4f; //of |B|^2 in FIELD_UNIT^2, magnetometer noise plus field model error
+    static constexpr uint16_t MIN_SAMPLES = 200; //accepted samples before the first fit is applied
+    static constexpr uint16_t SOLVE_PERIOD = 50;
+    static constexpr float MAX_SOFT_IRON_DEVIATION = 0.3f; //W further than this from I is a bad fit, not a calibration
+    static constexpr float RESIDUAL_AVERAGE_WEIGHT = 0.01f; //exponential average for the residual statistics
+
+    Vector3 hard_iron {}; //T
+    std::array < Vector3, 3 > soft_iron { { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } } };
+    float residual_before_rms = 0.0f; //T, rms of |raw| - |B_ref|
+    float residual_after_rms = 0.0f; //T, rms of |corrected| - |B_ref|
+    uint16_t sample_count = 0;
+    uint16_t fit_count = 0;
+
+    MagnetometerCalibration() {
+        theta = { 1.0f, 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f }; //A = I, h = 0
+        for (uint8_t i = 0; i < PARAMETER_COUNT; i++) covariance[i][i] = INITIAL_VARIANCE;
+    }
+
+    Vector3 correct(const Vector3 & raw) const {
+        const Vector3 d { raw[0] - hard_iron[0], raw[1] - hard_iron[1], raw[2] - hard_iron[2] };
+        return { dot(soft_iron[0], d), dot(soft_iron[1], d), dot(soft_iron[2], d) };
+    }
+
+    void update(const Vector3 & raw, float reference_magnitude, const Vector3 & rate) {
+        if (reference_magnitude <= 0.0f || norm(raw) == 0.0f) return; //no field model yet, nothing to fit against
+        update_residuals(raw, reference_magnitude);
+        if (norm(rate) < MIN_TUMBLE_RATE) return;
+        const Vector3 x { raw[0] / FIELD_UNIT, raw[1] / FIELD_UNIT, raw[2] / FIELD_UNIT };
+        if (sample_count > 0 && std::atan2(norm(cross(x, last_sample)), dot(x, last_sample)) < MIN_SAMPLE_SEPARATION) return;
+        last_sample = x;
+
+        const std::array < float, PARAMETER_COUNT > phi { x[0] * x[0], x[1] * x[1], x[2] * x[2], 2.0f * x[0] * x[1], 2.0f * x[0] * x[2],
+            2.0f * x[1] * x[2], 2.0f * x[0], 2.0f * x[1], 2.0f * x[2], 1.0f };
+        const float y = (reference_magnitude / FIELD_UNIT) * (reference_magnitude / FIELD_UNIT);
+        std::array < float, PARAMETER_COUNT > p_phi {};
+        float denominator = FORGETTING_FACTOR * MEASUREMENT_VARIANCE;
+        float predicted = 0.0f;
+        for (uint8_t i = 0; i < PARAMETER_COUNT; i++) {
+            for (uint8_t k = 0; k < PARAMETER_COUNT; k++) p_phi[i] += covariance[i][k] * phi[k];
+            denominator += phi[i] * p_phi[i];
+            predicted += phi[i] * theta[i];
+        }
+        for (uint8_t i = 0; i < PARAMETER_COUNT; i++) theta[i] += p_phi[i] / denominator * (y - predicted);
+        //P = (P - P phi phi^T P / denominator) / lambda, the forgetting is skipped once P is back at the prior so that
+        //directions we are not seeing do not wind up
+        float trace = 0.0f;
+        for (uint8_t i = 0; i < PARAMETER_COUNT; i++) {
+            for (uint8_t j = 0; j < PARAMETER_COUNT; j++) covariance[i][j] -= p_phi[i] * p_phi[j] / denominator;
+            trace += covariance[i][i];
+        }
+        if (trace < PARAMETER_COUNT * INITIAL_VARIANCE) {
+            for (auto & row: covariance)
+                for (float & value: row) value /= FORGETTING_FACTOR;
+        }
+        if (sample_count < UINT16_MAX) sample_count++;
+        if (sample_count >= MIN_SAMPLES && sample_count % SOLVE_PERIOD == 0) solve();
+    }
+
+    NonVolatileMemory::MagnetometerCalibrationRecord make_record(uint32_t time) const {
+        NonVolatileMemory::MagnetometerCalibrationRecord record {};
+        record.hard_iron = hard_iron;
+        record.soft_iron = soft_iron;
+        record.timestamp = time;
+        record.checksum = record.compute_checksum();
+        return record;
+    }
+
+    void restore(const NonVolatileMemory::MagnetometerCalibrationRecord & record) {
+        //the fit itself starts over, the stored correction is used until it has enough samples to replace it
+        hard_iron = record.hard_iron;
+        soft_iron = record.soft_iron;
+    }
+
+    private:
+    void update_residuals(const Vector3 & raw, float reference_magnitude) {
+        const float before = norm(raw) - reference_magnitude;
+        const float after = norm(correct(raw)) - reference_magnitude;
+        before_mean_square += RESIDUAL_AVERAGE_WEIGHT * (before * before - before_mean_square);
+        after_mean_square += RESIDUAL_AVERAGE_WEIGHT * (after * after - after_mean_square);
+        residual_before_rms = std::sqrt(before_mean_square);
+        residual_after_rms = std::sqrt(after_mean_square);
+    }
+
+    void solve() {
+        //A from theta, h = -A^-1 (theta 7..9), W = sqrt(A) by the denman-beavers iteration(symmetric, so the correction
+        //does not add a rotation of its own). a fit that is not positive definite or is far from I is not applied
+        const float a[3][3] = {
+            { theta[0], theta[3], theta[4] },
+            { theta[3], theta[1], theta[5] },
+            { theta[4], theta[5], theta[2] }
+        };
+        if (!positive_definite(a)) return;
+        float a_inverse[3][3];
+        if (!invert_3x3(a, a_inverse)) return;
+        Vector3 h {};
+        for (int i = 0; i < 3; i++)
+            for (int k = 0; k < 3; k++) h[i] -= a_inverse[i][k] * theta[6 + k];
+
+        float y[3][3], z[3][3] = { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } };
+        std::memcpy(y, a, sizeof(y));
+        for (int iteration = 0; iteration < 8; iteration++) {
+            float y_inverse[3][3], z_inverse[3][3];
+            if (!invert_3x3(y, y_inverse) || !invert_3x3(z, z_inverse)) return;
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    y[i][j] = 0.5f * (y[i][j] + z_inverse[i][j]);
+                    z[i][j] = 0.5f * (z[i][j] + y_inverse[i][j]);
+                }
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                if (std::abs(y[i][j] - ((i == j) ? 1.0f : 0.0f)) > MAX_SOFT_IRON_DEVIATION) return;
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) soft_iron[i][j] = y[i][j];
+            hard_iron[i] = h[i] * FIELD_UNIT;
+        }
+        fit_count++;
+    }
+
+    static bool positive_definite(const float m[3][3]) {
+        //symmetric m, the three LDL^T(cholesky without the roots) pivots all positive. two leading minors are not enough,
+        //an A with a negative third pivot would fit a hyperboloid, and the square root below is then not a real one
+        const float d0 = m[0][0];
+        if (d0 <= 0.0f) return false;
+        const float l10 = m[1][0] / d0, l20 = m[2][0] / d0;
+        const float d1 = m[1][1] - l10 * m[1][0];
+        if (d1 <= 0.0f) return false;
+        const float l21 = (m[2][1] - l20 * m[1][0]) / d1;
+        return m[2][2] - l20 * m[2][0] - l21 * l21 * d1 > 0.0f;
+    }
+
+    static bool invert_3x3(const float m[3][3], float inverse[3][3]) { //adjugate over determinant, false if singular
+        const float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+            m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        if (std::abs(det) < 1.0e-9f) return false;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                const int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+                inverse[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+            }
+        }
+        return true;
+    }
+
+    std::array < float, PARAMETER_COUNT > theta {};
+    std::array < std::array < float, PARAMETER_COUNT > , PARAMETER_COUNT > covariance {};
+    Vector3 last_sample {};
+    float before_mean_square = 0.0f;
+    float after_mean_square = 0.0f;
+};
+
+struct VectorObservation { //one direction seen in the body frame and known in the inertial frame(sun, magnetic field)
+    Vector3 body;
+    Vector3 reference;
+    float weight; //1/sigma^2
+};
+
+class AttitudeSolver {
+    //single frame attitude determination(no history, no initial guess), used to start the MEKF and as a fallback when it
+    //cannot be trusted. TRIAD takes exactly 2 vectors and trusts the first one completely, QUEST and ESOQ2 solve wahba's
+    //problem over any number of weighted vectors. everything is done on the stack, there is no allocation
+    public:
+    enum class Method: uint8_t {
+        TRIAD,
+        QUEST,
+        ESOQ2
+    };
+
+    static constexpr uint8_t MAX_OBSERVATIONS = 4;
+    static constexpr float MIN_SEPARATION = 0.1f; //sin of the smallest angle between two vectors that still fixes the attitude
+    static constexpr int NEWTON_ITERATIONS = 4;
+
+    struct Solution {
+        Quaternion attitude;
+        bool valid; //false when the vectors are (nearly) parallel and the rotation about them is unknown
+    };
+
+    static Solution solve(Method method, const VectorObservation * observations, uint8_t count) {
+        if (count < 2) return { { 1.0f, 0.0f, 0.0f, 0.0f }, false };
+        switch (method) {
+        case Method::TRIAD:
+            return triad(observations[0], observations[1]);
+        case Method::QUEST:
+            return quest(observations, count);
+        case Method::ESOQ2:
+            return esoq2(observations, count);
+        }
+        return { { 1.0f, 0.0f, 0.0f, 0.0f }, false };
+    }
+
+    static Solution triad(const VectorObservation & primary, const VectorObservation & secondary) {
+        //orthonormal triads t1 = v1, t2 = v1 x v2, t3 = t1 x t2 built in both frames, the rotation is M = [t_ref][t_body]^T
+        Vector3 body_triad[3], reference_triad[3];
+        if (!make_triad(primary.body, secondary.body, body_triad) || !make_triad(primary.reference, secondary.reference, reference_triad)) {
+            return { { 1.0f, 0.0f, 0.0f, 0.0f }, false };
+        }
+        float m[3][3] = {};
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                for (int k = 0; k < 3; k++) m[i][j] += reference_triad[k][i] * body_triad[k][j];
+        return { quaternion_from_matrix(m), true };
+    }
+
+    static Solution quest(const VectorObservation * observations, uint8_t count) {
+        //shuster's QUEST: largest eigenvalue of the davenport K matrix by newton iteration on its characteristic equation,
+        //then the quaternion from the adjoint of ((lambda + sigma)I - S), which needs no matrix inverse
+        Profile p;
+        if (!make_profile(observations, count, true, p)) return { { 1.0f, 0.0f, 0.0f, 0.0f }, false };
+        const float lambda = max_eigenvalue(p);
+        const float alpha = lambda * lambda - p.sigma * p.sigma + p.kappa;
+        const float beta = lambda - p.sigma;
+        const float gamma = (lambda + p.sigma) * alpha - p.delta;
+        Vector3 x;
+        for (int i = 0; i < 3; i++) x[i] = alpha * p.z[i] + beta * p.sz[i] + p.s2z[i];
+        return { finish(p, { gamma, x[0], x[1], x[2] }), true };
+    }
+
+    static Solution esoq2(const VectorObservation * observations, uint8_t count) {
+        //mortari's ESOQ2: with q = [cos(phi/2), e sin(phi/2)] the eigen problem becomes M e = 0,
+        //M = (lambda - sigma)(S - (lambda + sigma)I) + z z^T, so the axis e is the largest cross product of two rows of M.
+        //M goes to 0 as phi goes to 0(not 180 deg like QUEST), so here the sequential rotation goes for the smallest trace
+        Profile p;
+        if (!make_profile(observations, count, false, p)) return { { 1.0f, 0.0f, 0.0f, 0.0f }, false };
+        const float lambda = max_eigenvalue(p);
+        const float beta = lambda - p.sigma;
+        Vector3 rows[3];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) rows[i][j] = beta * (p.s[i][j] - ((i == j) ? lambda + p.sigma : 0.0f)) + p.z[i] * p.z[j];
+        Vector3 axis = cross(rows[0], rows[1]);
+        const Vector3 axis_b = cross(rows[1], rows[2]);
+        const Vector3 axis_c = cross(rows[2], rows[0]);
+        if (dot(axis_b, axis_b) > dot(axis, axis)) axis = axis_b;
+        if (dot(axis_c, axis_c) > dot(axis, axis)) axis = axis_c;
+        //sin(phi/2) : cos(phi/2) = (lambda - sigma) : z.e
+        return { finish(p, { dot(p.z, axis), beta * axis[0], beta * axis[1], beta * axis[2] }), true };
+    }
+
+    private:
+    struct Profile {
+        //attitude profile matrix B = sum(w b r^T) and the pieces of K derived from it, after the sequential rotation
+        float s[3][3]; //B + B^T
+        Vector3 z; //sum(w b x r)
+        Vector3 sz; //S z
+        Vector3 s2z; //S^2 z
+        float sigma; //trace B
+        float kappa; //trace of adj S
+        float delta; //det S
+        int rotation_axis; //-1 for none, else the reference frame was turned 180 deg about this axis
+    };
+
+    static bool make_triad(const Vector3 & v1, const Vector3 & v2, Vector3 triad[3]) {
+        const float n1 = norm(v1);
+        Vector3 t2 = cross(v1, v2);
+        const float n2 = norm(t2);
+        if (n1 < 1.0e-6f || n2 < MIN_SEPARATION * n1 * norm(v2)) return false;
+        triad[0] = { v1[0] / n1, v1[1] / n1, v1[2] / n1 };
+        triad[1] = { t2[0] / n2, t2[1] / n2, t2[2] / n2 };
+        triad[2] = cross(triad[0], triad[1]);
+        return true;
+    }
+
+    static bool make_profile(const VectorObservation * observations, uint8_t count, bool largest_trace, Profile & p) {
+        float b[3][3] = {};
+        float weight_sum = 0.0f;
+        Vector3 first_body {};
+        bool separated = false;
+        for (uint8_t k = 0; k < count; k++) {
+            const float nb = norm(observations[k].body);
+            const float nr = norm(observations[k].reference);
+            if (nb < 1.0e-6f || nr < 1.0e-6f) continue;
+            const Vector3 & body = observations[k].body;
+            const Vector3 & reference = observations[k].reference;
+            const float w = observations[k].weight / (nb * nr);
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++) b[i][j] += w * body[i] * reference[j];
+            weight_sum += observations[k].weight;
+            if (norm(first_body) == 0.0f) first_body = { body[0] / nb, body[1] / nb, body[2] / nb };
+            else if (norm(cross(first_body, body)) > MIN_SEPARATION * nb) separated = true;
+        }
+        if (!separated) return false;
+        //weights scaled to add up to 1, with 1/sigma^2 weights lambda^4 would be far outside what a float can subtract
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) b[i][j] /= weight_sum;
+
+        //method of sequential rotations: each method has a rotation angle where it falls apart, so the reference frame is
+        //turned 180 deg about whichever axis keeps the trace(1 + 2cos(phi) times the weights) furthest from it.
+        //turning about axis i flips the other two columns of B, and the solution is rotated back in finish()
+        p.rotation_axis = -1;
+        float best_trace = b[0][0] + b[1][1] + b[2][2];
+        for (int axis = 0; axis < 3; axis++) {
+            const float trace = 2.0f * b[axis][axis] - (b[0][0] + b[1][1] + b[2][2]);
+            if ((trace > best_trace) == largest_trace && trace != best_trace) {
+                best_trace = trace;
+                p.rotation_axis = axis;
+            }
+        }
+        if (p.rotation_axis >= 0) {
+            for (int j = 0; j < 3; j++) {
+                if (j == p.rotation_axis) continue;
+                for (int i = 0; i < 3; i++) b[i][j] = -b[i][j];
+            }
+        }
+
+        p.sigma = best_trace;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++) p.s[i][j] = b[i][j] + b[j][i];
+        p.z = { b[1][2] - b[2][1], b[2][0] - b[0][2], b[0][1] - b[1][0] };
+        for (int i = 0; i < 3; i++) p.sz[i] = p.s[i][0] * p.z[0] + p.s[i][1] * p.z[1] + p.s[i][2] * p.z[2];
+        for (int i = 0; i < 3; i++) p.s2z[i] = p.s[i][0] * p.sz[0] + p.s[i][1] * p.sz[1] + p.s[i][2] * p.sz[2];
+        p.kappa = (p.s[1][1] * p.s[2][2] - p.s[1][2] * p.s[2][1]) + (p.s[0][0] * p.s[2][2] - p.s[0][2] * p.s[2][0]) +
+            (p.s[0][0] * p.s[1][1] - p.s[0][1] * p.s[1][0]);
+        p.delta = p.s[0][0] * (p.s[1][1] * p.s[2][2] - p.s[1][2] * p.s[2][1]) - p.s[0][1] * (p.s[1][0] * p.s[2][2] - p.s[1][2] * p.s[2][0]) +
+            p.s[0][2] * (p.s[1][0] * p.s[2][1] - p.s[1][1] * p.s[2][0]);
+        return true;
+    }
+
+    static float max_eigenvalue(const Profile & p) {
+        //lambda^4 - (a + b) lambda^2 - c lambda + (a b + c sigma - d) = 0, started from the sum of the weights(1, the answer
+        //when every vector fits perfectly) so a few newton steps are plenty. this is done in double: the quaternion
+        //formulas need lambda to agree with the float K to well below float precision when the weights are very different
+        //(sun sensor vs magnetometer), in float QUEST was off by several degrees there. it is a handful of soft float ops
+        const double a = static_cast < double > (p.sigma) * p.sigma - p.kappa;
+        const double b = static_cast < double > (p.sigma) * p.sigma + dot(p.z, p.z);
+        const double c = static_cast < double > (p.delta) + dot(p.z, p.sz);
+        const double d = dot(p.z, p.s2z);
+        const double constant = a * b + c * static_cast < double > (p.sigma) - d;
+        double lambda = 1.0;
+        for (int i = 0; i < NEWTON_ITERATIONS; i++) {
+            const double lambda2 = lambda * lambda;
+            const double f = lambda2 * lambda2 - (a + b) * lambda2 - c * lambda + constant;
+            const double df = 4.0 * lambda2 * lambda - 2.0 * (a + b) * lambda - c;
+            if (std::abs(df) < 1.0e-12) break;
+            lambda -= f / df;
+        }
+        return static_cast < float > (lambda);
+    }
+
+    static Quaternion finish(const Profile & p, const Quaternion & unnormalized) {
+        //the eigenvector is for K built the body <- reference way round with the vector part first, which is the same
+        //numbers as our scalar first body -> inertial quaternion. then undo the sequential rotation: q = q_axis * q'
+        Quaternion q = quaternion_normalize(unnormalized);
+        if (p.rotation_axis >= 0) {
+            Quaternion turn { 0.0f, 0.0f, 0.0f, 0.0f };
+            turn[p.rotation_axis + 1] = 1.0f;
+            q = quaternion_normalize(quaternion_multiply(turn, q));
+        }
+        return q;
+    }
+
+    static Quaternion quaternion_from_matrix(const float m[3][3]) {
+        //shepperd's method, picks the largest of the 4 components to divide by
+        const float trace = m[0][0] + m[1][1] + m[2][2];
+        Quaternion q;
+        if (trace >= m[0][0] && trace >= m[1][1] && trace >= m[2][2]) {
+            const float s = 2.0f * std::sqrt(1.0f + trace);
+            q = { 0.25f * s, (m[2][1] - m[1][2]) / s, (m[0][2] - m[2][0]) / s, (m[1][0] - m[0][1]) / s };
+        } else if (m[0][0] >= m[1][1] && m[0][0] >= m[2][2]) {
+            const float s = 2.0f * std::sqrt(1.0f + m[0][0] - m[1][1] - m[2][2]);
+            q = { (m[2][1] - m[1][2]) / s, 0.25f * s, (m[0][1] + m[1][0]) / s, (m[0][2] + m[2][0]) / s };
+        } else if (m[1][1] >= m[2][2]) {
+            const float s = 2.0f * std::sqrt(1.0f + m[1][1] - m[0][0] - m[2][2]);
+            q = { (m[0][2] - m[2][0]) / s, (m[0][1] + m[1][0]) / s, 0.25f * s, (m[1][2] + m[2][1]) / s };
+        } else {
+            const float s = 2.0f * std::sqrt(1.0f + m[2][2] - m[0][0] - m[1][1]);
+            q = { (m[1][0] - m[0][1]) / s, (m[0][2] + m[2][0]) / s, (m[1][2] + m[2][1]) / s, 0.25f * s };
+        }
+        return quaternion_normalize(q);
+    }
+};
+
+#if defined(ADCS_HOST_BUILD) || defined(ADCS_BENCHMARK)
+struct AttitudeSolverBenchmark {
+    //cycles per solve for each method over the same random sun/field pairs, plus the worst error against the truth.
+    //built into the flight image with -DADCS_BENCHMARK to get the cortex-M numbers(DWT cycle counter), on the host
+    //read_cycle_counter gives nanoseconds instead
+    struct Result {
+        uint32_t average_cycles;
+        uint32_t max_cycles;
+        float max_error_deg;
+    };
+
+    static std::array < Result, 3 > run(uint16_t iterations, uint8_t vector_count = 2) {
+        std::array < Result, 3 > results {};
+        uint32_t seed = 12345u;
+        auto random = [ & seed]() { //xorshift, in [-1, 1]
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return static_cast < float > (seed) / 2147483648.0f - 1.0f;
+        };
+        std::array < uint64_t, 3 > total {};
+        for (uint16_t n = 0; n < iterations; n++) {
+            const Quaternion truth = quaternion_normalize(Quaternion { random(), random(), random(), random() });
+            VectorObservation observations[AttitudeSolver::MAX_OBSERVATIONS];
+            const uint8_t count = std::min(vector_count, AttitudeSolver::MAX_OBSERVATIONS);
+            for (uint8_t k = 0; k < count; k++) {
+                Vector3 reference { random(), random(), random() };
+                while (k > 0 && norm(cross(reference, observations[0].reference)) < 0.5f * norm(reference) * norm(observations[0].reference)) {
+                    reference = { random(), random(), random() }; //at least 30 deg from the first vector
+                }
+                const Vector3 body = rotate_to_body(truth, reference);
+                const float noise = (k == 0) ? 0.002f : 0.01f; //a sun sensor and a magnetometer
+                observations[k] = { { body[0] + noise * random(), body[1] + noise * random(), body[2] + noise * random() },
+                    reference, 1.0f / (noise * noise) };
+            }
+            for (uint8_t m = 0; m < 3; m++) {
+                const uint32_t start = read_cycle_counter();
+                const AttitudeSolver::Solution solution = AttitudeSolver::solve(static_cast < AttitudeSolver::Method > (m), observations, count);
+                const uint32_t cycles = read_cycle_counter() - start;
+                total[m] += cycles;
+                results[m].max_cycles = std::max(results[m].max_cycles, cycles);
+                if (!solution.valid) continue;
+                const float cos_half = std::abs(solution.attitude[0] * truth[0] + solution.attitude[1] * truth[1] +
+                    solution.attitude[2] * truth[2] + solution.attitude[3] * truth[3]);
+                results[m].max_error_deg = std::max(results[m].max_error_deg, 2.0f * std::acos(std::min(cos_half, 1.0f)) * 57.29578f);
+            }
+        }
+        for (uint8_t m = 0; m < 3; m++) results[m].average_cycles = static_cast < uint32_t > (total[m] / std::max < uint16_t > (iterations, 1));
+        return results;
+    }
+};
+#endif
+
+class MagnetorquerAllocator {
+    //turns a torque request into coil currents. only the part of the torque perpendicular to B can be made, m = (B x torque)/|B|^2
+    //gives exactly that. the currents are then scaled down together(so the dipole keeps its direction) until every coil is
+    //inside its current limit and the total coil power fits in the budget the EPS can spare above the LOW_POWER threshold
+    public:
+    static constexpr Vector3 DIPOLE_PER_AMP { 2.0f, 2.0f, 2.0f }; //Am^2 per A, turns x area of each coil
+    static constexpr Vector3 MAX_CURRENT { 0.1f, 0.1f, 0.1f }; //A
+    static constexpr Vector3 COIL_RESISTANCE { 30.0f, 30.0f, 30.0f }; //ohm
+    static constexpr float POWER_MARGIN = 0.5f; //W kept between us and the LOW_POWER threshold
+    static constexpr float SAFE_MODE_POWER_LIMIT = 0.1f; //W, after power_system_slowdown only a little damping is allowed
+
+    struct Allocation {
+        Vector3 currents; //A
+        Vector3 dipole; //Am^2 actually produced
+        float power; //W
+        float scale; //1 if nothing was limited
+    };
+
+    bool power_saving = false; //set by power_system_slowdown
+    float last_power = 0.0f; //W drawn by the coils after the last allocation
+
+    static Vector3 dipole_for_torque(const Vector3 & torque, const Vector3 & magnetic_field) {
+        //m x B = torque - (torque.b)b, the part along B is lost
+        const float b_squared = dot(magnetic_field, magnetic_field);
+        if (b_squared <= 0.0f) return {};
+        const Vector3 m = cross(magnetic_field, torque);
+        return { m[0] / b_squared, m[1] / b_squared, m[2] / b_squared };
+    }
+
+    float power_budget(float power_level) const {
+        //power_level is measured with the coils already drawing last_power, so that is added back to get what they may use
+        float budget = power_level + last_power - FaultManager::LOW_POWER_THRESHOLD - POWER_MARGIN;
+        if (power_saving) budget = std::min(budget, SAFE_MODE_POWER_LIMIT);
+        return std::max(budget, 0.0f);
+    }
+
+    Allocation allocate(const Vector3 & dipole, float power_budget_w) {
+        Allocation allocation {};
+        float scale = 1.0f;
+        for (int i = 0; i < 3; i++) {
+            allocation.currents[i] = dipole[i] / DIPOLE_PER_AMP[i];
+            const float magnitude = std::abs(allocation.currents[i]);
+            if (magnitude > MAX_CURRENT[i]) scale = std::min(scale, MAX_CURRENT[i] / magnitude);
+        }
+        float power = 0.0f;
+        for (int i = 0; i < 3; i++) power += scale * scale * allocation.currents[i] * allocation.currents[i] * COIL_RESISTANCE[i];
+        if (power > power_budget_w) { //power goes with the square of the current
+            const float power_scale = (power_budget_w > 0.0f) ? std::sqrt(power_budget_w / power) : 0.0f;
+            scale *= power_scale;
+            power = power_budget_w > 0.0f ? power_budget_w : 0.0f;
+        }
+        for (int i = 0; i < 3; i++) {
+            allocation.currents[i] *= scale;
+            allocation.dipole[i] = allocation.currents[i] * DIPOLE_PER_AMP[i];
+        }
+        allocation.power = power;
+        allocation.scale = scale;
+        last_power = power;
+        return allocation;
+    }
+};
+
+class ReactionWheelArray {
+    //three orthogonal wheels plus an optional fourth one skewed along (1,1,1). a body torque request is shared out with the
+    //pseudo inverse of the spin axis matrix W(3 x n), W+ = W^T (W W^T)^-1, which for 4 wheels is the minimum wheel torque
+    //solution. W+ is worked out again whenever a wheel is switched off, so any 3 working wheels still give full control.
+    //the wheels soak up momentum from the disturbances, momentum_dump_dipole bleeds it off with the magnetorquers
+    public:
+    static constexpr uint8_t WHEEL_COUNT = 4;
+    static constexpr float WHEEL_INERTIA = 1.5e-5f; //kg m^2
+    static constexpr float MAX_TORQUE = 1.0e-3f; //Nm per wheel
+    static constexpr float MAX_SPEED = 628.0f; //rad/s(6000 rpm)
+    static constexpr float DUMP_GAIN = 1.0e-3f; //1/s, torque = -DUMP_GAIN * stored momentum
+    static constexpr float DUMP_START_FRACTION = 0.3f; //dumping starts when a wheel is past this fraction of MAX_SPEED
+
+    std::array < Vector3, WHEEL_COUNT > spin_axes { {
+        { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.57735027f, 0.57735027f, 0.57735027f }
+    } };
+    std::array < bool, WHEEL_COUNT > enabled { true, true, true, true };
+    std::array < float, WHEEL_COUNT > speeds {}; //rad/s, from the wheel drivers
+    std::array < float, WHEEL_COUNT > torque_commands {}; //Nm, to the wheel drivers(positive spins the wheel up)
+    bool dumping = false;
+
+    ReactionWheelArray() {
+        compute_pseudo_inverse();
+    }
+
+    void set_enabled(uint8_t wheel, bool on) { //a wheel that fails(or is switched off to save power) drops out of the allocation
+        enabled[wheel] = on;
+        compute_pseudo_inverse();
+    }
+
+    bool available() const {
+        return allocation_valid;
+    }
+
+    Vector3 momentum() const { //stored in the wheels, body frame
+        Vector3 h {};
+        for (uint8_t k = 0; k < WHEEL_COUNT; k++)
+            for (int i = 0; i < 3; i++) h[i] += enabled[k] ? spin_axes[k][i] * WHEEL_INERTIA * speeds[k] : 0.0f;
+        return h;
+    }
+
+    void command_torque(const Vector3 & body_torque) {
+        //the body feels minus the wheel torque, so the wheels get -W+ torque, scaled together to stay inside the limits
+        float scale = 1.0f;
+        for (uint8_t k = 0; k < WHEEL_COUNT; k++) {
+            float t = 0.0f;
+            for (int i = 0; i < 3; i++) t -= pseudo_inverse[k][i] * body_torque[i];
+            torque_commands[k] = enabled[k] ? t : 0.0f;
+            if (std::abs(torque_commands[k]) > MAX_TORQUE) scale = std::min(scale, MAX_TORQUE / std::abs(torque_commands[k]));
+        }
+        for (uint8_t k = 0; k < WHEEL_COUNT; k++) {
+            torque_commands[k] *= scale;
+            //a wheel at its speed limit cannot spin up any further
+            if (std::abs(speeds[k]) >= MAX_SPEED && torque_commands[k] * speeds[k] > 0.0f) torque_commands[k] = 0.0f;
+        }
+    }
+
+    Vector3 momentum_dump_dipole(const Vector3 & magnetic_field) {
+        //hysteresis: start past DUMP_START_FRACTION, stop at half of it
+        float fastest = 0.0f;
+        for (uint8_t k = 0; k < WHEEL_COUNT; k++)
+            if (enabled[k]) fastest = std::max(fastest, std::abs(speeds[k]));
+        if (fastest > DUMP_START_FRACTION * MAX_SPEED) dumping = true;
+        else if (fastest < 0.5f * DUMP_START_FRACTION * MAX_SPEED) dumping = false;
+        if (!dumping) return {};
+        const Vector3 h = momentum();
+        return MagnetorquerAllocator::dipole_for_torque({ -DUMP_GAIN * h[0], -DUMP_GAIN * h[1], -DUMP_GAIN * h[2] }, magnetic_field);
+    }
+
+    private: std::array < Vector3, WHEEL_COUNT > pseudo_inverse {};
+    bool allocation_valid = false;
+
+    void compute_pseudo_inverse() {
+        float wwt[3][3] = {};
+        for (uint8_t k = 0; k < WHEEL_COUNT; k++) {
+            if (!enabled[k]) continue;
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++) wwt[i][j] += spin_axes[k][i] * spin_axes[k][j];
+        }
+        const float det = wwt[0][0] * (wwt[1][1] * wwt[2][2] - wwt[1][2] * wwt[2][1]) - wwt[0][1] * (wwt[1][0] * wwt[2][2] - wwt[1][2] * wwt[2][0]) +
+            wwt[0][2] * (wwt[1][0] * wwt[2][1] - wwt[1][1] * wwt[2][0]);
+        pseudo_inverse = {};
+        allocation_valid = std::abs(det) > 1.0e-3f; //fewer than 3 independent wheels left
+        if (!allocation_valid) return;
+        float inverse[3][3];
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 3; j++) { //cofactor of (j, i) over det
+                const int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+                inverse[i][j] = (wwt[r0][c0] * wwt[r1][c1] - wwt[r0][c1] * wwt[r1][c0]) / det;
+            }
+        }
+        for (uint8_t k = 0; k < WHEEL_COUNT; k++) {
+            if (!enabled[k]) continue;
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++) pseudo_inverse[k][i] += spin_axes[k][j] * inverse[j][i];
+        }
+    }
+};
+
+class PointingController {
+    //quaternion feedback PD law with rate feedforward for NOMINAL_POINTING:
+    //  torque = -Kp * q_err_vector - Kd * (w - w_target) + w x (J w)
+    //where q_err is the body attitude relative to the target(shortest way round). the torque goes out as a magnetorquer
+    //dipole(only the part perpendicular to B can be made) and, when reaction wheels are fitted, as a wheel torque command
+    public: enum class SubMode: uint8_t {
+        COARSE, //big errors, low stiffness so the torquers are not saturated all the time
+        FINE, //payload pointing
+        TRACKING, //target moving(ground station, nadir), relies on the rate feedforward
+        WHEEL, //reaction wheels make the torque, the torquers only dump momentum
+        COUNT
+    };
+
+    struct Gains {
+        float kp; //Nm per unit quaternion error
+        float kd; //Nm per rad/s
+    };
+
+    struct Command {
+        Vector3 torque; //Nm, body frame
+        Vector3 dipole; //Am^2, body frame
+    };
+
+    struct PointingStats { //closed loop pointing error, reset on every sub mode change so each tuning run starts clean
+        float last_error_deg = 0.0f;
+        float max_error_deg = 0.0f;
+        float mean_square_error_deg2 = 0.0f;
+        uint32_t samples = 0;
+        uint32_t start_time = 0;
+        uint32_t settled_since = 0; //0 while the error is above the settle threshold
+        uint32_t settling_time_ms = 0; //0 until the error has stayed inside the threshold for SETTLE_HOLD_MS
+    };
+
+    static constexpr Vector3 INERTIA { 0.035f, 0.035f, 0.008f }; //kg m^2, principal axes of the 3U bus
+    static constexpr float SETTLE_THRESHOLD_DEG = 2.0f;
+    static constexpr uint32_t SETTLE_HOLD_MS = 60000;
+    static constexpr float FIXED_TORQUE_SCALE = 1.0e5f;
+#ifdef ADCS_FIXED_POINT_CONTROL
+    using ControlScalar = Q31; //boards without an FPU. ~100x closer to the float law than Q16.16(ScalarPrecisionBenchmark)
+#else
+    using ControlScalar = float;
+#endif
+
+    //magnetorquer only gains have to stay low(the torque about B is missing, stiffer loops pump energy into that axis),
+    //tuned in the host simulator: COARSE settles a 30 deg error in ~12000s, FINE in ~9500s
+    std::array < Gains, static_cast < uint8_t > (SubMode::COUNT) > gains { {
+        { 5.0e-8f, 5.0e-5f }, //COARSE
+        { 2.0e-7f, 2.0e-4f }, //FINE
+        { 2.0e-7f, 2.0e-4f }, //TRACKING
+        { 7.0e-4f, 6.3e-3f } //WHEEL, full 3 axis torque: 0.1 rad/s bandwidth, 0.9 damping
+    } };
+    Quaternion target_attitude { 1.0f, 0.0f, 0.0f, 0.0f }; //inertial to target frame, same convention as the estimator
+    Vector3 target_rate {}; //rad/s, target frame, feedforward for a moving target
+    PointingStats stats {};
+
+    void set_sub_mode(SubMode mode, uint32_t now) {
+        sub_mode = mode;
+        stats = {};
+        stats.start_time = now;
+    }
+
+    SubMode get_sub_mode() const {
+        return sub_mode;
+    }
+
+    Command compute(const Quaternion & attitude, const Vector3 & rate, const Vector3 & magnetic_field, uint32_t now, const Vector3 & wheel_momentum = {}) {
+        Quaternion error = quaternion_multiply({ target_attitude[0], -target_attitude[1], -target_attitude[2], -target_attitude[3] }, attitude);
+        error = quaternion_normalize(error); //also picks the short way round(positive scalar part)
+        const Vector3 rate_feedforward = rotate_to_body(error, target_rate); //target rate seen from the body
+        const Vector3 rate_error { rate[0] - rate_feedforward[0], rate[1] - rate_feedforward[1], rate[2] - rate_feedforward[2] };
+        update_stats(error, now);
+
+        Command command {};
+        const Gains & g = gains[static_cast < uint8_t > (sub_mode)];
+        command.torque = pd_law < ControlScalar > (error, rate_error, rate, wheel_momentum, g);
+        command.dipole = MagnetorquerAllocator::dipole_for_torque(command.torque, magnetic_field);
+        return command;
+    }
+
+    template < typename Scalar >
+    static constexpr float torque_scale() {
+        //torques are ~1e-6 Nm, far below Q16.16 resolution, so in Q16.16 the law runs in units of 1e-5 Nm(gains and inertia
+        //scaled by 1e5, which keeps the inertia below the 32767 Q16.16 limit). Q31 resolves 5e-10 Nm as it is
+        return std::is_same_v < Scalar, FixedQ16 > ? FIXED_TORQUE_SCALE : 1.0f;
+    }
+
+    template < typename Scalar >
+    static Vector3 pd_law(const Quaternion & error, const Vector3 & rate_error, const Vector3 & rate, const Vector3 & wheel_momentum, const Gains & g) {
+        using Traits = ScalarTraits < Scalar > ;
+        constexpr float scale = torque_scale < Scalar > ();
+        const Scalar kp = Traits::from_float(g.kp * scale);
+        const Scalar kd = Traits::from_float(g.kd * scale);
+        Vector3Of < Scalar > w, h;
+        for (int i = 0; i < 3; i++) {
+            w[i] = Traits::from_float(rate[i]);
+            h[i] = Traits::from_float(INERTIA[i] * scale) * w[i] + Traits::from_float(wheel_momentum[i] * scale);
+        }
+        const Vector3Of < Scalar > gyroscopic = cross(w, h);
+        Vector3 torque;
+        for (int i = 0; i < 3; i++) {
+            const Scalar t = gyroscopic[i] - kp * Traits::from_float(error[i + 1]) - kd * Traits::from_float(rate_error[i]);
+            torque[i] = Traits::to_float(t) / scale;
+        }
+        return torque;
+    }
+
+    private: SubMode sub_mode = SubMode::COARSE;
+
+    void update_stats(const Quaternion & error, uint32_t now) {
+        const float vector_norm = std::sqrt(error[1] * error[1] + error[2] * error[2] + error[3] * error[3]);
+        const float error_deg = 2.0f * std::asin(std::min(vector_norm, 1.0f)) * 57.2957795f;
+        stats.last_error_deg = error_deg;
+        stats.max_error_deg = std::max(stats.max_error_deg, error_deg);
+        stats.samples++;
+        stats.mean_square_error_deg2 += (error_deg * error_deg - stats.mean_square_error_deg2) / static_cast < float > (stats.samples);
+        if (error_deg > SETTLE_THRESHOLD_DEG) {
+            stats.settled_since = 0;
+        } else if (stats.settled_since == 0) {
+            stats.settled_since = now;
+        } else if (stats.settling_time_ms == 0 && now - stats.settled_since >= SETTLE_HOLD_MS) {
+            stats.settling_time_ms = stats.settled_since - stats.start_time;
+        }
+    }
+};
+
+#if defined(ADCS_HOST_BUILD) || defined(ADCS_BENCHMARK)
+struct ScalarPrecisionBenchmark {
+    //the scalar generic code in every format against the same code in double:
+    //- attitude kinematics(propagate_attitude) through a slow tumble, attitude error after all the steps
+    //- rotate_to_body of random unit vectors, worst direction error
+    //- the pointing PD law over random errors and rates with every sub mode gain set, worst torque error as a fraction
+    //  of the torque
+    //- and the whole MEKF in float and double against the simulated truth(there is no fixed point filter)
+    //same cycle counter caveat as AttitudeSolverBenchmark: DWT cycles with -DADCS_BENCHMARK, nanoseconds on the host
+    enum class Format: uint8_t {
+        FLOAT,
+        DOUBLE,
+        Q31,
+        Q16_16,
+        Q15,
+        COUNT
+    };
+    struct Result {
+        float kinematics_error_deg;
+        float rotation_error_deg;
+        float torque_error; //fraction
+        uint32_t kinematics_cycles; //per propagate_attitude
+        uint32_t control_cycles; //per pd_law
+    };
+    struct EstimatorResult {
+        float float_error_deg; //last attitude against the truth
+        float double_error_deg;
+        uint32_t float_cycles; //per propagate and 2 vector updates
+        uint32_t double_cycles;
+    };
+    static constexpr float DT = 0.1f; //s, gyro sample period
+    static constexpr float RATE = 0.05f; //rad/s, peak tumble rate(NOMINAL_POINTING rates are well below)
+
+    static std::array < Result, static_cast < uint8_t > (Format::COUNT) > run(uint16_t iterations) {
+        std::array < Result, static_cast < uint8_t > (Format::COUNT) > results {};
+        results[static_cast < uint8_t > (Format::FLOAT)] = run_format < float > (iterations);
+        results[static_cast < uint8_t > (Format::DOUBLE)] = run_format < double > (iterations);
+        results[static_cast < uint8_t > (Format::Q31)] = run_format < Q31 > (iterations);
+        results[static_cast < uint8_t > (Format::Q16_16)] = run_format < FixedQ16 > (iterations);
+        results[static_cast < uint8_t > (Format::Q15)] = run_format < Q15 > (iterations);
+        return results;
+    }
+
+    static EstimatorResult run_estimator(uint16_t iterations) {
+        EstimatorResult result {};
+        uint64_t cycles = 0;
+        result.float_error_deg = estimator_error < float > (iterations, cycles);
+        result.float_cycles = static_cast < uint32_t > (cycles / std::max < uint16_t > (iterations, 1));
+        result.double_error_deg = estimator_error < double > (iterations, cycles);
+        result.double_cycles = static_cast < uint32_t > (cycles / std::max < uint16_t > (iterations, 1));
+        return result;
+    }
+
+    private: template < typename Scalar >
+    static Scalar to_scalar(double value) {
+        if constexpr(std::is_floating_point_v < Scalar > ) return static_cast < Scalar > (value);
+        else return ScalarTraits < Scalar > ::from_float(static_cast < float > (value));
+    }
+
+    template < typename Scalar >
+    static double to_double(Scalar value) {
+        if constexpr(std::is_floating_point_v < Scalar > ) return static_cast < double > (value);
+        else return static_cast < double > (value.raw) / static_cast < double > (Scalar::ONE);
+    }
+
+    template < typename Scalar, size_t N >
+    static std::array < Scalar, N > convert(const std::array < double, N > & value) {
+        std::array < Scalar, N > result;
+        for (size_t i = 0; i < N; i++) result[i] = to_scalar < Scalar > (value[i]);
+        return result;
+    }
+
+    template < typename Scalar, size_t N >
+    static std::array < double, N > convert_back(const std::array < Scalar, N > & value) {
+        std::array < double, N > result;
+        for (size_t i = 0; i < N; i++) result[i] = to_double(value[i]);
+        return result;
+    }
+
+    static double angle_deg(const QuaternionOf < double > & a, const QuaternionOf < double > & b) {
+        //from the vector part of a* b rather than acos of the dot product, which bottoms out at ~1e-6 deg
+        const QuaternionOf < double > difference = quaternion_multiply(QuaternionOf < double > { a[0], -a[1], -a[2], -a[3] }, b);
+        const double vector_norm = norm(Vector3Of < double > { difference[1], difference[2], difference[3] });
+        return 2.0 * std::atan2(vector_norm, std::abs(difference[0])) * 57.29577951;
+    }
+
+    static Vector3Of < double > tumble_rate(uint16_t step) {
+        return { RATE * std::sin(0.01 * step), 0.6 * RATE * std::cos(0.013 * step), 0.4 * RATE };
+    }
+
+    template < typename Scalar >
+    static Result run_format(uint16_t iterations) {
+        Result result {};
+        uint32_t seed = 24680u;
+        auto random = [ & seed]() { //xorshift, in [-1, 1]
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return static_cast < double > (seed) / 2147483648.0 - 1.0;
+        };
+        const uint16_t count = std::max < uint16_t > (iterations, 1);
+
+        QuaternionOf < double > reference { 1.0, 0.0, 0.0, 0.0 };
+        QuaternionOf < Scalar > attitude = convert < Scalar > (reference);
+        const Scalar dt = to_scalar < Scalar > (DT);
+        uint64_t total = 0;
+        for (uint16_t k = 0; k < count; k++) {
+            const Vector3Of < double > rate = tumble_rate(k);
+            reference = propagate_attitude(reference, rate, static_cast < double > (DT));
+            const Vector3Of < Scalar > w = convert < Scalar > (rate);
+            const uint32_t start = read_cycle_counter();
+            attitude = propagate_attitude(attitude, w, dt);
+            total += read_cycle_counter() - start;
+        }
+        result.kinematics_error_deg = static_cast < float > (angle_deg(convert_back(attitude), reference));
+        result.kinematics_cycles = static_cast < uint32_t > (total / count);
+
+        for (uint16_t k = 0; k < count; k++) {
+            const QuaternionOf < double > q = quaternion_normalize(QuaternionOf < double > { random(), random(), random(), random() });
+            Vector3Of < double > v { random(), random(), random() };
+            const double length = norm(v);
+            for (double & value: v) value /= length;
+            const Vector3Of < double > truth = rotate_to_body(q, v);
+            const Vector3Of < double > body = convert_back(rotate_to_body(convert < Scalar > (q), convert < Scalar > (v)));
+            const double angle = std::atan2(norm(cross(truth, body)), dot(truth, body));
+            result.rotation_error_deg = std::max(result.rotation_error_deg, static_cast < float > (angle * 57.29577951));
+        }
+
+        const PointingController controller;
+        total = 0;
+        for (uint16_t k = 0; k < count; k++) {
+            const Quaternion error = quaternion_normalize(Quaternion { 1.0f, 0.25f * static_cast < float > (random()), 0.25f * static_cast < float > (random()),
+                0.25f * static_cast < float > (random()) });
+            const Vector3 rate { RATE * static_cast < float > (random()), RATE * static_cast < float > (random()), RATE * static_cast < float > (random()) };
+            const Vector3 rate_error { 0.5f * rate[0], 0.5f * rate[1], 0.5f * rate[2] };
+            const Vector3 wheel_momentum { 0.01f * static_cast < float > (random()), 0.01f * static_cast < float > (random()), 0.01f * static_cast < float > (random()) };
+            for (const PointingController::Gains & gains: controller.gains) {
+                const Vector3 truth = PointingController::pd_law < double > (error, rate_error, rate, wheel_momentum, gains);
+                const uint32_t start = read_cycle_counter();
+                const Vector3 torque = PointingController::pd_law < Scalar > (error, rate_error, rate, wheel_momentum, gains);
+                total += read_cycle_counter() - start;
+                const Vector3 difference { torque[0] - truth[0], torque[1] - truth[1], torque[2] - truth[2] };
+                result.torque_error = std::max(result.torque_error, norm(difference) / std::max(norm(truth), 1.0e-12f));
+            }
+        }
+        result.control_cycles = static_cast < uint32_t > (total / (count * controller.gains.size()));
+        return result;
+    }
+
+    template < typename Real >
+    static float estimator_error(uint16_t iterations, uint64_t & cycles) {
+        //gyro with bias and noise, sun sensor and magnetometer with noise, the same random sequence for both precisions
+        using Estimator = BasicAttitudeEstimator < Real > ;
+        uint32_t seed = 13579u;
+        auto random = [ & seed]() {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            return static_cast < double > (seed) / 2147483648.0 - 1.0;
+        };
+        const Vector3Of < double > sun { 0.6, 0.8, 0.0 }, field { 0.0, 0.6, -0.8 }, bias { 2.0e-4, -1.0e-4, 3.0e-4 };
+        QuaternionOf < double > truth { 1.0, 0.0, 0.0, 0.0 };
+        Estimator estimator;
+        estimator.initialize(convert < Real > (truth), static_cast < Real > (1.0e-2));
+        cycles = 0;
+        for (uint16_t k = 0; k < iterations; k++) {
+            const Vector3Of < double > rate = tumble_rate(k);
+            truth = propagate_attitude(truth, rate, static_cast < double > (DT));
+            typename Estimator::Vector gyro, sun_body, field_body;
+            const Vector3Of < double > sun_truth = rotate_to_body(truth, sun), field_truth = rotate_to_body(truth, field);
+            for (int i = 0; i < 3; i++) {
+                gyro[i] = static_cast < Real > (rate[i] + bias[i] + 1.0e-4 / std::sqrt(DT) * random());
+                sun_body[i] = static_cast < Real > (sun_truth[i] + 2.0e-3 * random());
+                field_body[i] = static_cast < Real > (field_truth[i] + 5.0e-3 * random());
+            }
+            const uint32_t start = read_cycle_counter();
+            estimator.propagate(gyro, static_cast < Real > (DT));
+            estimator.update_vector(Estimator::Measurement::SUN, sun_body, convert < Real > (sun), static_cast < Real > (2.0e-3));
+            estimator.update_vector(Estimator::Measurement::MAGNETOMETER, field_body, convert < Real > (field), static_cast < Real > (5.0e-3));
+            cycles += read_cycle_counter() - start;
+        }
+        return static_cast < float > (angle_deg(convert_back(estimator.attitude), truth));
+    }
+};
+#endif
+
+template < uint8_t UNITS >
+class RedundantVectorSensor {
+    //voting over redundant 3 axis sensors(the IMU gyros, the magnetometers). every axis takes the median of the units in
+    //use, so one bad unit never reaches the output, and a unit that is off the vote on any axis for ISOLATE_AFTER reads in
+    //a row is isolated: the vote goes on with the others and the StateMachine resets just that unit. after its reset a
+    //unit is back on probation and readmitted once it has agreed for READMIT_AFTER reads, MAX_RESETS times at most.
+    //with two units left a disagreement has no majority: the one closer to the last vote is used, and if it lasts the
+    //sensor is reported anomalous, which is the only case that reaches FaultManager(as is having no unit at all).
+    //a unit that is not fitted(set_fitted) never takes part and is never counted as lost, so a build with no unit of a
+    //sensor just has no value(has_value false) and no anomaly
+    public:
+    static constexpr uint8_t ISOLATE_AFTER = 5;
+    static constexpr uint8_t READMIT_AFTER = 20;
+    static constexpr uint8_t MAX_RESETS = 3;
+
+    struct Unit {
+        bool isolated = false;
+        bool probation = false; //isolated, reset, and being compared again
+        uint8_t disagree_count = 0;
+        uint8_t agree_count = 0;
+        uint8_t resets = 0;
+    };
+
+    std::array < Unit, UNITS > units {};
+    Vector3 value {}; //last vote
+    bool has_value = false; //the last vote had a unit to use
+    bool anomaly = false;
+
+    RedundantVectorSensor(float absolute_tolerance, float relative_tolerance): absolute_tolerance(absolute_tolerance),
+        relative_tolerance(relative_tolerance) {}
+
+    Vector3 vote(const std::array < Vector3, UNITS > & readings, const std::array < bool, UNITS > & read_ok) {
+        uint8_t in_use[UNITS];
+        uint8_t count = 0;
+        for (uint8_t u = 0; u < UNITS; u++) {
+            if (read_ok[u] && fitted[u] && !units[u].isolated) in_use[count++] = u;
+        }
+        has_value = count > 0;
+        if (count == 0) {
+            anomaly = fitted_count() > 0;
+            return value;
+        }
+        if (count == 2 && !agrees(readings[in_use[0]], readings[in_use[1]])) {
+            //no majority, stay with the one that is continuous with the last vote
+            const uint8_t closer = (distance(readings[in_use[0]], value) <= distance(readings[in_use[1]], value)) ? in_use[0] : in_use[1];
+            if (split_count < ISOLATE_AFTER) split_count++;
+            anomaly = split_count >= ISOLATE_AFTER;
+            value = readings[closer];
+            return value;
+        }
+        split_count = 0;
+        anomaly = false;
+        for (int axis = 0; axis < 3; axis++) {
+            float sorted[UNITS];
+            for (uint8_t i = 0; i < count; i++) { //insertion sort, UNITS is 2-4
+                float x = readings[in_use[i]][axis];
+                int8_t j = static_cast < int8_t > (i) - 1;
+                for (; j >= 0 && sorted[j] > x; j--) sorted[j + 1] = sorted[j];
+                sorted[j + 1] = x;
+            }
+            value[axis] = (count % 2 == 1) ? sorted[count / 2] : 0.5f * (sorted[count / 2 - 1] + sorted[count / 2]);
+        }
+        if (count < 2) return value; //a single unit is used as it is, there is nothing to check it against
+        for (uint8_t u = 0; u < UNITS; u++) {
+            if (!read_ok[u] || !fitted[u]) continue;
+            Unit & unit = units[u];
+            const bool agreeing = agrees(readings[u], value);
+            if (!unit.isolated) {
+                if (count < 3) continue; //two agreeing units are a vote for a unit on probation, not enough to isolate one
+
+                unit.disagree_count = agreeing ? 0 : unit.disagree_count + 1;
+                if (unit.disagree_count >= ISOLATE_AFTER) {
+                    unit.isolated = true;
+                    unit.probation = false;
+                    unit.agree_count = 0;
+                }
+            } else if (unit.probation) {
+                unit.agree_count = agreeing ? unit.agree_count + 1 : 0;
+                if (unit.agree_count >= READMIT_AFTER) {
+                    unit.isolated = false;
+                    unit.probation = false;
+                    unit.disagree_count = 0;
+                }
+            }
+        }
+        return value;
+    }
+
+    bool needs_reset(uint8_t u) const { //isolated, not yet reset for it, and resets left
+        return units[u].isolated && !units[u].probation && units[u].resets < MAX_RESETS;
+    }
+
+    void set_fitted(uint8_t u, bool is_fitted) { //from the driver at boot, all units are fitted until told otherwise
+        fitted[u] = is_fitted;
+    }
+
+    uint8_t fitted_count() const {
+        uint8_t count = 0;
+        for (bool is_fitted: fitted) count += is_fitted ? 1 : 0;
+        return count;
+    }
+
+    void unit_reset(uint8_t u) { //the driver of unit u was just reset
+        units[u].probation = true;
+        units[u].agree_count = 0;
+        units[u].resets++;
+    }
+
+    void reset() { //all units were reset(SENSOR_ANOMALY handling), start the vote over
+        for (Unit & unit: units) unit = Unit {};
+        split_count = 0;
+        anomaly = false;
+    }
+
+    uint8_t isolated_mask() const {
+        uint8_t mask = 0;
+        for (uint8_t u = 0; u < UNITS; u++) {
+            if (units[u].isolated) mask |= static_cast < uint8_t > (1u << u);
+        }
+        return mask;
+    }
+
+    private:
+    float absolute_tolerance;
+    float relative_tolerance;
+    uint8_t split_count = 0;
+    std::array < bool, UNITS > fitted = make_all_fitted();
+
+    static constexpr std::array < bool, UNITS > make_all_fitted() {
+        std::array < bool, UNITS > all {};
+        all.fill(true);
+        return all;
+    }
+
+    bool agrees(const Vector3 & a, const Vector3 & b) const {
+        for (int axis = 0; axis < 3; axis++) {
+            if (std::abs(a[axis] - b[axis]) > absolute_tolerance + relative_tolerance * std::max(std::abs(a[axis]), std::abs(b[axis]))) return false;
+        }
+        return true;
+    }
+
+    static float distance(const Vector3 & a, const Vector3 & b) {
+        return norm(Vector3 { a[0] - b[0], a[1] - b[1], a[2] - b[2] });
+    }
+};
+
+class SunSensorArray {
+    //coarse sun vector from the photodiodes on the body faces. each diode gives current ~ cos(angle to the sun), so with
+    //face normals n_k and normalized currents I_k the sun vector s solves N s = I in the least squares sense.
+    //an unlit face only says n.s <= 0, it enters the fit as a 0 so that 1 or 2 lit faces still give a full rank system
+    //(for the cube faces this is exactly s = sum(n_k I_k) / 2)
+    public:
+    static constexpr uint8_t SENSOR_COUNT = 6;
+    static constexpr float LIT_THRESHOLD = 0.05f; //normalized current, below this a face is treated as dark
+    static constexpr float ECLIPSE_THRESHOLD = 0.15f; //no face above this means no sun(earth albedo alone stays below it)
+
+    std::array < Vector3, SENSOR_COUNT > normals { {
+        { 1.0f, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, -1.0f }
+    } };
+    Vector3 sun_vector {}; //unit, body frame, only valid while sun_visible
+    bool sun_visible = false;
+    uint8_t lit_faces = 0;
+
+    void update(const std::array < float, SENSOR_COUNT > & currents) {
+        float max_current = 0.0f;
+        for (float current: currents) max_current = std::max(max_current, current);
+        sun_visible = max_current >= ECLIPSE_THRESHOLD;
+        lit_faces = 0;
+        if (!sun_visible) return;
+
+        float ntn[3][3] = {};
+        Vector3 nti {};
+        for (uint8_t k = 0; k < SENSOR_COUNT; k++) {
+            const float current = (currents[k] >= LIT_THRESHOLD) ? currents[k] : 0.0f;
+            if (current > 0.0f) lit_faces++;
+            for (int i = 0; i < 3; i++) {
+                nti[i] += normals[k][i] * current;
+                for (int j = 0; j < 3; j++) ntn[i][j] += normals[k][i] * normals[k][j];
+            }
+        }
+        Vector3 s;
+        if (!solve_3x3(ntn, nti, s) || norm(s) < 1.0e-6f) {
+            sun_visible = false;
+            return;
+        }
+        const float n = norm(s);
+        sun_vector = { s[0] / n, s[1] / n, s[2] / n };
+    }
+
+    static bool solve_3x3(const float a[3][3], const Vector3 & b, Vector3 & x) { //cramer's rule, false if singular
+        const float det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1]) - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0]) +
+            a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+        if (std::abs(det) < 1.0e-6f) return false;
+        for (int c = 0; c < 3; c++) {
+            float m[3][3];
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++) m[i][j] = (j == c) ? b[i] : a[i][j];
+            x[c] = (m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])) / det;
+        }
+        return true;
+    }
+};
+
+class BdotController {
+    //DETUMBLING: the B-dot law m = -k dB/dt on the field measured in the body frame. for a tumbling satellite dB/dt is
+    //mostly -w x B(the field of the orbit itself turns at about twice the orbital rate, small next to a tumble), so the
+    //torque m x B = -k |B|^2 w_perp takes out the rate across the field, and the field turning over the orbit brings
+    //every axis across it in turn. needs no gyro and no attitude. the finite difference of successive readings is low
+    //pass filtered, the magnetometer noise would otherwise go straight to the coils
+    public:
+    static constexpr float GAIN = 1.0e5f; //Am^2 per T/s, k |B|^2 is about the damping gain of SunAcquisitionController at 30 uT
+    static constexpr float FILTER_TIME_CONSTANT_S = 0.5f;
+    static constexpr uint32_t MAX_GAP_MS = 1000; //readings further apart than this start the derivative over
+
+    Vector3 field_rate {}; //T/s, filtered
+
+    Vector3 compute_dipole(const Vector3 & field, uint32_t field_time) {
+        //called every cycle, a reading it has already used gives the same dipole again
+        if (has_previous && field_time == previous_time) return dipole;
+        if (!has_previous || field_time - previous_time > MAX_GAP_MS) {
+            has_previous = true;
+            previous_field = field;
+            previous_time = field_time;
+            field_rate = {};
+            dipole = {};
+            return dipole;
+        }
+        const float dt = (field_time - previous_time) * 0.001f;
+        const float alpha = dt / (FILTER_TIME_CONSTANT_S + dt);
+        for (int i = 0; i < 3; i++) {
+            field_rate[i] += alpha * ((field[i] - previous_field[i]) / dt - field_rate[i]);
+            dipole[i] = -GAIN * field_rate[i]; //the allocator scales it into the coil limits
+        }
+        previous_field = field;
+        previous_time = field_time;
+        return dipole;
+    }
+
+    private: Vector3 previous_field {};
+    Vector3 dipole {};
+    uint32_t previous_time = 0;
+    bool has_previous = false;
+};
+
+class SunAcquisitionController {
+    //rate based sun pointing for SUN_ACQUISITION: the rate command w_cmd = k (a x s) turns the panel axis a towards the sun
+    //vector s, and a damping loop torque = -Kd (w - w_cmd) makes it with the magnetorquers. if the sun is not seen(and it is
+    //not an eclipse we know about) for SEARCH_TIMEOUT_MS, the satellite is spun slowly about an axis perpendicular to a so
+    //the sensors sweep the sky. in an eclipse the rates are just damped
+    public:
+    static constexpr Vector3 PANEL_AXIS { 0.0f, 0.0f, 1.0f }; //body axis that should face the sun(solar panels)
+    //gains from the host simulator(SunAcquisitionSimulation), entered at the DETUMBLING exit rate: see the README for the
+    //times. the pointing loop is kept slower than the orbital rate(~1e-3 rad/s), torque only across B averages out to
+    //3 axis control over the orbit and not faster. with 10x the pointing gain the axis wandered for hours or stalled
+    static constexpr float POINTING_GAIN = 0.001f; //rad/s per unit of |a x s|
+    static constexpr float MAX_RATE_COMMAND = 0.001f; //rad/s
+    static constexpr float DAMPING_GAIN = 1.0e-4f; //Nm per rad/s
+    static constexpr float SEARCH_RATE = 0.02f; //rad/s about body X
+    static constexpr uint32_t SEARCH_TIMEOUT_MS = 30000;
+    static constexpr float ALIGNED_ANGLE_DEG = 2.0f; //the SUN_ACQUISITION exit criterion
+    static constexpr uint32_t ALIGNED_HOLD_MS = 10000; //has to stay inside it this long
+
+    bool searching = false;
+    float pointing_error_deg = 180.0f;
+    bool acquired = false; //the last acquisition has met the exit criterion
+    uint32_t acquisition_time_ms = 0; //entry to aligned, for the last acquisition(valid once acquired)
+
+    void start(uint32_t now) {
+        entry_time = now;
+        last_sun_time = now;
+        inside = false;
+        acquired = false;
+        acquisition_time_ms = 0;
+        searching = false;
+        pointing_error_deg = 180.0f;
+    }
+
+    Vector3 compute_dipole(const SunSensorArray & sun, bool eclipse_expected, const Vector3 & rate, const Vector3 & magnetic_field, uint32_t now) {
+        Vector3 rate_command {};
+        if (sun.sun_visible) {
+            last_sun_time = now;
+            searching = false;
+            const Vector3 axis = cross(PANEL_AXIS, sun.sun_vector);
+            for (int i = 0; i < 3; i++) rate_command[i] = POINTING_GAIN * axis[i];
+            const float command_norm = norm(rate_command);
+            if (command_norm > MAX_RATE_COMMAND) {
+                for (float & w: rate_command) w *= MAX_RATE_COMMAND / command_norm;
+            }
+            if (dot(PANEL_AXIS, sun.sun_vector) < 0.0f && command_norm < 1.0e-6f) {
+                rate_command = { MAX_RATE_COMMAND, 0.0f, 0.0f }; //sun exactly behind, a x s is zero, pick a direction
+            }
+            pointing_error_deg = std::acos(std::min(std::max(dot(PANEL_AXIS, sun.sun_vector), -1.0f), 1.0f)) * 57.2957795f;
+        } else {
+            pointing_error_deg = 180.0f;
+            searching = !eclipse_expected && now - last_sun_time >= SEARCH_TIMEOUT_MS;
+            if (searching) rate_command = { SEARCH_RATE, 0.0f, 0.0f };
+        }
+        update_alignment(now);
+
+        Vector3 torque;
+        for (int i = 0; i < 3; i++) torque[i] = -DAMPING_GAIN * (rate[i] - rate_command[i]);
+        return MagnetorquerAllocator::dipole_for_torque(torque, magnetic_field);
+    }
+
+    bool aligned(uint32_t now) const {
+        return inside && now - aligned_since >= ALIGNED_HOLD_MS;
+    }
+
+    private: uint32_t entry_time = 0;
+    uint32_t last_sun_time = 0;
+    uint32_t aligned_since = 0;
+    bool inside = false; //aligned_since is valid(a time of 0 is a time like any other)
+
+    void update_alignment(uint32_t now) {
+        if (pointing_error_deg > ALIGNED_ANGLE_DEG) {
+            inside = false;
+            return;
+        }
+        if (!inside) aligned_since = now;
+        inside = true;
+        if (!acquired && aligned(now)) {
+            acquired = true;
+            acquisition_time_ms = aligned_since - entry_time;
+        }
+    }
+};
+
+class Sgp4 {
+    //SGP4 from spacetrack report #3 with vallado's 2006 corrections, near earth only(period under 225 min, which is
+    //any orbit we will fly, SDP4 deep space terms are left out). WGS-72 constants as the TLEs are made with them.
+    //runs in double, it is only called at the slow OrbitPropagator rate. output is in the TEME frame, km and km/s
+    public:
+    static constexpr double EARTH_RADIUS_KM = 6378.135;
+    static constexpr double XKE = 0.0743669161331734132; //sqrt(mu) in earth radii^1.5 per minute
+    static constexpr double J2 = 0.001082616;
+    static constexpr double J3 = -0.00000253881;
+    static constexpr double J4 = -0.00000165597;
+    static constexpr double TWO_PI = 6.28318530717958648;
+    static constexpr double MINUTES_PER_DAY = 1440.0;
+
+    using Vector3d = std::array < double, 3 > ;
+
+    double epoch_julian_date = 0.0;
+    bool valid = false;
+
+    bool load_tle(const char * line1, const char * line2) {
+        //fixed column TLE lines as uplinked, both checksums have to match
+        valid = false;
+        if (line1[0] != '1' || line2[0] != '2' || !checksum_ok(line1) || !checksum_ok(line2)) return false;
+        const int year = static_cast < int > (parse_field(line1, 18, 2));
+        const double day_of_year = parse_field(line1, 20, 12);
+        bstar = parse_exponent_field(line1, 53);
+        inclination = parse_field(line2, 8, 8) * DEG_TO_RAD;
+        node = parse_field(line2, 17, 8) * DEG_TO_RAD;
+        eccentricity = parse_field(line2, 26, 7) * 1.0e-7; //implied leading decimal point
+        argument_of_perigee = parse_field(line2, 34, 8) * DEG_TO_RAD;
+        mean_anomaly = parse_field(line2, 43, 8) * DEG_TO_RAD;
+        const double mean_motion_kozai = parse_field(line2, 52, 11) * TWO_PI / MINUTES_PER_DAY; //rad/min
+        const int full_year = (year < 57) ? 2000 + year : 1900 + year;
+        epoch_julian_date = january_first_julian_date(full_year) + day_of_year - 1.0;
+        valid = initialize(mean_motion_kozai);
+        return valid;
+    }
+
+    bool propagate(double minutes, Vector3d & position_km, Vector3d & velocity_km_s) const {
+        //false if the elements do not give a usable orbit any more(decayed, eccentricity out of range)
+        if (!valid) return false;
+        const double t = minutes;
+        const double t2 = t * t;
+        const double mean_anomaly_df = mean_anomaly + mdot * t;
+        const double perigee_df = argument_of_perigee + argpdot * t;
+        const double node_df = node + nodedot * t;
+        double perigee_m = perigee_df;
+        double mean_anomaly_m = mean_anomaly_df;
+        double node_m = node_df + nodecf * t2;
+        double tempa = 1.0 - cc1 * t;
+        double tempe = bstar * cc4 * t;
+        double templ = t2cof * t2;
+        if (!simple) {
+            const double delomg = omgcof * t;
+            const double delm_base = 1.0 + eta * std::cos(mean_anomaly_df);
+            const double delm = xmcof * (delm_base * delm_base * delm_base - delmo);
+            mean_anomaly_m = mean_anomaly_df + delomg + delm;
+            perigee_m = perigee_df - delomg - delm;
+            const double t3 = t2 * t;
+            const double t4 = t3 * t;
+            tempa = tempa - d2 * t2 - d3 * t3 - d4 * t4;
+            tempe = tempe + bstar * cc5 * (std::sin(mean_anomaly_m) - sinmao);
+            templ = templ + t3cof * t3 + t4 * (t4cof + t * t5cof);
+        }
+        const double am = std::pow(XKE / mean_motion, 2.0 / 3.0) * tempa * tempa;
+        const double nm = XKE / std::pow(am, 1.5);
+        double em = eccentricity - tempe;
+        if (em >= 1.0 || em < -0.001) return false;
+        em = std::max(em, 1.0e-6);
+        mean_anomaly_m = mean_anomaly_m + mean_motion * templ;
+        const double xlm = std::fmod(mean_anomaly_m + perigee_m + node_m, TWO_PI);
+        node_m = std::fmod(node_m, TWO_PI);
+        perigee_m = std::fmod(perigee_m, TWO_PI);
+        mean_anomaly_m = std::fmod(xlm - perigee_m - node_m, TWO_PI);
+
+        //long period periodics
+        const double axnl = em * std::cos(perigee_m);
+        double temp = 1.0 / (am * (1.0 - em * em));
+        const double aynl = em * std::sin(perigee_m) + temp * aycof;
+        const double xl = mean_anomaly_m + perigee_m + node_m + temp * xlcof * axnl;
+
+        //kepler's equation in the equinoctial variables
+        const double u = std::fmod(xl - node_m, TWO_PI);
+        double eo1 = u;
+        double sineo1 = 0.0, coseo1 = 0.0;
+        for (int k = 0; k < 10; k++) {
+            sineo1 = std::sin(eo1);
+            coseo1 = std::cos(eo1);
+            double step = (u - aynl * coseo1 + axnl * sineo1 - eo1) / (1.0 - coseo1 * axnl - sineo1 * aynl);
+            step = std::min(std::max(step, -0.95), 0.95);
+            eo1 += step;
+            if (std::abs(step) < 1.0e-12) break;
+        }
+
+        //short period periodics
+        const double ecose = axnl * coseo1 + aynl * sineo1;
+        const double esine = axnl * sineo1 - aynl * coseo1;
+        const double el2 = axnl * axnl + aynl * aynl;
+        const double pl = am * (1.0 - el2);
+        if (pl < 0.0) return false;
+        const double rl = am * (1.0 - ecose);
+        const double rdotl = std::sqrt(am) * esine / rl;
+        const double rvdotl = std::sqrt(pl) / rl;
+        const double betal = std::sqrt(1.0 - el2);
+        temp = esine / (1.0 + betal);
+        const double sinu = am / rl * (sineo1 - aynl - axnl * temp);
+        const double cosu = am / rl * (coseo1 - axnl + aynl * temp);
+        double su = std::atan2(sinu, cosu);
+        const double sin2u = (cosu + cosu) * sinu;
+        const double cos2u = 1.0 - 2.0 * sinu * sinu;
+        temp = 1.0 / pl;
+        const double temp1 = 0.5 * J2 * temp;
+        const double temp2 = temp1 * temp;
+        const double mrt = rl * (1.0 - 1.5 * temp2 * betal * con41) + 0.5 * temp1 * x1mth2 * cos2u;
+        if (mrt < 1.0) return false; //below the surface
+        su = su - 0.25 * temp2 * x7thm1 * sin2u;
+        const double xnode = node_m + 1.5 * temp2 * cosio * sin2u;
+        const double xinc = inclination + 1.5 * temp2 * cosio * sinio * cos2u;
+        const double mvt = rdotl - nm * temp1 * x1mth2 * sin2u / XKE;
+        const double rvdot = rvdotl + nm * temp1 * (x1mth2 * cos2u + 1.5 * con41) / XKE;
+
+        //orientation vectors
+        const double sinsu = std::sin(su), cossu = std::cos(su);
+        const double snod = std::sin(xnode), cnod = std::cos(xnode);
+        const double sini = std::sin(xinc), cosi = std::cos(xinc);
+        const double xmx = -snod * cosi;
+        const double xmy = cnod * cosi;
+        const Vector3d uu { xmx * sinsu + cnod * cossu, xmy * sinsu + snod * cossu, sini * sinsu };
+        const Vector3d vv { xmx * cossu - cnod * sinsu, xmy * cossu - snod * sinsu, sini * cossu };
+        const double velocity_unit = EARTH_RADIUS_KM * XKE / 60.0;
+        for (int i = 0; i < 3; i++) {
+            position_km[i] = mrt * uu[i] * EARTH_RADIUS_KM;
+            velocity_km_s[i] = (mvt * uu[i] + rvdot * vv[i]) * velocity_unit;
+        }
+        return true;
+    }
+
+    static double january_first_julian_date(int year) { //0h UT on january 1st, good for 1901-2099
+        return 367.0 * year - std::floor(7.0 * year / 4.0) + 31.0 + 1721013.5;
+    }
+
+    static double gmst(double julian_date) { //greenwich mean sidereal time(rad), the TEME to earth fixed angle(UT1 ~ UTC here)
+        const double t = (julian_date - 2451545.0) / 36525.0;
+        const double seconds = -6.2e-6 * t * t * t + 0.093104 * t * t + (876600.0 * 3600.0 + 8640184.812866) * t + 67310.54841;
+        const double angle = std::fmod(seconds * DEG_TO_RAD / 240.0, TWO_PI);
+        return (angle < 0.0) ? angle + TWO_PI : angle;
+    }
+
+    private:
+    static constexpr double DEG_TO_RAD = 0.0174532925199432958;
+
+    bool initialize(double mean_motion_kozai) {
+        //sgp4init for the near earth case: recover the original mean motion and semi major axis, then the drag and
+        //secular coefficients that propagate() uses
+        const double eccsq = eccentricity * eccentricity;
+        const double omeosq = 1.0 - eccsq;
+        const double rteosq = std::sqrt(omeosq);
+        cosio = std::cos(inclination);
+        sinio = std::sin(inclination);
+        const double cosio2 = cosio * cosio;
+        const double ak = std::pow(XKE / mean_motion_kozai, 2.0 / 3.0);
+        const double d1 = 0.75 * J2 * (3.0 * cosio2 - 1.0) / (rteosq * omeosq);
+        double del = d1 / (ak * ak);
+        const double adel = ak * (1.0 - del * del - del * (1.0 / 3.0 + 134.0 * del * del / 81.0));
+        del = d1 / (adel * adel);
+        mean_motion = mean_motion_kozai / (1.0 + del);
+        if (TWO_PI / mean_motion >= 225.0) return false; //deep space, not supported
+        const double ao = std::pow(XKE / mean_motion, 2.0 / 3.0);
+        const double po = ao * omeosq;
+        const double con42 = 1.0 - 5.0 * cosio2;
+        con41 = -con42 - cosio2 - cosio2;
+        const double posq = po * po;
+        const double rp = ao * (1.0 - eccentricity);
+        if (rp < 1.0) return false;
+
+        //atmosphere parameters, lowered for perigees under 156 km
+        simple = rp < (220.0 / EARTH_RADIUS_KM + 1.0);
+        double sfour = 78.0 / EARTH_RADIUS_KM + 1.0;
+        double qzms24 = std::pow((120.0 - 78.0) / EARTH_RADIUS_KM, 4.0);
+        const double perigee_km = (rp - 1.0) * EARTH_RADIUS_KM;
+        if (perigee_km < 156.0) {
+            sfour = (perigee_km < 98.0) ? 20.0 : perigee_km - 78.0;
+            qzms24 = std::pow((120.0 - sfour) / EARTH_RADIUS_KM, 4.0);
+            sfour = sfour / EARTH_RADIUS_KM + 1.0;
+        }
+        const double pinvsq = 1.0 / posq;
+        const double tsi = 1.0 / (ao - sfour);
+        eta = ao * eccentricity * tsi;
+        const double etasq = eta * eta;
+        const double eeta = eccentricity * eta;
+        const double psisq = std::abs(1.0 - etasq);
+        const double coef = qzms24 * std::pow(tsi, 4.0);
+        const double coef1 = coef / std::pow(psisq, 3.5);
+        const double cc2 = coef1 * mean_motion * (ao * (1.0 + 1.5 * etasq + eeta * (4.0 + etasq)) +
+            0.375 * J2 * tsi / psisq * con41 * (8.0 + 3.0 * etasq * (8.0 + etasq)));
+        cc1 = bstar * cc2;
+        const double cc3 = (eccentricity > 1.0e-4) ? -2.0 * coef * tsi * (J3 / J2) * mean_motion * sinio / eccentricity : 0.0;
+        x1mth2 = 1.0 - cosio2;
+        cc4 = 2.0 * mean_motion * coef1 * ao * omeosq * (eta * (2.0 + 0.5 * etasq) + eccentricity * (0.5 + 2.0 * etasq) -
+            J2 * tsi / (ao * psisq) * (-3.0 * con41 * (1.0 - 2.0 * eeta + etasq * (1.5 - 0.5 * eeta)) +
+            0.75 * x1mth2 * (2.0 * etasq - eeta * (1.0 + etasq)) * std::cos(2.0 * argument_of_perigee)));
+        cc5 = 2.0 * coef1 * ao * omeosq * (1.0 + 2.75 * (etasq + eeta) + eeta * etasq);
+        const double cosio4 = cosio2 * cosio2;
+        const double temp1 = 1.5 * J2 * pinvsq * mean_motion;
+        const double temp2 = 0.5 * temp1 * J2 * pinvsq;
+        const double temp3 = -0.46875 * J4 * pinvsq * pinvsq * mean_motion;
+        mdot = mean_motion + 0.5 * temp1 * rteosq * con41 + 0.0625 * temp2 * rteosq * (13.0 - 78.0 * cosio2 + 137.0 * cosio4);
+        argpdot = -0.5 * temp1 * con42 + 0.0625 * temp2 * (7.0 - 114.0 * cosio2 + 395.0 * cosio4) + temp3 * (3.0 - 36.0 * cosio2 + 49.0 * cosio4);
+        const double xhdot1 = -temp1 * cosio;
+        nodedot = xhdot1 + (0.5 * temp2 * (4.0 - 19.0 * cosio2) + 2.0 * temp3 * (3.0 - 7.0 * cosio2)) * cosio;
+        omgcof = bstar * cc3 * std::cos(argument_of_perigee);
+        xmcof = (eccentricity > 1.0e-4) ? -2.0 / 3.0 * coef * bstar / eeta : 0.0;
+        nodecf = 3.5 * omeosq * xhdot1 * cc1;
+        t2cof = 1.5 * cc1;
+        xlcof = -0.25 * (J3 / J2) * sinio * (3.0 + 5.0 * cosio) / ((std::abs(cosio + 1.0) > 1.5e-12) ? (1.0 + cosio) : 1.5e-12);
+        aycof = -0.5 * (J3 / J2) * sinio;
+        const double delmo_base = 1.0 + eta * std::cos(mean_anomaly);
+        delmo = delmo_base * delmo_base * delmo_base;
+        sinmao = std::sin(mean_anomaly);
+        x7thm1 = 7.0 * cosio2 - 1.0;
+        if (!simple) {
+            const double cc1sq = cc1 * cc1;
+            d2 = 4.0 * ao * tsi * cc1sq;
+            const double temp = d2 * tsi * cc1 / 3.0;
+            d3 = (17.0 * ao + sfour) * temp;
+            d4 = 0.5 * temp * ao * tsi * (221.0 * ao + 31.0 * sfour) * cc1;
+            t3cof = d2 + 2.0 * cc1sq;
+            t4cof = 0.25 * (3.0 * d3 + cc1 * (12.0 * d2 + 10.0 * cc1sq));
+            t5cof = 0.2 * (3.0 * d4 + 12.0 * cc1 * d3 + 6.0 * d2 * d2 + 15.0 * cc1sq * (2.0 * d2 + cc1sq));
+        }
+        return true;
+    }
+
+    static bool checksum_ok(const char * line) { //digits add up, '-' counts as 1, modulo 10 against column 69
+        int sum = 0;
+        for (int i = 0; i < 68; i++) {
+            if (line[i] == '\0') return false;
+            if (line[i] >= '0' && line[i] <= '9') sum += line[i] - '0';
+            else if (line[i] == '-') sum += 1;
+        }
+        return line[68] >= '0' && line[68] <= '9' && sum % 10 == line[68] - '0';
+    }
+
+    static double parse_field(const char * line, int start, int length) {
+        //fixed width decimal number, blanks ignored(no strtod, it depends on the locale and may not be in the libc)
+        double value = 0.0, scale = 0.0;
+        bool negative = false;
+        for (int i = start; i < start + length; i++) {
+            const char c = line[i];
+            if (c == '-') negative = true;
+            else if (c == '.') scale = 1.0;
+            else if (c >= '0' && c <= '9') {
+                value = value * 10.0 + (c - '0');
+                scale *= 10.0;
+            }
+        }
+        if (scale > 0.0) value /= scale;
+        return negative ? -value : value;
+    }
+
+    static double parse_exponent_field(const char * line, int start) {
+        //" 66816-4" style: sign, 5 digit mantissa with an implied leading decimal point, signed exponent digit
+        const double mantissa = parse_field(line, start + 1, 5) * 1.0e-5;
+        const double exponent = parse_field(line, start + 6, 2);
+        return ((line[start] == '-') ? -mantissa : mantissa) * std::pow(10.0, exponent);
+    }
+
+    //elements
+    double bstar = 0.0, inclination = 0.0, node = 0.0, eccentricity = 0.0, argument_of_perigee = 0.0, mean_anomaly = 0.0;
+    double mean_motion = 0.0; //un-kozai'd, rad/min
+    //initialized constants
+    bool simple = false;
+    double cosio = 0.0, sinio = 0.0, con41 = 0.0, x1mth2 = 0.0, x7thm1 = 0.0, eta = 0.0;
+    double cc1 = 0.0, cc4 = 0.0, cc5 = 0.0, d2 = 0.0, d3 = 0.0, d4 = 0.0;
+    double mdot = 0.0, argpdot = 0.0, nodedot = 0.0, omgcof = 0.0, xmcof = 0.0, nodecf = 0.0;
+    double t2cof = 0.0, t3cof = 0.0, t4cof = 0.0, t5cof = 0.0, xlcof = 0.0, aycof = 0.0, delmo = 0.0, sinmao = 0.0;
+};
+
+class OrbitPropagator {
+    //where we are, for the reference sun and field vectors. SGP4 runs once every STEP_MS(it is thousands of cycles,
+    //mostly soft float double on the cortex-M4) one step ahead of now, and the control loop linearly interpolates
+    //between the last two points in float, which is a few hundred cycles. over 10 s the interpolation is off by about
+    //a dt^2/8 ~ 100 m, nothing next to the TLE itself.
+    //the time base maps get_current_time() to UTC julian date: the ground sends the on-board time that goes with a
+    //UTC time(set_time_reference), so the RTC only has to count, not know the date
+    public:
+    static constexpr uint32_t STEP_MS = 10000;
+
+    Sgp4 sgp4;
+
+    bool load_tle(const char * line1, const char * line2) {
+        steps_valid = false;
+        return sgp4.load_tle(line1, line2);
+    }
+
+    void set_time_reference(uint32_t onboard_ms, double julian_date) {
+        reference_onboard_ms = onboard_ms;
+        reference_julian_date = julian_date;
+        time_reference_set = true;
+        steps_valid = false;
+    }
+
+    bool valid() const {
+        return steps_valid;
+    }
+
+    double julian_date(uint32_t now) const { //UTC, from the uplinked time reference
+        return reference_julian_date + static_cast < double > (static_cast < int32_t > (now - reference_onboard_ms)) / 86400000.0;
+    }
+
+    double minutes_since_epoch(uint32_t now) const {
+        return (julian_date(now) - sgp4.epoch_julian_date) * Sgp4::MINUTES_PER_DAY;
+    }
+
+    void update(uint32_t now) { //slow path, call every cycle: only propagates when now has run past the newer point
+        if (!sgp4.valid || !time_reference_set) return;
+        if (steps_valid) {
+            const int32_t past_newer = static_cast < int32_t > (now - step_time[1]);
+            if (past_newer < 0 && static_cast < int32_t > (now - step_time[0]) >= 0) return; //still between the two points
+            if (past_newer >= 0 && past_newer < static_cast < int32_t > (STEP_MS)) {
+                //normal case: the newer point becomes the older one and one more step is propagated
+                step_time[0] = step_time[1];
+                step_position[0] = step_position[1];
+                step_velocity[0] = step_velocity[1];
+                steps_valid = propagate_step(1, step_time[0] + STEP_MS);
+                return;
+            }
+        }
+        //first call or a jump in time: both points again
+        steps_valid = propagate_step(0, now) && propagate_step(1, now + STEP_MS);
+    }
+
+    bool position(uint32_t now, Vector3 & position_km, Vector3 & velocity_km_s) const { //fast path, TEME
+        if (!steps_valid) return false;
+        const float f = static_cast < float > (static_cast < int32_t > (now - step_time[0])) / static_cast < float > (STEP_MS);
+        for (int i = 0; i < 3; i++) {
+            position_km[i] = step_position[0][i] + f * (step_position[1][i] - step_position[0][i]);
+            velocity_km_s[i] = step_velocity[0][i] + f * (step_velocity[1][i] - step_velocity[0][i]);
+        }
+        return true;
+    }
+
+    private:
+    bool propagate_step(int slot, uint32_t time) {
+        Sgp4::Vector3d r, v;
+        if (!sgp4.propagate(minutes_since_epoch(time), r, v)) return false;
+        step_time[slot] = time;
+        for (int i = 0; i < 3; i++) {
+            step_position[slot][i] = static_cast < float > (r[i]);
+            step_velocity[slot][i] = static_cast < float > (v[i]);
+        }
+        return true;
+    }
+
+    double reference_julian_date = 0.0;
+    uint32_t reference_onboard_ms = 0;
+    bool time_reference_set = false;
+    bool steps_valid = false;
+    std::array < uint32_t, 2 > step_time {};
+    std::array < Vector3, 2 > step_position {};
+    std::array < Vector3, 2 > step_velocity {};
+};
+
+#if defined(ADCS_HOST_BUILD) || defined(ADCS_BENCHMARK)
+struct OrbitPropagatorBenchmark {
+    //cycles of one SGP4 step and one interpolation, and what that comes to per control cycle at a given loop rate
+    struct Result {
+        uint32_t sgp4_cycles;
+        uint32_t interpolation_cycles;
+        uint32_t per_cycle_cycles; //interpolation plus the SGP4 step spread over the cycles between steps
+    };
+
+    static Result run(OrbitPropagator & orbit, uint32_t cycle_period_ms, uint16_t iterations) {
+        Result result {};
+        uint64_t sgp4_total = 0, interpolation_total = 0;
+        Sgp4::Vector3d r, v;
+        Vector3 position, velocity;
+        volatile float sink = 0.0f; //keeps the interpolation from being optimized away
+        for (uint16_t i = 0; i < iterations; i++) {
+            uint32_t start = read_cycle_counter();
+            orbit.sgp4.propagate(static_cast < double > (i), r, v);
+            sgp4_total += read_cycle_counter() - start;
+            start = read_cycle_counter();
+            orbit.position(i * cycle_period_ms, position, velocity);
+            interpolation_total += read_cycle_counter() - start;
+            sink = sink + position[0];
+        }
+        const uint16_t n = std::max < uint16_t > (iterations, 1);
+        result.sgp4_cycles = static_cast < uint32_t > (sgp4_total / n);
+        result.interpolation_cycles = static_cast < uint32_t > (interpolation_total / n);
+        result.per_cycle_cycles = result.interpolation_cycles + result.sgp4_cycles * cycle_period_ms / OrbitPropagator::STEP_MS;
+        return result;
+    }
+};
+#endif
+
+struct IgrfCoefficient {
+    float g, h; //nT at the model epoch
+    float g_rate, h_rate; //nT/year
+};
+
+struct Igrf13 {
+    //IGRF-13: main field at 2020.0, n = 1..13, m = 0..n in that order, secular variation(n <= 8) for 2020-2025.
+    //past 2025 the secular variation is extrapolated, which is tens of nT a year off, fine for attitude work
+    static constexpr float EPOCH_YEAR = 2020.0f;
+    static constexpr uint8_t MAX_DEGREE = 13;
+    static constexpr uint8_t COEFFICIENT_COUNT = 104;
+    static constexpr IgrfCoefficient COEFFICIENTS[COEFFICIENT_COUNT] = {
+        //n = 1
+        { -29404.8f, 0.0f, 5.7f, 0.0f }, { -1450.9f, 4652.5f, 7.4f, -25.9f },
+        //n = 2
+        { -2499.6f, 0.0f, -11.0f, 0.0f }, { 2982.0f, -2991.6f, -7.0f, -30.2f }, { 1677.0f, -734.6f, -2.1f, -22.4f },
+        //n = 3
+        { 1363.2f, 0.0f, 2.2f, 0.0f }, { -2381.2f, -82.1f, -5.9f, 6.0f }, { 1236.2f, 241.9f, 3.1f, -1.1f }, { 525.7f, -543.4f, -12.0f, 0.5f },
+        //n = 4
+        { 903.0f, 0.0f, -1.2f, 0.0f }, { 809.5f, 281.9f, -1.6f, -0.1f }, { 86.3f, -158.4f, -5.9f, 6.5f }, { -309.4f, 199.7f, 5.2f, 3.6f },
+        { 48.0f, -349.7f, -5.1f, -5.0f },
+        //n = 5
+        { -234.3f, 0.0f, -0.3f, 0.0f }, { 363.2f, 47.7f, 0.5f, 0.0f }, { 187.8f, 208.3f, -0.6f, 2.5f }, { -140.7f, -121.2f, 0.2f, -0.6f },
+        { -151.2f, 32.3f, 1.3f, 3.0f }, { 13.5f, 98.9f, 0.9f, 0.3f },
+        //n = 6
+        { 66.0f, 0.0f, -0.5f, 0.0f }, { 65.5f, -19.1f, -0.3f, 0.0f }, { 72.9f, 25.1f, 0.4f, -1.6f }, { -121.5f, 52.8f, 1.3f, -1.3f },
+        { -36.2f, -64.5f, -1.4f, 0.8f }, { 13.5f, 8.9f, 0.0f, 0.0f }, { -64.7f, 68.1f, 0.9f, 1.0f },
+        //n = 7
+        { 80.6f, 0.0f, -0.1f, 0.0f }, { -76.7f, -51.5f, -0.2f, 0.6f }, { -8.2f, -16.9f, 0.0f, 0.6f }, { 56.5f, 2.2f, 0.7f, -0.8f },
+        { 15.8f, 23.5f, 0.1f, -0.2f }, { 6.4f, -2.2f, -0.5f, -1.1f }, { -7.2f, -27.2f, -0.8f, 0.1f }, { 9.8f, -1.8f, 0.8f, 0.3f },
+        //n = 8
+        { 23.7f, 0.0f, 0.0f, 0.0f }, { 9.7f, 8.4f, 0.1f, -0.2f }, { -17.6f, -15.3f, -0.1f, 0.6f }, { -0.5f, 12.8f, 0.4f, -0.2f },
+        { -21.1f, -11.7f, -0.1f, 0.5f }, { 15.3f, 14.9f, 0.4f, -0.3f }, { 13.7f, 3.6f, 0.3f, -0.4f }, { -16.5f, -6.9f, -0.1f, 0.5f },
+        { -0.3f, 2.8f, 0.4f, 0.0f },
+        //n = 9
+        { 5.0f, 0.0f, 0.0f, 0.0f }, { 8.4f, -23.4f, 0.0f, 0.0f }, { 2.9f, 11.0f, 0.0f, 0.0f }, { -1.5f, 9.8f, 0.0f, 0.0f },
+        { -1.1f, -5.1f, 0.0f, 0.0f }, { -13.2f, -6.3f, 0.0f, 0.0f }, { 1.1f, 7.8f, 0.0f, 0.0f }, { 8.8f, 0.4f, 0.0f, 0.0f },
+        { -9.3f, -1.4f, 0.0f, 0.0f }, { -11.9f, 9.6f, 0.0f, 0.0f },
+        //n = 10
+        { -1.9f, 0.0f, 0.0f, 0.0f }, { -6.2f, 3.4f, 0.0f, 0.0f }, { -0.1f, -0.2f, 0.0f, 0.0f }, { 1.7f, 3.6f, 0.0f, 0.0f },
+        { -0.9f, 4.8f, 0.0f, 0.0f }, { 0.7f, -8.6f, 0.0f, 0.0f }, { -0.9f, -0.1f, 0.0f, 0.0f }, { 1.9f, -4.3f, 0.0f, 0.0f },
+        { 1.4f, -3.4f, 0.0f, 0.0f }, { -2.4f, -0.1f, 0.0f, 0.0f }, { -3.8f, -8.8f, 0.0f, 0.0f },
+        //n = 11
+        { 3.0f, 0.0f, 0.0f, 0.0f }, { -1.4f, 0.0f, 0.0f, 0.0f }, { -2.5f, 2.5f, 0.0f, 0.0f }, { 2.3f, -0.6f, 0.0f, 0.0f },
+        { -0.9f, -0.4f, 0.0f, 0.0f }, { 0.3f, 0.6f, 0.0f, 0.0f }, { -0.7f, -0.2f, 0.0f, 0.0f }, { -0.1f, -1.7f, 0.0f, 0.0f },
+        { 1.4f, -1.6f, 0.0f, 0.0f }, { -0.6f, -3.0f, 0.0f, 0.0f }, { 0.2f, -2.0f, 0.0f, 0.0f }, { 3.1f, -2.6f, 0.0f, 0.0f },
+        //n = 12
+        { -2.0f, 0.0f, 0.0f, 0.0f }, { -0.1f, -1.2f, 0.0f, 0.0f }, { 0.5f, 0.5f, 0.0f, 0.0f }, { 1.3f, 1.4f, 0.0f, 0.0f },
+        { -1.2f, -1.8f, 0.0f, 0.0f }, { 0.7f, 0.1f, 0.0f, 0.0f }, { 0.3f, 0.8f, 0.0f, 0.0f }, { 0.5f, -0.2f, 0.0f, 0.0f },
+        { -0.3f, 0.6f, 0.0f, 0.0f }, { -0.5f, 0.2f, 0.0f, 0.0f }, { 0.1f, -0.9f, 0.0f, 0.0f }, { -1.1f, 0.0f, 0.0f, 0.0f },
+        { -0.3f, 0.5f, 0.0f, 0.0f },
+        //n = 13
+        { 0.1f, 0.0f, 0.0f, 0.0f }, { -0.9f, -0.9f, 0.0f, 0.0f }, { 0.5f, 0.6f, 0.0f, 0.0f }, { 0.7f, 1.4f, 0.0f, 0.0f },
+        { -0.3f, -0.4f, 0.0f, 0.0f }, { 0.8f, -1.3f, 0.0f, 0.0f }, { 0.0f, -0.1f, 0.0f, 0.0f }, { 0.8f, 0.3f, 0.0f, 0.0f },
+        { 0.0f, -0.1f, 0.0f, 0.0f }, { 0.4f, 0.5f, 0.0f, 0.0f }, { 0.1f, 0.5f, 0.0f, 0.0f }, { 0.5f, -0.4f, 0.0f, 0.0f },
+        { -0.5f, -0.4f, 0.0f, 0.0f }, { -0.4f, -0.6f, 0.0f, 0.0f }
+    };
+};
+
+template < typename Real >
+class GeomagneticField {
+    //IGRF spherical harmonic field up to a chosen truncation order, float or double. set_epoch folds the secular
+    //variation and the schmidt normalization into one table and the legendre recurrence factors are tabulated once,
+    //so field_ecef is only multiply adds: gauss normalized P(n,m), dP(n,m)/dtheta by recurrence in the colatitude and
+    //cos/sin(m phi) by angle addition
+    public:
+    using Vector = std::array < Real, 3 > ;
+    static constexpr uint8_t MAX_ORDER = Igrf13::MAX_DEGREE;
+    static constexpr Real REFERENCE_RADIUS_KM = static_cast < Real > (6371.2);
+
+    explicit GeomagneticField(uint8_t truncation_order = MAX_ORDER) {
+        set_order(truncation_order);
+        for (int n = 2; n <= MAX_ORDER; n++) {
+            for (int m = 0; m < n; m++) {
+                recurrence[index(n, m)] = static_cast < Real > ((n - 1) * (n - 1) - m * m) / static_cast < Real > ((2 * n - 1) * (2 * n - 3));
+            }
+        }
+        set_epoch(Igrf13::EPOCH_YEAR);
+    }
+
+    void set_order(uint8_t truncation_order) {
+        order = std::min < uint8_t > (std::max < uint8_t > (truncation_order, 1), MAX_ORDER);
+    }
+
+    uint8_t get_order() const {
+        return order;
+    }
+
+    void set_epoch(float decimal_year) {
+        //g = S(n,m) (g0 + rate dt), S(n,0) = S(n-1,0)(2n-1)/n, S(n,m) = S(n,m-1) sqrt((n-m+1)(1 + [m==1])/(n+m))
+        const Real dt = static_cast < Real > (decimal_year - Igrf13::EPOCH_YEAR);
+        Real schmidt_zonal = 1;
+        for (int n = 1; n <= MAX_ORDER; n++) {
+            schmidt_zonal *= static_cast < Real > (2 * n - 1) / static_cast < Real > (n);
+            Real schmidt = schmidt_zonal;
+            for (int m = 0; m <= n; m++) {
+                if (m > 0) schmidt *= std::sqrt(static_cast < Real > ((n - m + 1) * ((m == 1) ? 2 : 1)) / static_cast < Real > (n + m));
+                const IgrfCoefficient & c = Igrf13::COEFFICIENTS[index(n, m)];
+                g[index(n, m)] = schmidt * (c.g + dt * c.g_rate);
+                h[index(n, m)] = schmidt * (c.h + dt * c.h_rate);
+            }
+        }
+    }
+
+    Vector field_ecef(const Vector & position_km) const { //tesla, earth fixed, position geocentric earth fixed
+        const Real rxy = std::sqrt(position_km[0] * position_km[0] + position_km[1] * position_km[1]);
+        const Real r = std::sqrt(rxy * rxy + position_km[2] * position_km[2]);
+        const Real cos_theta = position_km[2] / r;
+        const Real sin_theta = std::max(rxy / r, static_cast < Real > (1.0e-10)); //right over a pole B phi is 0/0
+        const Real cos_phi = (rxy > 0) ? position_km[0] / rxy : 1;
+        const Real sin_phi = (rxy > 0) ? position_km[1] / rxy : 0;
+        const Real ratio = REFERENCE_RADIUS_KM / r;
+
+        std::array < Real, MAX_ORDER + 1 > cos_m {}, sin_m {};
+        cos_m[0] = 1;
+        for (int m = 1; m <= order; m++) {
+            cos_m[m] = cos_m[m - 1] * cos_phi - sin_m[m - 1] * sin_phi;
+            sin_m[m] = sin_m[m - 1] * cos_phi + cos_m[m - 1] * sin_phi;
+        }
+
+        //P and dP of the last two degrees, entries with m above the degree stay 0 which the recurrence relies on
+        std::array < Real, MAX_ORDER + 1 > p_previous {}, p_older {}, dp_previous {}, dp_older {}, p {}, dp {};
+        p_previous[0] = 1;
+        Real radial = 0, south = 0, east = 0;
+        Real ratio_power = ratio * ratio; //(a/r)^(n+2)
+        for (int n = 1; n <= order; n++) {
+            ratio_power *= ratio;
+            Real radial_n = 0, south_n = 0, east_n = 0;
+            for (int m = 0; m <= n; m++) {
+                const int i = index(n, m);
+                if (m == n) {
+                    p[m] = sin_theta * p_previous[m - 1];
+                    dp[m] = sin_theta * dp_previous[m - 1] + cos_theta * p_previous[m - 1];
+                } else {
+                    p[m] = cos_theta * p_previous[m] - recurrence[i] * p_older[m];
+                    dp[m] = cos_theta * dp_previous[m] - sin_theta * p_previous[m] - recurrence[i] * dp_older[m];
+                }
+                const Real gh = g[i] * cos_m[m] + h[i] * sin_m[m];
+                radial_n += gh * p[m];
+                south_n += gh * dp[m];
+                east_n += static_cast < Real > (m) * (h[i] * cos_m[m] - g[i] * sin_m[m]) * p[m];
+            }
+            radial += static_cast < Real > (n + 1) * ratio_power * radial_n;
+            south -= ratio_power * south_n;
+            east -= ratio_power * east_n;
+            p_older = p_previous;
+            dp_older = dp_previous;
+            p_previous = p;
+            dp_previous = dp;
+        }
+        east /= sin_theta;
+
+        //B = -grad V in (r, theta, phi) to earth fixed cartesian, nT to T
+        const Real nano = static_cast < Real > (1.0e-9);
+        const Real horizontal = radial * sin_theta + south * cos_theta;
+        return { (horizontal * cos_phi - east * sin_phi) * nano, (horizontal * sin_phi + east * cos_phi) * nano,
+            (radial * cos_theta - south * sin_theta) * nano };
+    }
+
+    private:
+    static constexpr int index(int n, int m) {
+        return n * (n + 1) / 2 + m - 1;
+    }
+
+    std::array < Real, Igrf13::COEFFICIENT_COUNT > g {}, h {}, recurrence {};
+    uint8_t order = MAX_ORDER;
+};
+
+class MagneticFieldReference {
+    //the model field in the inertial(TEME) frame for the control loop. it is evaluated every REFRESH_MS at the orbit
+    //position(TEME to earth fixed by the GMST rotation, polar motion ignored) and linearly extrapolated from the last
+    //two evaluations in between: the field turns at about twice the orbit rate, so 10 s out that is off by < 30 nT
+    public:
+    static constexpr uint32_t REFRESH_MS = 10000;
+    //truncation order from GeomagneticFieldBenchmark(LEO, against the full order 13 model): order 8 is ~60 nT rms and
+    //0.4 deg worst case, under the calibrated magnetometer error and the unmodelled external field, for a bit over half
+    //the cycles of order 13(it is the one long cycle every REFRESH_MS that counts). float error is far below that:
+    //  order    4     6     8    10    12
+    //  rms nT  870   210    58    12   3.7
+    //  max deg 4.8   1.0  0.38  0.08  0.02
+    static constexpr uint8_t DEFAULT_ORDER = 8;
+    static constexpr float EPOCH_UPDATE_YEARS = 0.01f; //the coefficients are brought to the date every few days
+
+    GeomagneticField < float > model { DEFAULT_ORDER };
+
+    void update(uint32_t now, const OrbitPropagator & orbit) {
+        if (!orbit.valid()) return;
+        if (sample_count > 0 && static_cast < int32_t > (now - sample_time[1]) < static_cast < int32_t > (REFRESH_MS)) return;
+        Vector3 position, velocity;
+        if (!orbit.position(now, position, velocity)) return;
+        const double julian_date = orbit.julian_date(now);
+        const float year = 2000.0f + static_cast < float > ((julian_date - 2451545.0) / 365.25);
+        if (std::abs(year - model_year) > EPOCH_UPDATE_YEARS) {
+            model.set_epoch(year);
+            model_year = year;
+        }
+        //TEME to earth fixed is a rotation by GMST about z
+        const float gmst = static_cast < float > (Sgp4::gmst(julian_date));
+        const float c = std::cos(gmst), s = std::sin(gmst);
+        const Vector3 b_ecef = model.field_ecef({ c * position[0] + s * position[1], -s * position[0] + c * position[1], position[2] });
+        sample_time[0] = sample_time[1];
+        sample_field[0] = sample_field[1];
+        sample_time[1] = now;
+        sample_field[1] = { c * b_ecef[0] - s * b_ecef[1], s * b_ecef[0] + c * b_ecef[1], b_ecef[2] };
+        if (sample_count < 2) sample_count++;
+    }
+
+    bool field(uint32_t now, Vector3 & b_inertial) const { //tesla, TEME, false until there are 2 evaluations to go on
+        if (sample_count < 2) return false;
+        const float f = static_cast < float > (static_cast < int32_t > (now - sample_time[1])) /
+            static_cast < float > (static_cast < int32_t > (sample_time[1] - sample_time[0]));
+        for (int i = 0; i < 3; i++) b_inertial[i] = sample_field[1][i] + f * (sample_field[1][i] - sample_field[0][i]);
+        return true;
+    }
+
+    private:
+    std::array < uint32_t, 2 > sample_time {};
+    std::array < Vector3, 2 > sample_field {};
+    uint8_t sample_count = 0;
+    float model_year = 0.0f;
+};
+
+#if defined(ADCS_HOST_BUILD) || defined(ADCS_BENCHMARK)
+struct GeomagneticFieldBenchmark {
+    //accuracy against the full order 13 double model and cycles per evaluation, for every truncation order in float and
+    //double, over random LEO positions(300-800 km). this is what DEFAULT_ORDER was picked from
+    struct Result {
+        uint8_t order;
+        float rms_error_nt; //float model
+        float max_angle_error_deg; //float model
+        uint32_t float_cycles;
+        uint32_t double_cycles;
+    };
+    static constexpr uint8_t MIN_ORDER = 4;
+    static constexpr uint8_t ORDER_COUNT = GeomagneticField < float > ::MAX_ORDER - MIN_ORDER + 1;
+
+    static std::array < Result, ORDER_COUNT > run(uint16_t samples) {
+        std::array < Result, ORDER_COUNT > results {};
+        const GeomagneticField < double > reference;
+        GeomagneticField < float > model_float;
+        GeomagneticField < double > model_double;
+        for (uint8_t k = 0; k < ORDER_COUNT; k++) {
+            const uint8_t order = MIN_ORDER + k;
+            model_float.set_order(order);
+            model_double.set_order(order);
+            uint32_t seed = 987654321u;
+            auto random = [ & seed]() { //xorshift, in [-1, 1]
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                return static_cast < double > (seed) / 2147483648.0 - 1.0;
+            };
+            double square_sum = 0.0;
+            volatile double sink = 0.0; //keeps the double evaluation from being optimized away
+            uint64_t float_total = 0, double_total = 0;
+            Result & result = results[k];
+            result.order = order;
+            for (uint16_t i = 0; i < samples; i++) {
+                std::array < double, 3 > direction { random(), random(), random() };
+                const double length = std::sqrt(direction[0] * direction[0] + direction[1] * direction[1] + direction[2] * direction[2]);
+                const double radius = 6371.0 + 300.0 + 250.0 * (random() + 1.0);
+                const std::array < double, 3 > position { direction[0] / length * radius, direction[1] / length * radius, direction[2] / length * radius };
+                const std::array < double, 3 > truth = reference.field_ecef(position);
+
+                uint32_t start = read_cycle_counter();
+                const Vector3 b = model_float.field_ecef({ static_cast < float > (position[0]), static_cast < float > (position[1]), static_cast < float > (position[2]) });
+                float_total += read_cycle_counter() - start;
+                start = read_cycle_counter();
+                const std::array < double, 3 > b_double = model_double.field_ecef(position);
+                double_total += read_cycle_counter() - start;
+                sink = sink + b_double[0];
+
+                double error2 = 0.0, dot_product = 0.0, norm_b = 0.0, norm_truth = 0.0;
+                for (int j = 0; j < 3; j++) {
+                    error2 += (b[j] - truth[j]) * (b[j] - truth[j]);
+                    dot_product += b[j] * truth[j];
+                    norm_b += static_cast < double > (b[j]) * b[j];
+                    norm_truth += truth[j] * truth[j];
+                }
+                square_sum += error2;
+                const double cos_angle = std::min(dot_product / std::sqrt(norm_b * norm_truth), 1.0);
+                result.max_angle_error_deg = std::max(result.max_angle_error_deg, static_cast < float > (std::acos(cos_angle) * 57.29577951));
+            }
+            const uint16_t n = std::max < uint16_t > (samples, 1);
+            result.rms_error_nt = static_cast < float > (std::sqrt(square_sum / n) * 1.0e9);
+            result.float_cycles = static_cast < uint32_t > (float_total / n);
+            result.double_cycles = static_cast < uint32_t > (double_total / n);
+        }
+        return results;
+    }
+};
+#endif
+
+class SunEphemeris {
+    //low precision sun from the astronomical almanac(mean longitude and anomaly, equation of center, mean obliquity):
+    //~0.01 deg from 1950 to 2050, which is far below the coarse sun sensors. the result is mean equator and equinox of
+    //date, TEME differs from that by the nutation in right ascension(< 0.005 deg), so it is used as TEME directly.
+    //the eclipse geometry is the earth as a sphere and the sun as a disc, seen from the satellite
+    public:
+    static constexpr double AU_KM = 149597870.7;
+    static constexpr float SUN_RADIUS_KM = 696000.0f;
+    static constexpr float EARTH_RADIUS_KM = 6378.137f;
+    enum class ShadowModel: uint8_t {
+        CYLINDRICAL, //umbra only, parallel sun rays: 0 or 1, no penumbra
+        CONICAL //umbra and penumbra from the apparent discs, the fraction of the sun disc that is visible
+    };
+
+    static void position(double julian_date, Vector3 & direction, float & distance_km) { //TEME unit vector and distance
+        constexpr double DEG = 3.14159265358979323846 / 180.0;
+        const double t = (julian_date - 2451545.0) / 36525.0; //julian centuries from J2000(UTC for UT1 is plenty here)
+        const double mean_longitude = 280.460 + 36000.771 * t;
+        const double mean_anomaly = (357.5291092 + 35999.05034 * t) * DEG;
+        const double longitude = (mean_longitude + 1.914666471 * std::sin(mean_anomaly) + 0.019994643 * std::sin(2.0 * mean_anomaly)) * DEG;
+        const double obliquity = (23.439291 - 0.0130042 * t) * DEG;
+        const double distance_au = 1.000140612 - 0.016708617 * std::cos(mean_anomaly) - 0.000139589 * std::cos(2.0 * mean_anomaly);
+        direction = { static_cast < float > (std::cos(longitude)), static_cast < float > (std::cos(obliquity) * std::sin(longitude)),
+            static_cast < float > (std::sin(obliquity) * std::sin(longitude)) };
+        distance_km = static_cast < float > (distance_au * AU_KM);
+    }
+
+    static float illumination(const Vector3 & position_km, const Vector3 & sun_direction, float sun_distance_km, ShadowModel model) {
+        //1 in full sun, 0 in the umbra
+        const float r = norm(position_km);
+        if (model == ShadowModel::CYLINDRICAL) {
+            const float along = dot(position_km, sun_direction);
+            if (along >= 0.0f) return 1.0f;
+            const float across2 = r * r - along * along;
+            return across2 < EARTH_RADIUS_KM * EARTH_RADIUS_KM ? 0.0f : 1.0f;
+        }
+        //apparent radii of the sun(a) and earth(b) discs and the angle between their centers(c)
+        Vector3 to_sun;
+        for (int i = 0; i < 3; i++) to_sun[i] = sun_direction[i] * sun_distance_km - position_km[i];
+        const float sun_range = norm(to_sun);
+        const float a = std::asin(std::min(SUN_RADIUS_KM / sun_range, 1.0f));
+        const float b = std::asin(std::min(EARTH_RADIUS_KM / r, 1.0f));
+        const float cos_c = -dot(position_km, to_sun) / (r * sun_range);
+        const float c = std::acos(std::min(std::max(cos_c, -1.0f), 1.0f));
+        if (c >= a + b) return 1.0f; //discs apart
+        if (c <= b - a) return 0.0f; //sun disc behind the earth disc
+        if (c <= a - b) return 1.0f - (b * b) / (a * a); //earth disc inside the sun disc(never in LEO)
+        //partial overlap: the lens is a segment of each disc cut by the common chord(half length y, x from the sun center).
+        //the earth segment is a sliver of a disc 270x the size, so its angle comes from atan2 and the area from
+        //r^2 (t - sin t cos t), acos(1 - tiny) in float throws away most of the sun disc
+        const float x = ((c - b) * (c + b) + a * a) / (2.0f * c);
+        const float y = std::sqrt(std::max(a * a - x * x, 0.0f));
+        const float sun_angle = std::atan2(y, x), earth_angle = std::atan2(y, c - x);
+        const float overlap = a * a * (sun_angle - 0.5f * std::sin(2.0f * sun_angle)) + b * b * (earth_angle - 0.5f * std::sin(2.0f * earth_angle));
+        return std::min(std::max(1.0f - overlap / (3.14159265f * a * a), 0.0f), 1.0f);
+    }
+};
+
+class SunReference {
+    //sun direction and eclipse state for the control loop, on the same time base as the orbit(OrbitPropagator::julian_date).
+    //every REFRESH_MS the ephemeris and the shadow model are evaluated once at the orbit position, and the orbit is run
+    //ahead as a circle(the osculating plane and rate, a few km off after one revolution for our eccentricity) to find the
+    //next shadow entry and exit. in between, the eclipse state is just now against those two times and the sun direction
+    //(it moves 1 deg a day) is held, so the per cycle cost is a couple of compares. the predicted entry is what lets
+    //SAFE_MODE go in ahead of an eclipse instead of after LOW_POWER has tripped
+    public:
+    static constexpr uint32_t REFRESH_MS = 10000;
+    static constexpr float ECLIPSE_ILLUMINATION = 0.5f; //below this(half way through the penumbra) we count as in eclipse
+    static constexpr uint32_t PREDICTION_STEP_MS = 60000; //coarse search step over one revolution, the penumbra is ~10 s...
+    static constexpr uint8_t BISECTION_STEPS = 6; //...so the crossings are then bisected down to ~1 s
+
+    SunEphemeris::ShadowModel shadow_model = SunEphemeris::ShadowModel::CONICAL;
+
+    void update(uint32_t now, const OrbitPropagator & orbit) {
+        if (!orbit.valid()) return;
+        if (sample_valid && static_cast < int32_t > (now - sample_time) < static_cast < int32_t > (REFRESH_MS)) return;
+        Vector3 position, velocity;
+        if (!orbit.position(now, position, velocity)) return;
+        SunEphemeris::position(orbit.julian_date(now), sun_direction, sun_distance_km);
+        sample_time = now;
+        sample_illumination = SunEphemeris::illumination(position, sun_direction, sun_distance_km, shadow_model);
+        sample_eclipse = sample_illumination < ECLIPSE_ILLUMINATION;
+        predict_crossings(position, velocity);
+        sample_valid = true;
+    }
+
+    bool valid() const {
+        return sample_valid;
+    }
+
+    bool direction(Vector3 & sun_inertial) const { //unit, TEME
+        if (!sample_valid) return false;
+        sun_inertial = sun_direction;
+        return true;
+    }
+
+    float illumination() const { //visible fraction of the sun disc at the last evaluation, 1 without an orbit
+        return sample_valid ? sample_illumination : 1.0f;
+    }
+
+    bool in_eclipse(uint32_t now) const {
+        if (!sample_valid) return false;
+        bool eclipse = sample_eclipse;
+        for (uint8_t i = 0; i < crossing_count; i++) {
+            if (static_cast < int32_t > (now - crossing_time[i]) >= 0) eclipse = !eclipse;
+        }
+        return eclipse;
+    }
+
+    int32_t time_to_eclipse_ms(uint32_t now) const { //0 while in eclipse, -1 if there is none within one revolution(or no orbit)
+        if (!sample_valid) return -1;
+        if (in_eclipse(now)) return 0;
+        for (uint8_t i = 0; i < crossing_count; i++) {
+            const int32_t remaining = static_cast < int32_t > (crossing_time[i] - now);
+            if (remaining > 0 && sample_eclipse == (i % 2 == 1)) return remaining; //the crossings alternate, pick an entry
+        }
+        return -1;
+    }
+
+    int32_t time_to_sunlight_ms(uint32_t now) const { //0 while in the sun, -1 if unknown
+        if (!sample_valid) return -1;
+        if (!in_eclipse(now)) return 0;
+        for (uint8_t i = 0; i < crossing_count; i++) {
+            const int32_t remaining = static_cast < int32_t > (crossing_time[i] - now);
+            if (remaining > 0 && sample_eclipse == (i % 2 == 0)) return remaining;
+        }
+        return -1;
+    }
+
+    uint8_t upcoming_crossings(uint32_t now, std::array < int32_t, 2 > & in_ms) const { //the boundaries still ahead of now, in order
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < crossing_count; i++) {
+            const int32_t remaining = static_cast < int32_t > (crossing_time[i] - now);
+            if (remaining > 0) in_ms[count++] = remaining;
+        }
+        return count;
+    }
+
+    uint32_t period_ms() const { //of the orbit the crossings were predicted on
+        return orbit_period_ms;
+    }
+
+    private:
+    Vector3 sun_direction {};
+    float sun_distance_km = 0.0f;
+    uint32_t sample_time = 0;
+    float sample_illumination = 1.0f;
+    bool sample_eclipse = false;
+    bool sample_valid = false;
+    std::array < uint32_t, 2 > crossing_time {}; //the next shadow boundary crossings after sample_time, entry and exit alternate
+    uint8_t crossing_count = 0;
+    uint32_t orbit_period_ms = 0;
+
+    void predict_crossings(const Vector3 & position, const Vector3 & velocity) {
+        //circular motion in the current orbit plane: p(t) = |r| (cos(nt) u + sin(nt) w)
+        const Vector3 h = cross(position, velocity);
+        const float r = norm(position);
+        const float rate = norm(h) / (r * r); //rad/s
+        crossing_count = 0;
+        if (r == 0.0f || rate <= 0.0f) return;
+        const Vector3 u { position[0] / r, position[1] / r, position[2] / r };
+        const float h_norm = norm(h);
+        const Vector3 w = cross({ h[0] / h_norm, h[1] / h_norm, h[2] / h_norm }, u);
+        auto eclipse_at = [ & ](float t_s) {
+            const float angle = rate * t_s;
+            const float c = r * std::cos(angle), s = r * std::sin(angle);
+            const Vector3 p { c * u[0] + s * w[0], c * u[1] + s * w[1], c * u[2] + s * w[2] };
+            return SunEphemeris::illumination(p, sun_direction, sun_distance_km, shadow_model) < ECLIPSE_ILLUMINATION;
+        };
+        const float period_s = 6.28318531f / rate;
+        orbit_period_ms = static_cast < uint32_t > (period_s * 1000.0f);
+        const float step_s = PREDICTION_STEP_MS * 0.001f;
+        bool state = sample_eclipse;
+        for (float t = step_s; t < period_s + step_s && crossing_count < crossing_time.size(); t += step_s) {
+            if (eclipse_at(t) == state) continue;
+            float low = t - step_s, high = t;
+            for (uint8_t i = 0; i < BISECTION_STEPS; i++) {
+                const float middle = 0.5f * (low + high);
+                if (eclipse_at(middle) == state) low = middle;
+                else high = middle;
+            }
+            crossing_time[crossing_count++] = sample_time + static_cast < uint32_t > (0.5f * (low + high) * 1000.0f);
+            state = !state;
+        }
+    }
+};
+
+class PowerScheduler {
+    //battery state of charge forecast over the next orbit, per ADCS mode, and the mode ladder built on it. the orbit is cut
+    //into sun and shadow intervals at the SunReference crossings(one revolution, the rest taken as sun); in the sun the
+    //battery gets the array power for the mode's pointing minus the loads, in the shadow it gives the loads. the state of
+    //charge is piecewise linear that way, so its minimum is at one of the interval ends. a mode is kept while its forecast
+    //minimum stays above KEEP_CHARGE and only entered above ENTER_CHARGE, which is the hysteresis that stops the flapping.
+    //the forecast alone says nothing about FaultManager::LOW_POWER_THRESHOLD(bus power, W), so a mode also needs the bus
+    //power it would leave(the measured one with this mode's ADCS load instead of the current one's) to stay KEEP_MARGIN_W
+    //over the threshold, ENTER_MARGIN_W to be entered. a bus that sinks slowly makes the scheduler step down(NOMINAL_POINTING
+    //-> SUN_ACQUISITION -> SAFE_MODE) before the fault trips, a sudden drop under the threshold is left to the fault
+    public:
+    static constexpr float BATTERY_CAPACITY_WH = 40.0f;
+    static constexpr float PLATFORM_LOAD_W = 4.5f; //everything that is not the ADCS(OBC, radio receive, heaters)
+    static constexpr float ARRAY_POWER_W = 14.0f; //panels normal to the sun
+    //per ADCSMode: the ADCS load and the fraction of ARRAY_POWER_W its pointing gives on average over the sunlit part
+    //(a tumbling or uncontrolled bus averages about a third of a face on)
+    static constexpr float MODE_LOAD_W[5] = { 1.2f, 1.0f, 2.5f, 0.3f, 0.8f };
+    static constexpr float MODE_ARRAY_FRACTION[5] = { 0.35f, 0.9f, 0.7f, 0.35f, 0.35f };
+    static constexpr float KEEP_CHARGE = 0.35f;
+    static constexpr float ENTER_CHARGE = 0.5f;
+    static constexpr float KEEP_MARGIN_W = 0.5f; //over FaultManager::LOW_POWER_THRESHOLD
+    static constexpr float ENTER_MARGIN_W = 1.0f; //same as the SAFE_MODE exit hysteresis
+    static constexpr uint32_t UPDATE_PERIOD_MS = 10000;
+    //without an orbit(no TLE or time reference yet) the worst case is taken: a long eclipse starting right now
+    static constexpr uint32_t DEFAULT_PERIOD_MS = 5700000;
+    static constexpr uint32_t DEFAULT_ECLIPSE_MS = 2160000;
+
+    std::array < float, 5 > forecast_min_charge {}; //per ADCSMode, lowest state of charge over the next orbit
+
+    void update(uint32_t now, float battery_charge, float power_level, const SunReference & sun) {
+        bus_power = power_level; //every cycle, the bus check in allows() has to follow the fault check's rate
+        if (updated && static_cast < int32_t > (now - last_update) < static_cast < int32_t > (UPDATE_PERIOD_MS)) return;
+        last_update = now;
+        updated = true;
+        //sun/shadow boundaries over one revolution from now
+        std::array < int32_t, 3 > boundary {};
+        uint8_t boundary_count = 0;
+        bool eclipse = true;
+        int32_t period = static_cast < int32_t > (DEFAULT_PERIOD_MS);
+        if (sun.valid() && sun.period_ms() > 0) {
+            eclipse = sun.in_eclipse(now);
+            period = static_cast < int32_t > (sun.period_ms());
+            std::array < int32_t, 2 > crossings {};
+            boundary_count = sun.upcoming_crossings(now, crossings);
+            for (uint8_t i = 0; i < boundary_count; i++) boundary[i] = std::min(crossings[i], period);
+        } else {
+            boundary[boundary_count++] = static_cast < int32_t > (DEFAULT_ECLIPSE_MS);
+        }
+        boundary[boundary_count++] = period;
+        for (uint8_t mode = 0; mode < forecast_min_charge.size(); mode++) {
+            const float sun_net_w = ARRAY_POWER_W * MODE_ARRAY_FRACTION[mode] - PLATFORM_LOAD_W - MODE_LOAD_W[mode];
+            const float shadow_net_w = -PLATFORM_LOAD_W - MODE_LOAD_W[mode];
+            float charge = battery_charge, lowest = battery_charge;
+            int32_t start = 0;
+            bool in_shadow = eclipse;
+            for (uint8_t i = 0; i < boundary_count; i++) {
+                const float hours = static_cast < float > (boundary[i] - start) * (1.0f / 3600000.0f);
+                charge = std::min(charge + (in_shadow ? shadow_net_w : sun_net_w) * hours / BATTERY_CAPACITY_WH, 1.0f);
+                lowest = std::min(lowest, charge);
+                start = boundary[i];
+                in_shadow = !in_shadow;
+            }
+            forecast_min_charge[mode] = lowest;
+        }
+    }
+
+    bool allows(ADCSMode mode, ADCSMode current) const {
+        const bool keep = rank(mode) <= rank(current);
+        const float mode_bus_power = bus_power + MODE_LOAD_W[static_cast < uint8_t > (current)] - MODE_LOAD_W[static_cast < uint8_t > (mode)];
+        if (mode_bus_power < FaultManager::LOW_POWER_THRESHOLD + (keep ? KEEP_MARGIN_W : ENTER_MARGIN_W)) return false;
+        if (!updated) return true;
+        return forecast_min_charge[static_cast < uint8_t > (mode)] >= (keep ? KEEP_CHARGE : ENTER_CHARGE);
+    }
+
+    ADCSMode limit(ADCSMode wanted, ADCSMode current) const {
+        //DETUMBLING and FAULT_RECOVERY are about keeping the bus alive and draw little, they are never held back
+        if (wanted == ADCSMode::DETUMBLING || wanted == ADCSMode::FAULT_RECOVERY || wanted == ADCSMode::SAFE_MODE) return wanted;
+        if (wanted == ADCSMode::NOMINAL_POINTING) {
+            if (allows(ADCSMode::NOMINAL_POINTING, current)) return ADCSMode::NOMINAL_POINTING;
+            wanted = ADCSMode::SUN_ACQUISITION; //panels to the sun is the most power positive thing we can do
+        }
+        return allows(ADCSMode::SUN_ACQUISITION, current) ? ADCSMode::SUN_ACQUISITION : ADCSMode::SAFE_MODE;
+    }
+
+    private:
+    uint32_t last_update = 0;
+    bool updated = false;
+    float bus_power = FaultManager::LOW_POWER_THRESHOLD + ENTER_MARGIN_W; //W, last measured, until the first update
+
+    static uint8_t rank(ADCSMode mode) { //position on the ladder, higher draws more
+        switch (mode) {
+        case ADCSMode::SAFE_MODE:
+            return 0;
+        case ADCSMode::NOMINAL_POINTING:
+            return 2;
+        default:
+            return 1;
+        }
+    }
+};
+
+class WatchdogTimer {
+    public:
+        //implementation of the WDT(depending on which type of WDT we use)
+        void initialize() {
+            /*watchdog implementation*/
+        }
+    void refresh_watchdog() {
+        /*watchdog implementation*/
+    }
+    static constexpr uint32_t TIMEOUT_MS = 1600; //time from the last refresh to the reset
+};
+
+enum class WatchdogToken: uint8_t { //every stage of run_cycle checks in with its token once per cycle
+    SENSORS,
+    STATE_TRANSITION,
+    MODE_BEHAVIOR,
+    FAULTS,
+    COUNT
+};
+
+class WatchdogSupervisor {
+    //the hardware WDT is only kicked when every stage has checked in and the cycle took a sane amount of time.
+    //a stage that silently skips its work, a cycle that overruns or a loop that runs too fast all stop the kicks,
+    //the reason is saved in NVM and the WDT then resets us
+    public: enum class Violation: uint8_t {
+        NONE,
+        MISSING_TOKEN,
+        TOO_EARLY,
+        TOO_LATE
+    };
+
+    static constexpr uint8_t ALL_TOKENS = (1u << static_cast < uint8_t > (WatchdogToken::COUNT)) - 1u;
+    static constexpr uint8_t FAILED_CYCLE_TOLERANCE = 3; //consecutive bad cycles before we give up kicking(one late cycle is not worth a reset),
+    //fewer when the WDT would run out before the next cycle anyway
+
+    static constexpr uint32_t MAX_WINDOW_MS = 1500; //margin under the 1.6s hardware timeout
+
+    uint32_t window_min_ms = 50; //a cycle shorter than this means the loop is running away
+    uint32_t window_max_ms = 1000; //has to stay below the 1.6s hardware timeout
+    NonVolatileMemory::WatchdogDiagnostic last_reset_diagnostic {}; //what the supervisor saw before the previous reset(violation NONE if it was not us)
+
+    template < typename Nvm >
+    void initialize(Nvm & nvm, uint32_t now) {
+        const NonVolatileMemory::WatchdogDiagnostic diagnostic = nvm.read_watchdog_diagnostic();
+        if (diagnostic.checksum == diagnostic.compute_checksum()) {
+            last_reset_diagnostic = diagnostic;
+        }
+        nvm.write_watchdog_diagnostic(make_diagnostic(Violation::NONE, 0, now)); //clear it so it is not reported twice
+        hardware.initialize();
+        tokens = 0;
+        failed_cycles = 0;
+        last_cycle_time = now;
+        last_refresh_time = now;
+        first_cycle = true;
+    }
+
+    void set_window(uint32_t min_ms, uint32_t max_ms) {
+        //takes effect after the next service: the cycle that changes the period was still timed with the old one
+        pending_min_ms = min_ms;
+        pending_max_ms = std::min(max_ms, MAX_WINDOW_MS);
+        window_pending = true;
+    }
+
+    void check_in(WatchdogToken token) {
+        tokens |= static_cast < uint8_t > (1u << static_cast < uint8_t > (token));
+    }
+
+    template < typename Nvm >
+    void service(Nvm & nvm, uint32_t now) { //called once at the end of every cycle instead of kicking the WDT directly
+        if (expired) {
+            return; //let the hardware WDT run out
+        }
+        const uint32_t elapsed = now - last_cycle_time;
+        Violation violation = Violation::NONE;
+        if (tokens != ALL_TOKENS) {
+            violation = Violation::MISSING_TOKEN;
+        } else if (elapsed < window_min_ms && !first_cycle) { //the first cycle after boot has no previous kick to compare with
+            violation = Violation::TOO_EARLY;
+        } else if (elapsed > window_max_ms) {
+            violation = Violation::TOO_LATE;
+        }
+
+        if (violation == Violation::NONE) {
+            hardware.refresh_watchdog();
+            last_refresh_time = now;
+            if (failed_cycles > 0) { //recovered, the saved reason would be wrong for a later reset that is not ours
+                nvm.write_watchdog_diagnostic(make_diagnostic(Violation::NONE, 0, now));
+            }
+            failed_cycles = 0;
+        } else {
+            if (failed_cycles == 0) { //saved on the first bad cycle(FRAM write is cheap), the WDT may reset us before the next one
+                nvm.write_watchdog_diagnostic(make_diagnostic(violation, static_cast < uint8_t > (ALL_TOKENS & ~tokens), now));
+            }
+            failed_cycles++;
+        }
+        tokens = 0;
+        last_cycle_time = now;
+        first_cycle = false;
+        if (window_pending) {
+            window_min_ms = pending_min_ms;
+            window_max_ms = pending_max_ms;
+            window_pending = false;
+        }
+        //tolerating another bad cycle only makes sense if it can come before the WDT runs out
+        if (failed_cycles > 0 && (failed_cycles >= FAILED_CYCLE_TOLERANCE || now - last_refresh_time + window_max_ms >= WatchdogTimer::TIMEOUT_MS)) {
+            expired = true;
+        }
+    }
+
+    private: WatchdogTimer hardware;
+    uint8_t tokens = 0;
+    uint8_t failed_cycles = 0;
+    uint32_t last_cycle_time = 0; //previous service, the window is checked against it
+    uint32_t last_refresh_time = 0; //previous real refresh, the WDT counts from it
+    bool first_cycle = true;
+    bool expired = false;
+    uint32_t pending_min_ms = 0;
+    uint32_t pending_max_ms = 0;
+    bool window_pending = false;
+
+    static NonVolatileMemory::WatchdogDiagnostic make_diagnostic(Violation violation, uint8_t missing_tokens, uint32_t now) {
+        NonVolatileMemory::WatchdogDiagnostic diagnostic { now, static_cast < uint8_t > (violation), missing_tokens, 0 };
+        diagnostic.checksum = diagnostic.compute_checksum();
+        return diagnostic;
+    }
+};
+
+class CycleProfiler { //execution time of run_cycle, in core clock cycles
+    public:
+    uint32_t last_cycles = 0;
+    uint32_t max_cycles = 0;
+    uint32_t average_cycles = 0; //exponential moving average(1/16 weight), cheap and does not overflow
+    uint32_t cycle_count = 0;
+
+    void start() {
+        start_cycles = read_cycle_counter();
+    }
+
+    void stop() {
+        last_cycles = read_cycle_counter() - start_cycles;
+        max_cycles = std::max(max_cycles, last_cycles);
+        average_cycles = (cycle_count == 0) ? last_cycles : average_cycles - (average_cycles >> 4) + (last_cycles >> 4);
+        cycle_count++;
+    }
+
+    private: uint32_t start_cycles = 0;
+};
+
+class PowerStateManager {
+    //per ADCSMode MCU clock, control rate and sensor sampling, applied on every mode transition. the control rate sets the
+    //cyclic executive period(and with it the watchdog window), each sensor is read only when its own period is due and
+    //the gyro can be switched off. the energy of every cycle is estimated from the measured run time at the mode's clock
+    //and the sensor activity, so the saving of each profile can be seen in telemetry
+    public:
+    enum class Sensor: uint8_t {
+        GYRO,
+        MAGNETOMETER,
+        SUN_SENSORS,
+        COUNT
+    };
+    struct Profile {
+        uint32_t cpu_clock_hz;
+        uint16_t cycle_period_ms;
+        std::array < uint16_t, static_cast < uint8_t > (Sensor::COUNT) > sample_period_ms; //0 is powered off
+    };
+    //indexed by ADCSMode. SAFE_MODE only damps with the magnetometer(the rate comes from the field), so the gyro is off
+    static constexpr Profile PROFILES[5] = {
+        { 80000000, 100, { 100, 100, 1000 } }, //DETUMBLING
+        { 48000000, 200, { 200, 200, 200 } }, //SUN_ACQUISITION
+        { 80000000, 100, { 100, 100, 100 } }, //NOMINAL_POINTING
+        { 16000000, 1000, { 0, 1000, 1000 } }, //SAFE_MODE
+        { 48000000, 200, { 200, 200, 200 } } //FAULT_RECOVERY
+    };
+    //power model(datasheet numbers, 3.3 V)
+    static constexpr float MCU_RUN_W_PER_MHZ = 0.0004f; //~120 uA/MHz
+    static constexpr float MCU_SLEEP_W = 0.0005f; //stop mode between cycles(TicklessIdle)
+    static constexpr float GYRO_POWER_W = 0.02f; //continuous while powered, it needs too long to start up to duty cycle
+    static constexpr float MAGNETOMETER_SAMPLE_UJ = 60.0f; //one measurement including the set/reset pulse
+    static constexpr float SUN_SENSOR_SAMPLE_UJ = 15.0f; //six ADC conversions with the photodiode bias on
+
+    float last_cycle_energy_uj = 0.0f;
+    std::array < float, 5 > average_power_mw {}; //per ADCSMode, moving average(1/16 weight) of the estimate
+
+    const Profile & profile() const {
+        return PROFILES[static_cast < uint8_t > (mode)];
+    }
+
+    ADCSMode active_mode() const {
+        return mode;
+    }
+
+    void apply(ADCSMode new_mode) {
+        mode = new_mode;
+        for (uint32_t & time: last_sample_time) time = 0; //everything is read in the first cycle of the new mode
+        for (bool & taken: sampled) taken = false;
+    }
+
+    bool powered(Sensor sensor) const {
+        return profile().sample_period_ms[static_cast < uint8_t > (sensor)] != 0;
+    }
+
+    bool due(Sensor sensor, uint32_t now) { //true(and the sample is counted) when the sensor should be read this cycle
+        const uint8_t index = static_cast < uint8_t > (sensor);
+        const uint16_t period = profile().sample_period_ms[index];
+        if (period == 0) return false;
+        //half a cycle of slack, or a cycle that starts a little early would skip a sample and halve the rate
+        if (sampled[index] && now - last_sample_time[index] + profile().cycle_period_ms / 2 < period) return false;
+        last_sample_time[index] = now;
+        sampled[index] = true;
+        samples[index]++;
+        return true;
+    }
+
+    void end_cycle(uint32_t run_cycles) { //after the cycle, with its run time from the CycleProfiler
+        const Profile & p = profile();
+        const float period_s = p.cycle_period_ms * 0.001f;
+        const float run_s = std::min(static_cast < float > (run_cycles) / static_cast < float > (p.cpu_clock_hz), period_s);
+        float energy_uj = (MCU_RUN_W_PER_MHZ * (p.cpu_clock_hz * 1.0e-6f) * run_s + MCU_SLEEP_W * (period_s - run_s)) * 1.0e6f;
+        if (powered(Sensor::GYRO)) energy_uj += GYRO_POWER_W * period_s * 1.0e6f;
+        energy_uj += MAGNETOMETER_SAMPLE_UJ * samples[static_cast < uint8_t > (Sensor::MAGNETOMETER)] +
+            SUN_SENSOR_SAMPLE_UJ * samples[static_cast < uint8_t > (Sensor::SUN_SENSORS)];
+        samples = {};
+        last_cycle_energy_uj = energy_uj;
+        float & average = average_power_mw[static_cast < uint8_t > (mode)];
+        const float power_mw = energy_uj * 0.001f / period_s;
+        average = (average == 0.0f) ? power_mw : average + (power_mw - average) * (1.0f / 16.0f);
+    }
+
+    private:
+    ADCSMode mode = ADCSMode::DETUMBLING;
+    std::array < uint32_t, static_cast < uint8_t > (Sensor::COUNT) > last_sample_time {};
+    std::array < bool, static_cast < uint8_t > (Sensor::COUNT) > sampled {};
+    std::array < uint16_t, static_cast < uint8_t > (Sensor::COUNT) > samples {}; //this cycle
+};
+
+class TicklessIdle {
+    //between two cycles the core sleeps instead of spinning in a delay. releases are on a fixed grid(release += period)
+    //so the run time of a cycle does not push the next one back. the long part of the wait is spent in stop mode on the
+    //low power wakeup timer, set STOP_WAKEUP_LATENCY_MS short of the release for the PLL and flash to come back, and the
+    //rest in WFI woken by the 1 ms tick. a cycle that runs past its release starts the next one at once and the grid is
+    //moved to it(no burst of catch up cycles). asleep and awake time are counted per mode
+    public:
+    static constexpr uint32_t STOP_WAKEUP_LATENCY_MS = 2; //stop mode exit to running at the profile clock
+    static constexpr uint32_t MIN_STOP_MS = 5; //shorter waits are not worth the stop mode entry and exit, WFI only
+
+    struct Plan {
+        uint32_t release; //when the next cycle starts
+        uint32_t stop_ms; //how long to spend in stop mode first(0: WFI only)
+    };
+
+    std::array < uint64_t, 5 > asleep_ms {}; //per ADCSMode
+    std::array < uint64_t, 5 > awake_ms {};
+    uint32_t overruns = 0; //cycles that ran past their release
+
+    Plan plan(uint32_t now, uint32_t period_ms, ADCSMode mode) { //at the end of a cycle
+        if (!started) {
+            release = now;
+            cycle_start = now;
+            started = true;
+        }
+        awake_ms[static_cast < uint8_t > (mode)] += now - cycle_start;
+        sleep_mode = mode;
+        sleep_start = now;
+        release += period_ms;
+        const int32_t remaining = static_cast < int32_t > (release - now);
+        if (remaining <= 0) {
+            overruns++;
+            release = now;
+            return { release, 0 };
+        }
+        const uint32_t stop_ms = (static_cast < uint32_t > (remaining) >= MIN_STOP_MS + STOP_WAKEUP_LATENCY_MS) ?
+            static_cast < uint32_t > (remaining) - STOP_WAKEUP_LATENCY_MS : 0;
+        return { release, stop_ms };
+    }
+
+    void woke(uint32_t now) { //at the start of the next cycle
+        asleep_ms[static_cast < uint8_t > (sleep_mode)] += now - sleep_start;
+        cycle_start = now;
+    }
+
+    float sleep_fraction(ADCSMode mode) const {
+        const uint8_t index = static_cast < uint8_t > (mode);
+        const uint64_t total = asleep_ms[index] + awake_ms[index];
+        return (total == 0) ? 0.0f : static_cast < float > (asleep_ms[index]) / static_cast < float > (total);
+    }
+
+    private:
+    uint32_t release = 0;
+    uint32_t cycle_start = 0;
+    uint32_t sleep_start = 0;
+    ADCSMode sleep_mode = ADCSMode::DETUMBLING;
+    bool started = false;
+};
+
+class BitWriter { //MSB first bit stream straight into a caller owned buffer
+    public: explicit BitWriter(uint8_t * buffer): out(buffer) {}
+
+    void write(uint32_t value, uint8_t bits) {
+        for (int8_t bit = bits - 1; bit >= 0; bit--) {
+            if (bit_position == 0) * out = 0;
+            if ((value >> bit) & 1u) * out |= static_cast < uint8_t > (0x80u >> bit_position);
+            if (++bit_position == 8) {
+                bit_position = 0;
+                out++;
+            }
+        }
+    }
+
+    uint8_t * end() const { //first byte after the stream(a partly filled byte counts)
+        return (bit_position == 0) ? out : out + 1;
+    }
+
+    private: uint8_t * out;
+    uint8_t bit_position = 0;
+};
+
+class BitReader {
+    public: explicit BitReader(const uint8_t * buffer): in(buffer) {}
+
+    uint32_t read(uint8_t bits) {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < bits; i++) {
+            value = (value << 1) | ((( * in) >> (7 - bit_position)) & 1u);
+            if (++bit_position == 8) {
+                bit_position = 0;
+                in++;
+            }
+        }
+        return value;
+    }
+
+    private: const uint8_t * in;
+    uint8_t bit_position = 0;
+};
+
+constexpr uint8_t bits_for_range(float min, float max, float resolution) {
+    //smallest number of bits that can hold every step of size resolution between min and max
+    const float steps = (max - min) / resolution;
+    uint8_t bits = 0;
+    while (static_cast < float > ((1ull << bits) - 1) < steps) bits++;
+    return bits;
+}
+
+template < typename Spec >
+struct QuantizedField: Spec {
+    //a telemetry field that only declares its range and resolution(and how to get at it in the ADCSState),
+    //the bit width and the pack/unpack code are worked out at compile time
+    static constexpr uint8_t BITS = bits_for_range(Spec::MIN, Spec::MAX, Spec::RESOLUTION);
+    static constexpr uint32_t MAX_CODE = (1ul << BITS) - 1;
+    static_assert(BITS > 0 && BITS <= 32, "field does not fit in 32 bits");
+
+    static void pack(BitWriter & writer, const ADCSState & state) {
+        const float clamped = std::min(std::max(Spec::get(state), Spec::MIN), Spec::MAX);
+        writer.write(static_cast < uint32_t > ((clamped - Spec::MIN) / Spec::RESOLUTION + 0.5f), BITS);
+    }
+
+    static void unpack(BitReader & reader, ADCSState & state) {
+        Spec::set(state, Spec::MIN + static_cast < float > (reader.read(BITS)) * Spec::RESOLUTION);
+    }
+};
+
+template < typename...Fields >
+struct PackedSchema {
+    static constexpr uint32_t SAMPLE_BITS = (Fields::BITS + ...);
+
+    static void pack(BitWriter & writer, const ADCSState & state) {
+        (Fields::pack(writer, state), ...);
+    }
+
+    static void unpack(BitReader & reader, ADCSState & state) {
+        (Fields::unpack(reader, state), ...);
+    }
+};
+
+//the housekeeping sample schema, ranges cover the whole mission(anything outside is clamped to the edge)
+struct ModeSpec {
+    static constexpr float MIN = 0.0f, MAX = static_cast < float > (ADCSMode::FAULT_RECOVERY), RESOLUTION = 1.0f;
+    static float get(const ADCSState & state) { return static_cast < float > (state.current_mode); }
+    static void set(ADCSState & state, float value) { state.current_mode = static_cast < ADCSMode > (static_cast < uint8_t > (value + 0.5f)); }
+};
+template < uint8_t AXIS >
+struct AngularRateSpec {
+    static constexpr float MIN = -0.5f, MAX = 0.5f, RESOLUTION = 0.00025f; //rad/s, 12 bits(detumbling starts well inside 0.5 rad/s)
+    static float get(const ADCSState & state) { return state.angular_velocity[AXIS]; }
+    static void set(ADCSState & state, float value) { state.angular_velocity[AXIS] = value; }
+};
+struct PowerSpec {
+    static constexpr float MIN = 0.0f, MAX = 20.0f, RESOLUTION = 0.02f; //W, 10 bits
+    static float get(const ADCSState & state) { return state.power_level; }
+    static void set(ADCSState & state, float value) { state.power_level = value; }
+};
+using HousekeepingSchema = PackedSchema < QuantizedField < ModeSpec > , QuantizedField < AngularRateSpec < 0 >> , QuantizedField < AngularRateSpec < 1 >> ,
+    QuantizedField < AngularRateSpec < 2 >> , QuantizedField < PowerSpec >> ;
+static_assert(HousekeepingSchema::SAMPLE_BITS == 49, "housekeeping sample layout changed, update the ground unpacker");
+
+class TelemetryHistory {
+    //time series store for everything update_sensor_data and the estimator produce between ground passes.
+    //every channel is written into its own fixed size blocks, a block starts with a raw sample and then holds a bit stream of:
+    //  '0' + elias gamma run length      : the previous sample repeated(same value, same time step) run length times
+    //  '1' + time + value                : a new sample, where
+    //      time  = '0' if the delta of delta is zero, else '1' + zigzag varint of the delta of delta
+    //      value = gorilla style XOR with the previous float: '0' same value, '10' + bits inside the previous window,
+    //              '11' + 5 bit leading zeros + 5 bit(length - 1) + the meaningful bits
+    //steady channels(mode, a quiet power bus) cost almost nothing and noisy rates about a third of their raw size.
+    //the blocks are also the downlink unit, the ground decodes them with the same decode_block
+    public: enum class Channel: uint8_t {
+        ANGULAR_RATE_X,
+        ANGULAR_RATE_Y,
+        ANGULAR_RATE_Z,
+        POWER_LEVEL,
+        MODE,
+        ATTITUDE_W,
+        ATTITUDE_X,
+        ATTITUDE_Y,
+        ATTITUDE_Z,
+        COUNT
+    };
+    static constexpr uint8_t CHANNEL_COUNT = static_cast < uint8_t > (Channel::COUNT);
+    static constexpr uint16_t BLOCK_DATA_SIZE = 256;
+    static constexpr uint16_t BLOCK_COUNT = 1024; //~280KB, meant for the external SRAM/FRAM(only the linker script has to know)
+    static constexpr uint16_t WORST_CASE_SAMPLE_BITS = 1 + (1 + 40) + (2 + 5 + 5 + 32);
+    static constexpr uint16_t WORST_CASE_RUN_BITS = 1 + 31;
+
+    struct Block {
+        uint32_t sequence; //increases with every block opened, 0 means unused
+        uint8_t channel;
+        uint16_t sample_count; //samples in the stream, not counting pending_repeats
+        uint16_t pending_repeats; //repeats of the last sample not yet written to the stream(the run is still going)
+        uint16_t bit_count;
+        uint32_t first_time;
+        uint32_t last_time;
+        uint32_t first_value; //raw float bits
+        std::array < uint8_t, BLOCK_DATA_SIZE > data;
+    };
+
+    struct Sample {
+        uint32_t time;
+        float value;
+    };
+
+    std::array < uint16_t, CHANNEL_COUNT > period_ms { 100, 100, 100, 1000, 100, 1000, 1000, 1000, 1000 }; //recording rate per channel, can be changed in flight
+
+    void record(Channel channel, uint32_t time, float value) {
+        const uint8_t c = static_cast < uint8_t > (channel);
+        Encoder & encoder = encoders[c];
+        if (encoder.block != nullptr && time - encoder.last_record_time < period_ms[c]) {
+            return;
+        }
+        encoder.last_record_time = time;
+        uint32_t bits;
+        std::memcpy( & bits, & value, sizeof(bits));
+
+        if (encoder.block == nullptr || encoder.block->sample_count == UINT16_MAX ||
+            encoder.block->bit_count + WORST_CASE_SAMPLE_BITS + WORST_CASE_RUN_BITS > BLOCK_DATA_SIZE * 8) {
+            open_block(c, time, bits);
+            return;
+        }
+        Block & block = * encoder.block;
+        const int32_t delta = static_cast < int32_t > (time - block.last_time);
+        const int32_t delta_of_delta = delta - encoder.previous_delta;
+        if (delta_of_delta == 0 && bits == encoder.previous_bits && block.sample_count > 1 && block.pending_repeats < UINT16_MAX) {
+            block.pending_repeats++;
+        } else {
+            flush_run(block);
+            put_bits(block, 1, 1);
+            if (delta_of_delta == 0) {
+                put_bits(block, 0, 1);
+            } else {
+                put_bits(block, 1, 1);
+                const uint32_t zigzag = (static_cast < uint32_t > (delta_of_delta) << 1) ^ static_cast < uint32_t > (delta_of_delta >> 31);
+                put_varint(block, zigzag);
+            }
+            put_value(block, encoder, bits);
+            block.sample_count++;
+        }
+        encoder.previous_delta = delta;
+        encoder.previous_bits = bits;
+        block.last_time = time;
+    }
+
+    uint16_t find_blocks(Channel channel, uint32_t from, uint32_t to, uint32_t after_sequence, const Block ** out, uint16_t max_blocks) const {
+        //blocks of one channel that overlap [from, to], oldest first, starting after the block with sequence after_sequence
+        //(the caller keeps the last sequence it got so an interrupted download continues where it stopped).
+        //plain scan of the ring, this runs from ground commands and not in the control loop
+        uint16_t found = 0;
+        while (found < max_blocks) {
+            const Block * next = nullptr;
+            for (const Block & block: blocks) {
+                if (block.sequence > after_sequence && block.channel == static_cast < uint8_t > (channel) &&
+                    block.first_time <= to && block.last_time >= from && (next == nullptr || block.sequence < next->sequence)) {
+                    next = & block;
+                }
+            }
+            if (next == nullptr) break;
+            out[found++] = next;
+            after_sequence = next->sequence;
+        }
+        return found;
+    }
+
+    static uint16_t decode_block(const Block & block, Sample * out, uint16_t max_samples) {
+        if (block.sequence == 0 || max_samples == 0) return 0;
+        uint16_t count = 0;
+        uint32_t bits = block.first_value;
+        uint32_t time = block.first_time;
+        int32_t delta = 0;
+        uint8_t leading = 0, trailing = 0;
+        auto emit = [ & ]() {
+            float value;
+            std::memcpy( & value, & bits, sizeof(value));
+            out[count++] = { time, value };
+        };
+        emit();
+        uint16_t position = 0;
+        uint16_t samples_read = 1;
+        while (samples_read < block.sample_count && count < max_samples) {
+            if (get_bits(block, position, 1) == 0) { //run of repeats
+                for (uint32_t run = get_gamma(block, position); run > 0 && count < max_samples; run--) {
+                    time += delta;
+                    emit();
+                }
+                continue;
+            }
+            if (get_bits(block, position, 1) == 1) {
+                const uint32_t zigzag = get_varint(block, position);
+                delta += static_cast < int32_t > ((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+            }
+            time += delta;
+            if (get_bits(block, position, 1) == 1) {
+                if (get_bits(block, position, 1) == 1) {
+                    leading = static_cast < uint8_t > (get_bits(block, position, 5));
+                    const uint8_t length = static_cast < uint8_t > (get_bits(block, position, 5) + 1);
+                    trailing = static_cast < uint8_t > (32 - leading - length);
+                }
+                bits ^= get_bits(block, position, static_cast < uint8_t > (32 - leading - trailing)) << trailing;
+            }
+            emit();
+            samples_read++;
+        }
+        //a run at the very end of the stream(closed block) or still pending(open block)
+        while (position < block.bit_count && count < max_samples && get_bits(block, position, 1) == 0) {
+            for (uint32_t run = get_gamma(block, position); run > 0 && count < max_samples; run--) {
+                time += delta;
+                emit();
+            }
+        }
+        for (uint16_t run = block.pending_repeats; run > 0 && count < max_samples; run--) {
+            time += delta;
+            emit();
+        }
+        return count;
+    }
+
+    bool is_open(const Block * block) const { //still being written into
+        for (const Encoder & encoder: encoders)
+            if (encoder.block == block) return true;
+        return false;
+    }
+
+    private: struct Encoder {
+        Block * block = nullptr;
+        uint32_t last_record_time = 0;
+        int32_t previous_delta = 0;
+        uint32_t previous_bits = 0;
+        uint8_t leading = 0xFF; //window of the last XOR written with its own header, 0xFF until there is one
+        uint8_t trailing = 0;
+    };
+
+    std::array < Block, BLOCK_COUNT > blocks {}; //per instance, the encoders and sequence numbers only know their own ring. ~280KB, so the owner has to live in .bss(see main)
+    std::array < Encoder, CHANNEL_COUNT > encoders {};
+    uint16_t next_block = 0;
+    uint32_t next_sequence = 1;
+
+    void open_block(uint8_t channel, uint32_t time, uint32_t bits) {
+        Encoder & encoder = encoders[channel];
+        if (encoder.block != nullptr) flush_run( * encoder.block);
+        //oldest block gets overwritten, but never one that another channel is still writing into
+        Block * block;
+        do {
+            block = & blocks[next_block];
+            next_block = (next_block + 1) % BLOCK_COUNT;
+        } while (is_open(block));
+        * block = {};
+        block->sequence = next_sequence++;
+        block->channel = channel;
+        block->sample_count = 1;
+        block->first_time = time;
+        block->last_time = time;
+        block->first_value = bits;
+        encoder.block = block;
+        encoder.previous_delta = 0;
+        encoder.previous_bits = bits;
+        encoder.leading = 0xFF;
+    }
+
+    static void flush_run(Block & block) {
+        if (block.pending_repeats == 0) return;
+        put_bits(block, 0, 1);
+        put_gamma(block, block.pending_repeats);
+        block.pending_repeats = 0;
+    }
+
+    static void put_value(Block & block, Encoder & encoder, uint32_t bits) {
+        const uint32_t x = bits ^ encoder.previous_bits;
+        if (x == 0) {
+            put_bits(block, 0, 1);
+            return;
+        }
+        put_bits(block, 1, 1);
+        const uint8_t leading = static_cast < uint8_t > (std::min(__builtin_clz(x), 31));
+        const uint8_t trailing = static_cast < uint8_t > (__builtin_ctz(x));
+        if (encoder.leading != 0xFF && leading >= encoder.leading && trailing >= encoder.trailing) {
+            put_bits(block, 0, 1);
+            put_bits(block, x >> encoder.trailing, static_cast < uint8_t > (32 - encoder.leading - encoder.trailing));
+        } else {
+            const uint8_t length = static_cast < uint8_t > (32 - leading - trailing);
+            put_bits(block, 1, 1);
+            put_bits(block, leading, 5);
+            put_bits(block, length - 1u, 5);
+            put_bits(block, x >> trailing, length);
+            encoder.leading = leading;
+            encoder.trailing = trailing;
+        }
+    }
+
+    static void put_bits(Block & block, uint32_t value, uint8_t count) {
+        for (int8_t bit = count - 1; bit >= 0; bit--) {
+            uint8_t & byte = block.data[block.bit_count >> 3];
+            const uint8_t mask = static_cast < uint8_t > (0x80u >> (block.bit_count & 7));
+            byte = ((value >> bit) & 1u) ? (byte | mask) : (byte & ~mask);
+            block.bit_count++;
+        }
+    }
+
+    static void put_varint(Block & block, uint32_t value) { //7 bits per group, MSB of the group says "more follows"
+        do {
+            const uint8_t group = value & 0x7F;
+            value >>= 7;
+            put_bits(block, (value != 0) ? (group | 0x80u) : group, 8);
+        } while (value != 0);
+    }
+
+    static void put_gamma(Block & block, uint32_t value) { //elias gamma, value >= 1
+        const uint8_t length = static_cast < uint8_t > (32 - __builtin_clz(value));
+        put_bits(block, 0, length - 1);
+        put_bits(block, value, length);
+    }
+
+    static uint32_t get_bits(const Block & block, uint16_t & position, uint8_t count) {
+        uint32_t value = 0;
+        for (uint8_t i = 0; i < count; i++, position++) {
+            value = (value << 1) | ((block.data[position >> 3] >> (7 - (position & 7))) & 1u);
+        }
+        return value;
+    }
+
+    static uint32_t get_varint(const Block & block, uint16_t & position) {
+        uint32_t value = 0;
+        for (uint8_t shift = 0; shift < 35; shift += 7) {
+            const uint32_t group = get_bits(block, position, 8);
+            value |= (group & 0x7F) << shift;
+            if ((group & 0x80) == 0) break;
+        }
+        return value;
+    }
+
+    static uint32_t get_gamma(const Block & block, uint16_t & position) {
+        uint8_t zeros = 0;
+        while (get_bits(block, position, 1) == 0) zeros++;
+        return (1u << zeros) | get_bits(block, position, zeros);
+    }
+};
+
+class TelemetryGenerator {
+    //builds CCSDS space packets(primary header + time secondary header + payload + CRC16 packet error control)
+    //straight into preallocated buffers, the fields are serialized from the live structures so there is no intermediate copy.
+    //the buffers are word aligned so the radio UART DMA can take them as they are
+    public:
+    static constexpr uint16_t HOUSEKEEPING_APID = 0x0A1;
+    static constexpr uint16_t PACKED_HOUSEKEEPING_APID = 0x0A2;
+    static constexpr uint16_t HISTORY_APID = 0x0A3;
+    static constexpr uint16_t FAULT_EVENT_APID = 0x0A4;
+    static constexpr uint16_t HISTORY_HEADER_SIZE = 4 + 1 + 2 + 2 + 2 + 4 + 4 + 4; //the Block fields, then the used part of the data
+    static constexpr uint16_t PRIMARY_HEADER_SIZE = 6;
+    static constexpr uint16_t SECONDARY_HEADER_SIZE = 4; //mission time in ms
+    static constexpr uint16_t CRC_SIZE = 2;
+    static constexpr uint16_t HOUSEKEEPING_PAYLOAD_SIZE = 1 + 4 + 3 * 4 + 4 + 4 * 4 + 2 * 4 + 2 * 4 + 4 + 4 + 1 + 2 * 4 + 2 * (FaultManager::FAULT_TYPE_COUNT - 1) + 4 * 4;
+    static constexpr uint16_t HOUSEKEEPING_PACKET_SIZE = PRIMARY_HEADER_SIZE + SECONDARY_HEADER_SIZE + HOUSEKEEPING_PAYLOAD_SIZE + CRC_SIZE;
+    static constexpr uint16_t FAULT_EVENT_PACKET_SIZE = PRIMARY_HEADER_SIZE + SECONDARY_HEADER_SIZE + 1 + 1 + 4 + CRC_SIZE;
+    static constexpr uint16_t MAX_PACKET_SIZE = PRIMARY_HEADER_SIZE + SECONDARY_HEADER_SIZE + HISTORY_HEADER_SIZE + TelemetryHistory::BLOCK_DATA_SIZE + CRC_SIZE;
+    static constexpr uint8_t BUFFER_COUNT = 2; //one being sent by the DMA while the next one is filled
+    static constexpr uint8_t PACKED_SAMPLES_PER_PACKET = 16; //16 x 49 bits = 98 bytes, against 16 x 21 bytes as plain floats + time
+    static constexpr uint16_t PACKED_HEADER_SIZE = 2 + 1; //sample period(ms), sample count
+
+    struct Packet {
+        const uint8_t * data;
+        uint16_t length;
+        uint32_t tag() const { //APID and sequence count from the primary header, how the radio says which packet it finished
+            return (static_cast < uint32_t > (data[0]) << 24) | (static_cast < uint32_t > (data[1]) << 16) | (static_cast < uint32_t > (data[2]) << 8) | data[3];
+        }
+    };
+
+    //each builder writes into buffer(MAX_PACKET_SIZE bytes) when it is given one, the downlink scheduler passes the buffer
+    //it holds until the radio is done with it. without one the packet goes into the BUFFER_COUNT ring, which is reused
+    //two builds later
+    Packet build_housekeeping(const ADCSState & state, const FaultManager & faults, const CycleProfiler & profiler, uint32_t time, uint8_t * buffer = nullptr) {
+        uint8_t * packet = buffer ? buffer : next_buffer();
+        uint8_t * p = packet + PRIMARY_HEADER_SIZE;
+        p = put_u32(p, time);
+        //ADCS state
+        * p++ = static_cast < uint8_t > (state.current_mode);
+        p = put_u32(p, state.mode_entry_time);
+        for (float rate: state.angular_velocity) p = put_float(p, rate);
+        p = put_float(p, state.power_level);
+        for (float speed: state.wheel_speeds) p = put_float(p, speed);
+        for (float residual: state.magnetometer_residual_rms) p = put_float(p, residual);
+        p = put_float(p, state.battery_charge);
+        p = put_float(p, state.forecast_min_charge);
+        p = put_float(p, state.avionics_power_mw);
+        p = put_float(p, state.idle_fraction);
+        * p++ = state.isolated_sensors;
+        for (float nis: state.innovation_nis_mean) p = put_float(p, nis);
+        //fault counters(NONE is never counted so it is left out)
+        for (uint8_t i = 1; i < FaultManager::FAULT_TYPE_COUNT; i++) p = put_u16(p, faults.fault_counts[i]);
+        //profiler
+        p = put_u32(p, profiler.last_cycles);
+        p = put_u32(p, profiler.max_cycles);
+        p = put_u32(p, profiler.average_cycles);
+        p = put_u32(p, profiler.cycle_count);
+        return finish_packet(packet, p, HOUSEKEEPING_APID, housekeeping_sequence_count);
+    }
+
+    Packet build_fault_event(uint8_t fault, ADCSMode mode, uint32_t event_time, uint32_t time, uint8_t * buffer = nullptr) {
+        uint8_t * packet = buffer ? buffer : next_buffer();
+        uint8_t * p = put_u32(packet + PRIMARY_HEADER_SIZE, time);
+        * p++ = fault;
+        * p++ = static_cast < uint8_t > (mode);
+        p = put_u32(p, event_time);
+        return finish_packet(packet, p, FAULT_EVENT_APID, fault_event_sequence_count);
+    }
+
+    static uint16_t history_packet_size(const TelemetryHistory::Block & block) {
+        return static_cast < uint16_t > (PRIMARY_HEADER_SIZE + SECONDARY_HEADER_SIZE + HISTORY_HEADER_SIZE + (block.bit_count + 7) / 8 + CRC_SIZE);
+    }
+
+    Packet build_history_packet(const TelemetryHistory::Block & block, uint32_t time, uint8_t * buffer = nullptr) {
+        //the compressed block goes down as it is, the ground runs TelemetryHistory::decode_block on it
+        uint8_t * packet = buffer ? buffer : next_buffer();
+        uint8_t * p = put_u32(packet + PRIMARY_HEADER_SIZE, time);
+        p = put_u32(p, block.sequence);
+        * p++ = block.channel;
+        p = put_u16(p, block.sample_count);
+        p = put_u16(p, block.pending_repeats);
+        p = put_u16(p, block.bit_count);
+        p = put_u32(p, block.first_time);
+        p = put_u32(p, block.last_time);
+        p = put_u32(p, block.first_value);
+        const uint16_t data_bytes = static_cast < uint16_t > ((block.bit_count + 7) / 8);
+        std::memcpy(p, block.data.data(), data_bytes);
+        return finish_packet(packet, p + data_bytes, HISTORY_APID, history_sequence_count);
+    }
+
+    bool add_packed_sample(const ADCSState & state, uint32_t time, uint16_t sample_period_ms, Packet & packet) {
+        //samples are quantized straight into the packet buffer, returns true(and the packet) once it holds PACKED_SAMPLES_PER_PACKET
+        if (packed_sample_count == 0) {
+            packed_packet = packed_buffers[packed_buffer_index].data();
+            packed_buffer_index = (packed_buffer_index + 1) % BUFFER_COUNT;
+            uint8_t * p = put_u32(packed_packet + PRIMARY_HEADER_SIZE, time); //time of the first sample
+            p = put_u16(p, sample_period_ms);
+            packed_writer = BitWriter(p + 1);
+        }
+        HousekeepingSchema::pack(packed_writer, state);
+        if (++packed_sample_count < PACKED_SAMPLES_PER_PACKET) {
+            return false;
+        }
+        packed_packet[PRIMARY_HEADER_SIZE + SECONDARY_HEADER_SIZE + 2] = packed_sample_count;
+        packet = finish_packet(packed_packet, packed_writer.end(), PACKED_HOUSEKEEPING_APID, packed_sequence_count);
+        packed_sample_count = 0;
+        return true;
+    }
+
+    float benchmark_bytes_per_us(const ADCSState & state, const FaultManager & faults, const CycleProfiler & profiler, uint16_t iterations) {
+        //encoding throughput on the target(run it from a ground command, not in the control loop)
+        const uint32_t start = read_cycle_counter();
+        uint32_t bytes = 0;
+        for (uint16_t i = 0; i < iterations; i++) bytes += build_housekeeping(state, faults, profiler, i).length;
+        const uint32_t cycles = read_cycle_counter() - start;
+        return (cycles == 0) ? 0.0f : static_cast < float > (bytes) * (CPU_CLOCK_HZ / 1000000) / static_cast < float > (cycles);
+    }
+
+    static uint16_t crc16(const uint8_t * data, uint16_t length) {
+        return crc16_ccitt(data, length);
+    }
+
+    private: alignas(32) std::array < std::array < uint8_t, MAX_PACKET_SIZE > , BUFFER_COUNT > buffers {};
+    uint8_t next_buffer_index = 0;
+    uint16_t housekeeping_sequence_count = 0;
+    uint16_t history_sequence_count = 0;
+    uint16_t fault_event_sequence_count = 0;
+    alignas(32) std::array < std::array < uint8_t, MAX_PACKET_SIZE > , BUFFER_COUNT > packed_buffers {}; //own buffers, a packed packet fills over several seconds
+    uint8_t packed_buffer_index = 0;
+    uint8_t packed_sample_count = 0;
+    uint8_t * packed_packet = nullptr;
+    BitWriter packed_writer { nullptr };
+    uint16_t packed_sequence_count = 0;
+
+    uint8_t * next_buffer() {
+        uint8_t * buffer = buffers[next_buffer_index].data();
+        next_buffer_index = (next_buffer_index + 1) % BUFFER_COUNT;
+        return buffer;
+    }
+
+    Packet finish_packet(uint8_t * packet, uint8_t * end, uint16_t apid, uint16_t & sequence_count) {
+        const uint16_t length = static_cast < uint16_t > (end - packet) + CRC_SIZE;
+        //version 000, type 0(telemetry), secondary header flag 1, 11 bit APID
+        put_u16(packet, static_cast < uint16_t > (0x0800 | (apid & 0x07FF)));
+        //sequence flags 11(unsegmented), 14 bit sequence count
+        put_u16(packet + 2, static_cast < uint16_t > (0xC000 | (sequence_count & 0x3FFF)));
+        //packet data length is the number of bytes after the primary header minus one
+        put_u16(packet + 4, static_cast < uint16_t > (length - PRIMARY_HEADER_SIZE - 1));
+        sequence_count = (sequence_count + 1) & 0x3FFF;
+        put_u16(end, crc16(packet, length - CRC_SIZE));
+        return { packet, length };
+    }
+
+    //big endian(network order) writers, as CCSDS wants
+    static uint8_t * put_u16(uint8_t * p, uint16_t value) {
+        p[0] = static_cast < uint8_t > (value >> 8);
+        p[1] = static_cast < uint8_t > (value);
+        return p + 2;
+    }
+    static uint8_t * put_u32(uint8_t * p, uint32_t value) {
+        p[0] = static_cast < uint8_t > (value >> 24);
+        p[1] = static_cast < uint8_t > (value >> 16);
+        p[2] = static_cast < uint8_t > (value >> 8);
+        p[3] = static_cast < uint8_t > (value);
+        return p + 4;
+    }
+    static uint8_t * put_float(uint8_t * p, float value) {
+        uint32_t bits;
+        std::memcpy( & bits, & value, sizeof(bits));
+        return put_u32(p, bits);
+    }
+};
+
+class DownlinkScheduler {
+    //decides what goes down during a ground pass: fault events first, then the current state, then the latest packed
+    //samples, then compressed history. it is the only thing that hands packets to the radio, the 1 Hz housekeeping and
+    //the packed samples come through it too(request_state, queue_packed), so everything is inside the pass budget and
+    //the radio's "done" is always about the scheduler's own packet.
+    //packets are built only when the radio can take one, into a buffer of the scheduler's own that is left alone until
+    //confirm_sent(the generator's ring is refilled by the 1 Hz housekeeping while the radio may still be sending), and every
+    //packet is counted against the byte budget of the pass. queue positions and history cursors only move on when the
+    //radio reports the packet as transmitted, so a pass that ends mid packet costs that one packet and the next pass
+    //picks up from there instead of starting the download again. everything is static, no allocation
+    public: enum class PacketClass: uint8_t { //in priority order
+        FAULT_EVENT,
+        CURRENT_STATE,
+        PACKED_STATE,
+        HISTORY,
+        COUNT
+    };
+    static constexpr uint8_t CLASS_COUNT = static_cast < uint8_t > (PacketClass::COUNT);
+    static constexpr uint8_t FAULT_QUEUE_SIZE = 32;
+    static constexpr uint8_t HISTORY_REQUEST_COUNT = 8;
+
+    struct FaultEvent {
+        uint8_t fault; //FaultManager::FaultType
+        ADCSMode mode;
+        uint32_t time;
+    };
+
+    struct HistoryRequest { //one ground request, the cursor is the last block sequence that made it down
+        bool active;
+        TelemetryHistory::Channel channel;
+        uint32_t from;
+        uint32_t to;
+        uint32_t after_sequence;
+    };
+
+    struct PassStats {
+        uint32_t budget_bytes;
+        std::array < uint32_t, CLASS_COUNT > bytes_sent;
+        std::array < uint16_t, CLASS_COUNT > packets_sent;
+    };
+
+    PassStats pass_stats {};
+    uint16_t replaced_packed_packets = 0; //a newer packed packet came before the previous one went(its samples are in the history)
+    uint16_t dropped_fault_events = 0; //the queue was full and the oldest event(not counting one being sent) was overwritten
+
+    void queue_fault_event(uint8_t fault, ADCSMode mode, uint32_t time) {
+        if (fault_count == FAULT_QUEUE_SIZE) {
+            if (in_flight && in_flight_class == PacketClass::FAULT_EVENT) {
+                //the head is on its way and confirm_sent will pop it, so the one after it goes instead
+                for (uint8_t i = 1; i + 1 < fault_count; i++) {
+                    fault_queue[(fault_head + i) % FAULT_QUEUE_SIZE] = fault_queue[(fault_head + i + 1) % FAULT_QUEUE_SIZE];
+                }
+            } else {
+                fault_head = (fault_head + 1) % FAULT_QUEUE_SIZE;
+            }
+            fault_count--;
+            dropped_fault_events++;
+        }
+        fault_queue[(fault_head + fault_count) % FAULT_QUEUE_SIZE] = { fault, mode, time };
+        fault_count++;
+    }
+
+    void request_state() { //fresh housekeeping wanted, it is built when it goes
+        state_pending = true;
+    }
+
+    void queue_packed(const TelemetryGenerator::Packet & packet) {
+        //copied, the generator reuses its packed buffers. only the latest one is kept
+        if (packed_pending) replaced_packed_packets++;
+        packed_generation++;
+        std::memcpy(packed_buffer.data(), packet.data, packet.length);
+        packed_length = packet.length;
+        packed_pending = true;
+    }
+
+    const TelemetryGenerator::Packet * in_flight_packet() const { //what the radio has to report as done for confirm_sent
+        return in_flight ? & sent_packet : nullptr;
+    }
+
+    bool request_history(TelemetryHistory::Channel channel, uint32_t from, uint32_t to) {
+        for (HistoryRequest & request: history_requests) {
+            if (!request.active) {
+                request = { true, channel, from, to, 0 };
+                return true;
+            }
+        }
+        return false; //all slots busy, the ground asks again later
+    }
+
+    void begin_pass(uint32_t budget_bytes) {
+        pass_stats = {};
+        pass_stats.budget_bytes = budget_bytes;
+        remaining_bytes = budget_bytes;
+        state_pending = true;
+        in_flight = false;
+    }
+
+    void end_pass() {
+        in_flight = false; //not confirmed, it is rebuilt and sent again next pass
+        remaining_bytes = 0;
+    }
+
+    bool pass_active() const {
+        return remaining_bytes > 0 || in_flight;
+    }
+
+    bool next_packet(TelemetryGenerator & generator, const TelemetryHistory & history, const ADCSState & state, const FaultManager & faults,
+        const CycleProfiler & profiler, uint32_t time, TelemetryGenerator::Packet & packet) {
+        //highest priority packet that still fits in the budget, false if there is nothing(or nothing that fits)
+        if (in_flight) return false; //one packet at a time, wait for confirm_sent
+        for (uint8_t c = 0; c < CLASS_COUNT; c++) {
+            const PacketClass packet_class = static_cast < PacketClass > (c);
+            uint32_t next_sequence = 0;
+            if (packet_class == PacketClass::FAULT_EVENT && fault_count > 0) {
+                if (TelemetryGenerator::FAULT_EVENT_PACKET_SIZE > remaining_bytes) continue;
+                const FaultEvent & event = fault_queue[fault_head];
+                packet = generator.build_fault_event(event.fault, event.mode, event.time, time, in_flight_buffer.data());
+            } else if (packet_class == PacketClass::CURRENT_STATE && state_pending) {
+                if (TelemetryGenerator::HOUSEKEEPING_PACKET_SIZE > remaining_bytes) continue;
+                packet = generator.build_housekeeping(state, faults, profiler, time, in_flight_buffer.data());
+            } else if (packet_class == PacketClass::PACKED_STATE && packed_pending) {
+                if (packed_length > remaining_bytes) continue;
+                std::memcpy(in_flight_buffer.data(), packed_buffer.data(), packed_length); //queue_packed may refill packed_buffer while this one goes
+                packet = { in_flight_buffer.data(), packed_length };
+                in_flight_generation = packed_generation;
+            } else if (packet_class == PacketClass::HISTORY && find_history_block(history, next_sequence, packet, generator, time)) {
+                //find_history_block already checked the budget
+            } else {
+                continue;
+            }
+            in_flight = true;
+            sent_packet = packet;
+            in_flight_class = packet_class;
+            in_flight_length = packet.length;
+            in_flight_sequence = next_sequence;
+            remaining_bytes -= packet.length;
+            return true;
+        }
+        return false;
+    }
+
+    void confirm_sent() { //the radio has transmitted the in flight packet
+        if (!in_flight) return;
+        in_flight = false;
+        const uint8_t c = static_cast < uint8_t > (in_flight_class);
+        pass_stats.bytes_sent[c] += in_flight_length;
+        pass_stats.packets_sent[c]++;
+        switch (in_flight_class) {
+        case PacketClass::FAULT_EVENT:
+            fault_head = (fault_head + 1) % FAULT_QUEUE_SIZE;
+            fault_count--;
+            break;
+        case PacketClass::CURRENT_STATE:
+            state_pending = false;
+            break;
+        case PacketClass::PACKED_STATE:
+            if (packed_generation == in_flight_generation) packed_pending = false; //else a newer one came while this one was going
+            break;
+        case PacketClass::HISTORY:
+            history_requests[in_flight_request].after_sequence = in_flight_sequence;
+            break;
+        default:
+            break;
+        }
+    }
+
+    private: std::array < FaultEvent, FAULT_QUEUE_SIZE > fault_queue {};
+    uint8_t fault_head = 0;
+    uint8_t fault_count = 0;
+    std::array < HistoryRequest, HISTORY_REQUEST_COUNT > history_requests {};
+    uint32_t remaining_bytes = 0;
+    bool state_pending = false;
+    bool in_flight = false;
+    PacketClass in_flight_class = PacketClass::FAULT_EVENT;
+    uint16_t in_flight_length = 0;
+    uint8_t in_flight_request = 0;
+    uint32_t in_flight_sequence = 0;
+    alignas(32) std::array < uint8_t, TelemetryGenerator::MAX_PACKET_SIZE > in_flight_buffer {}; //the DMA reads it until confirm_sent
+    TelemetryGenerator::Packet sent_packet { nullptr, 0 };
+    std::array < uint8_t, TelemetryGenerator::MAX_PACKET_SIZE > packed_buffer {};
+    uint16_t packed_length = 0;
+    bool packed_pending = false;
+    uint16_t packed_generation = 0;
+    uint16_t in_flight_generation = 0;
+
+    bool find_history_block(const TelemetryHistory & history, uint32_t & next_sequence, TelemetryGenerator::Packet & packet,
+        TelemetryGenerator & generator, uint32_t time) {
+        //oldest request first, a request that has no blocks left is finished
+        for (uint8_t i = 0; i < HISTORY_REQUEST_COUNT; i++) {
+            HistoryRequest & request = history_requests[i];
+            if (!request.active) continue;
+            const TelemetryHistory::Block * block;
+            if (history.find_blocks(request.channel, request.from, request.to, request.after_sequence, & block, 1) == 0) {
+                request.active = false;
+                continue;
+            }
+            if (history.is_open(block) && block->last_time < request.to) {
+                continue; //the block is still filling with samples the ground asked for, it goes once it is closed
+            }
+            if (TelemetryGenerator::history_packet_size( * block) > remaining_bytes) return false;
+            packet = generator.build_history_packet( * block, time, in_flight_buffer.data());
+            next_sequence = block->sequence;
+            in_flight_request = i;
+            return true;
+        }
+        return false;
+    }
+};
+
+//driver interfaces the state machine is built against. every backend(flight, simulation, replay) is a set of plain
+//classes that satisfy these, picked at compile time through the Hal template argument of BasicStateMachine, so the
+//calls in the control loop are direct(and usually inlined), there are no virtual calls anywhere in it
+template < typename T >
+concept ImuDriver = requires(T imu, uint8_t unit, Vector3 & rate, bool on) {
+    { T::UNITS } -> std::convertible_to < uint8_t > ;
+    { imu.read(unit, rate) } -> std::same_as < bool > ; //body frame, rad/s, false on a bus error or a failed data check
+    { imu.fitted(unit) } -> std::same_as < bool > ; //false for a unit this build does not have, it is left out of the vote
+    imu.reset(unit); //power cycle and reinitialize one unit
+    imu.set_power(on); //gyro sleep/normal, all units
+};
+
+template < typename T >
+concept MagnetometerDriver = requires(T magnetometer, uint8_t unit, Vector3 & field) {
+    { T::UNITS } -> std::convertible_to < uint8_t > ;
+    { magnetometer.read(unit, field) } -> std::same_as < bool > ; //body frame, tesla
+    { magnetometer.fitted(unit) } -> std::same_as < bool > ;
+    magnetometer.reset(unit);
+};
+
+template < typename T >
+concept SunSensorDriver = requires(T sun_sensors) {
+    { sun_sensors.read() } -> std::same_as < std::array < float, SunSensorArray::SENSOR_COUNT >> ; //normalized photodiode currents
+    sun_sensors.reset();
+};
+
+template < typename T >
+concept PowerDriver = requires(T eps, bool on) {
+    { eps.read_power() } -> std::same_as < float > ; //W available to the ADCS
+    { eps.read_battery_charge() } -> std::same_as < float > ; //state of charge, 0-1
+    eps.set_power_saving(on); //only the essential loads powered
+};
+
+template < typename T >
+concept TorquerDriver = requires(T torquers, const Vector3 & currents, const std::array < float, ReactionWheelArray::WHEEL_COUNT > & torques) {
+    torquers.set_coil_currents(currents); //A
+    { torquers.read_wheel_speeds() } -> std::same_as < std::array < float, ReactionWheelArray::WHEEL_COUNT >> ; //rad/s
+    torquers.set_wheel_torques(torques); //Nm
+};
+
+template < typename T >
+concept NvmDriver = requires(T nvm, const NonVolatileMemory::ADCSState & state, const NonVolatileMemory::EstimatorCheckpoint & checkpoint,
+    const NonVolatileMemory::GyroCalibrationRecord & gyro, const NonVolatileMemory::MagnetometerCalibrationRecord & magnetometer,
+    const NonVolatileMemory::WatchdogDiagnostic & diagnostic) {
+    { nvm.read_persistent_state() } -> std::same_as < NonVolatileMemory::ADCSState > ;
+    nvm.write(state);
+    { nvm.read_estimator_checkpoint() } -> std::same_as < NonVolatileMemory::EstimatorCheckpoint > ;
+    nvm.write_estimator_checkpoint(checkpoint);
+    { nvm.read_gyro_calibration() } -> std::same_as < NonVolatileMemory::GyroCalibrationRecord > ;
+    nvm.write_gyro_calibration(gyro);
+    { nvm.read_magnetometer_calibration() } -> std::same_as < NonVolatileMemory::MagnetometerCalibrationRecord > ;
+    nvm.write_magnetometer_calibration(magnetometer);
+    { nvm.read_watchdog_diagnostic() } -> std::same_as < NonVolatileMemory::WatchdogDiagnostic > ;
+    nvm.write_watchdog_diagnostic(diagnostic);
+};
+
+template < typename T >
+concept PlatformDriver = requires(T platform, uint32_t value) {
+    { platform.time_ms() } -> std::same_as < uint32_t > ; //RTC, keeps counting through a WDT or software reset
+    { platform.reset_cycles() } -> std::same_as < uint32_t > ; //read_cycle_counter() at the last reset
+    platform.set_cpu_clock(value);
+    platform.enter_stop_mode(value); //wake up after value ms
+    platform.wait_for_interrupt();
+    platform.software_reset();
+    platform.hardware_reset();
+};
+
+template < typename T >
+concept RadioDriver = requires(T radio, const TelemetryGenerator::Packet & packet) {
+    radio.send(packet);
+    { radio.transmit_done(packet) } -> std::same_as < bool > ; //true once, when this packet(Packet::tag) has gone
+    { radio.pass_lost() } -> std::same_as < bool > ; //carrier lock to the ground station gone
+};
+
+template < ImuDriver Imu, MagnetometerDriver Magnetometer, SunSensorDriver SunSensors, PowerDriver Eps, TorquerDriver Torquers,
+    NvmDriver Nvm, PlatformDriver Platform, RadioDriver Radio >
+struct Hal {
+    Imu imu;
+    Magnetometer magnetometer;
+    SunSensors sun_sensors;
+    Eps eps;
+    Torquers torquers;
+    Nvm nvm;
+    Platform platform;
+    Radio radio;
+};
+
+template < typename Derived, uint8_t UNIT_COUNT >
+class UnitDriver {
+    //CRTP base for the redundant sensors: the unit range check and the zeroed reading on a failure are the same for every
+    //backend, Derived only supplies read_unit and reset_unit(and unit_fitted if some units can be missing)
+    public:
+    static constexpr uint8_t UNITS = UNIT_COUNT;
+
+    bool fitted(uint8_t unit) const {
+        return unit < UNITS && static_cast < const Derived * > (this)->unit_fitted(unit);
+    }
+
+    bool unit_fitted(uint8_t) const {
+        return true;
+    }
+
+    bool read(uint8_t unit, Vector3 & value) {
+        value = {};
+        if (unit >= UNITS) return false;
+        if (static_cast < Derived * > (this)->read_unit(unit, value)) return true;
+        value = {}; //whatever came off the bus is not used
+        return false;
+    }
+
+    void reset(uint8_t unit) {
+        if (unit < UNITS) static_cast < Derived * > (this)->reset_unit(unit);
+    }
+};
+
+//flight backend
+class FlightImu: public UnitDriver < FlightImu, 3 > {
+    public: bool unit_fitted(uint8_t) const {
+        /* which IMUs this build has(board strapping or configuration) */
+        return false; //none until the driver exists: the voter leaves them out instead of raising SENSOR_ANOMALY every cycle
+    }
+    bool read_unit(uint8_t, Vector3 &) {
+        /* IMU gyro read implementation(body frame, rad/s), false on a bus error or a failed data check */
+        return false;
+    }
+    void reset_unit(uint8_t) {
+        /* power cycle and reinitialize one IMU */ }
+    void set_power(bool) {
+        /* IMU gyro power mode implementation(sleep/normal), the accelerometer and magnetometer are separate parts */ }
+};
+
+class FlightMagnetometer: public UnitDriver < FlightMagnetometer, 3 > {
+    public: bool unit_fitted(uint8_t) const {
+        /* which magnetometers this build has */
+        return false; //same as the IMU
+    }
+    bool read_unit(uint8_t, Vector3 &) {
+        /* magnetometer read implementation(body frame, tesla), false on a bus error or a failed data check */
+        return false;
+    }
+    void reset_unit(uint8_t) {
+        /* power cycle and reinitialize one magnetometer */ }
+};
+
+struct FlightSunSensors {
+    std::array < float, SunSensorArray::SENSOR_COUNT > read() {
+        /* photodiode ADC read implementation, normalized to the full sun current at normal incidence */
+        return {};
+    }
+    void reset() {
+        /* reinitialize the photodiode ADC and bias supply */ }
+};
+
+struct FlightEps {
+    float read_power() {
+        /* EPS read implementation */
+        return 0.0f;
+    }
+    float read_battery_charge() {
+        /* EPS fuel gauge read implementation(state of charge, 0-1) */
+        return 0.0f;
+    }
+    void set_power_saving(bool) {
+        /*The EPS will be adjusted. to power only the most important things*/ }
+};
+
+struct FlightTorquers {
+    void set_coil_currents(const Vector3 &) {
+        /* Actuator control, coil driver PWM for the currents(A) */ }
+    std::array < float, ReactionWheelArray::WHEEL_COUNT > read_wheel_speeds() {
+        /* wheel driver speed read implementation(rad/s) */
+        return {};
+    }
+    void set_wheel_torques(const std::array < float, ReactionWheelArray::WHEEL_COUNT > &) {
+        /* wheel driver torque(motor current) command implementation */ }
+};
+
+struct FlightPlatform {
+    uint32_t time_ms() {
+        /*code to fetch time(ms from the RTC, which keeps counting through a WDT or software reset)*/
+        return 0;
+    }
+    uint32_t reset_cycles() {
+        return 0; //the reset handler zeroes and starts DWT->CYCCNT before anything else, so it counts from the reset
+    }
+    void set_cpu_clock(uint32_t) {
+        /* PLL/prescaler reconfiguration implementation(flash wait states first when going up), the RTC and the
+        cycle counter based timing are not affected */ }
+    void enter_stop_mode(uint32_t) {
+        /* low power timer wakeup after the given ms, then stop mode(the RTC and the IWDG keep running), restore the profile
+        clock after the wakeup */ }
+    void wait_for_interrupt() {
+        /* __WFI(), the 1 ms tick wakes us up */ }
+    void software_reset() {
+        /*the implementation is complicated, but we will be reseting the sensors by rebooting their drivers*/ }
+    void hardware_reset() {
+        /*the implementation is complicated. but my idea is to have another external circuit or microcontroller to whom we give a command to turn off the power to the main circuit, and then turn it on again after a delay*/ }
+};
+
+struct FlightRadio {
+    void send(const TelemetryGenerator::Packet &) {
+        /*hand the buffer to the radio UART DMA, it must be done with it before the buffer comes round again*/ }
+    bool transmit_done(const TelemetryGenerator::Packet &) {
+        /*true once, when the radio reports the packet with this tag(APID + sequence count) as sent*/
+        return false;
+    }
+    bool pass_lost() {
+        /*the radio lost the ground station(carrier lock gone)*/
+        return false;
+    }
+};
+
+using FlightHal = Hal < FlightImu, FlightMagnetometer, FlightSunSensors, FlightEps, FlightTorquers, NonVolatileMemory, FlightPlatform, FlightRadio > ;
+
+#ifdef ADCS_HOST_BUILD
+//ground side decoder for the housekeeping packets, only built for the host(ground software and testing)
+class TelemetryDecoder {
+    public:
+    struct Housekeeping {
+        uint16_t apid;
+        uint16_t sequence_count;
+        uint32_t time;
+        ADCSMode mode;
+        uint32_t mode_entry_time;
+        std::array < float, 3 > angular_velocity;
+        float power_level;
+        std::array < float, 4 > wheel_speeds;
+        std::array < float, 2 > magnetometer_residual_rms;
+        float battery_charge;
+        float forecast_min_charge;
+        float avionics_power_mw;
+        float idle_fraction;
+        uint8_t isolated_sensors;
+        std::array < float, 2 > innovation_nis_mean;
+        std::array < uint16_t, FaultManager::FAULT_TYPE_COUNT - 1 > fault_counts;
+        uint32_t last_cycles;
+        uint32_t max_cycles;
+        uint32_t average_cycles;
+        uint32_t cycle_count;
+    };
+
+    static bool decode_housekeeping(const uint8_t * packet, uint16_t length, Housekeeping & out) {
+        if (length < TelemetryGenerator::PRIMARY_HEADER_SIZE + TelemetryGenerator::CRC_SIZE) return false;
+        const uint16_t packet_length = get_u16(packet + 4) + TelemetryGenerator::PRIMARY_HEADER_SIZE + 1;
+        if (packet_length > length || packet_length != TelemetryGenerator::HOUSEKEEPING_PACKET_SIZE) return false;
+        if (TelemetryGenerator::crc16(packet, packet_length - TelemetryGenerator::CRC_SIZE) != get_u16(packet + packet_length - TelemetryGenerator::CRC_SIZE)) return false;
+        out.apid = get_u16(packet) & 0x07FF;
+        if (out.apid != TelemetryGenerator::HOUSEKEEPING_APID) return false;
+        out.sequence_count = get_u16(packet + 2) & 0x3FFF;
+        const uint8_t * p = packet + TelemetryGenerator::PRIMARY_HEADER_SIZE;
+        out.time = get_u32(p);
+        p += 4;
+        out.mode = static_cast < ADCSMode > ( * p++);
+        out.mode_entry_time = get_u32(p);
+        p += 4;
+        for (float & rate: out.angular_velocity) {
+            rate = get_float(p);
+            p += 4;
+        }
+        out.power_level = get_float(p);
+        p += 4;
+        for (float & speed: out.wheel_speeds) {
+            speed = get_float(p);
+            p += 4;
+        }
+        for (float & residual: out.magnetometer_residual_rms) {
+            residual = get_float(p);
+            p += 4;
+        }
+        out.battery_charge = get_float(p);
+        out.forecast_min_charge = get_float(p + 4);
+        out.avionics_power_mw = get_float(p + 8);
+        out.idle_fraction = get_float(p + 12);
+        p += 16;
+        out.isolated_sensors = * p++;
+        for (float & nis: out.innovation_nis_mean) {
+            nis = get_float(p);
+            p += 4;
+        }
+        for (uint16_t & count: out.fault_counts) {
+            count = get_u16(p);
+            p += 2;
+        }
+        out.last_cycles = get_u32(p);
+        out.max_cycles = get_u32(p + 4);
+        out.average_cycles = get_u32(p + 8);
+        out.cycle_count = get_u32(p + 12);
+        return true;
+    }
+
+    static uint8_t decode_packed_housekeeping(const uint8_t * packet, uint16_t length, uint32_t & first_sample_time, uint16_t & sample_period_ms,
+        ADCSState * samples, uint8_t max_samples) {
+        //returns the number of samples unpacked(0 if the packet is bad)
+        if (length < TelemetryGenerator::PRIMARY_HEADER_SIZE + TelemetryGenerator::SECONDARY_HEADER_SIZE + TelemetryGenerator::PACKED_HEADER_SIZE + TelemetryGenerator::CRC_SIZE) return 0;
+        const uint16_t packet_length = get_u16(packet + 4) + TelemetryGenerator::PRIMARY_HEADER_SIZE + 1;
+        if (packet_length > length || (get_u16(packet) & 0x07FF) != TelemetryGenerator::PACKED_HOUSEKEEPING_APID) return 0;
+        if (TelemetryGenerator::crc16(packet, packet_length - TelemetryGenerator::CRC_SIZE) != get_u16(packet + packet_length - TelemetryGenerator::CRC_SIZE)) return 0;
+        const uint8_t * p = packet + TelemetryGenerator::PRIMARY_HEADER_SIZE;
+        first_sample_time = get_u32(p);
+        sample_period_ms = get_u16(p + 4);
+        const uint8_t count = std::min(p[6], max_samples);
+        BitReader reader(p + 7);
+        for (uint8_t i = 0; i < count; i++) {
+            samples[i] = {};
+            HousekeepingSchema::unpack(reader, samples[i]);
+        }
+        return count;
+    }
+
+    static bool decode_history(const uint8_t * packet, uint16_t length, TelemetryHistory::Block & block) {
+        //rebuilds the block, TelemetryHistory::decode_block then gives the samples
+        if (length < TelemetryGenerator::PRIMARY_HEADER_SIZE + TelemetryGenerator::SECONDARY_HEADER_SIZE + TelemetryGenerator::HISTORY_HEADER_SIZE + TelemetryGenerator::CRC_SIZE) return false;
+        const uint16_t packet_length = get_u16(packet + 4) + TelemetryGenerator::PRIMARY_HEADER_SIZE + 1;
+        if (packet_length > length || (get_u16(packet) & 0x07FF) != TelemetryGenerator::HISTORY_APID) return false;
+        if (TelemetryGenerator::crc16(packet, packet_length - TelemetryGenerator::CRC_SIZE) != get_u16(packet + packet_length - TelemetryGenerator::CRC_SIZE)) return false;
+        const uint8_t * p = packet + TelemetryGenerator::PRIMARY_HEADER_SIZE + TelemetryGenerator::SECONDARY_HEADER_SIZE;
+        block = {};
+        block.sequence = get_u32(p);
+        block.channel = p[4];
+        block.sample_count = get_u16(p + 5);
+        block.pending_repeats = get_u16(p + 7);
+        block.bit_count = get_u16(p + 9);
+        block.first_time = get_u32(p + 11);
+        block.last_time = get_u32(p + 15);
+        block.first_value = get_u32(p + 19);
+        const uint16_t data_bytes = static_cast < uint16_t > ((block.bit_count + 7) / 8);
+        if (data_bytes > TelemetryHistory::BLOCK_DATA_SIZE || p + TelemetryGenerator::HISTORY_HEADER_SIZE + data_bytes + TelemetryGenerator::CRC_SIZE > packet + packet_length) return false;
+        std::memcpy(block.data.data(), p + TelemetryGenerator::HISTORY_HEADER_SIZE, data_bytes);
+        return true;
+    }
+
+    private: static uint16_t get_u16(const uint8_t * p) {
+        return static_cast < uint16_t > ((p[0] << 8) | p[1]);
+    }
+    static uint32_t get_u32(const uint8_t * p) {
+        return (static_cast < uint32_t > (p[0]) << 24) | (static_cast < uint32_t > (p[1]) << 16) | (static_cast < uint32_t > (p[2]) << 8) | p[3];
+    }
+    static float get_float(const uint8_t * p) {
+        const uint32_t bits = get_u32(p);
+        float value;
+        std::memcpy( & value, & bits, sizeof(value));
+        return value;
+    }
+};
+struct DownlinkPassSimulation {
+    //runs the downlink scheduler over passes of random length against a filled history, to see how much of the
+    //pass capacity ends up as useful(delivered, never repeated) bytes. the scheduler is given a predicted budget
+    //that is off by up to +-20%, the real pass is cut at its actual length wherever that falls
+    uint32_t capacity_bytes = 0;
+    uint32_t useful_bytes = 0;
+    uint32_t lost_bytes = 0; //packets cut off by the end of the pass(sent again next pass)
+    uint16_t passes = 0;
+
+    void run(DownlinkScheduler & scheduler, TelemetryGenerator & generator, const TelemetryHistory & history, const ADCSState & state,
+        const FaultManager & faults, const CycleProfiler & profiler, uint16_t pass_count, uint32_t min_pass_bytes, uint32_t max_pass_bytes, uint32_t seed) {
+        for (uint16_t pass = 0; pass < pass_count; pass++) {
+            const uint32_t actual = min_pass_bytes + next_random(seed) % (max_pass_bytes - min_pass_bytes + 1);
+            const uint32_t predicted = actual + static_cast < uint32_t > (actual * ((next_random(seed) % 41) / 100.0f - 0.2f));
+            scheduler.begin_pass(predicted);
+            uint32_t transmitted = 0;
+            TelemetryGenerator::Packet packet;
+            while (scheduler.next_packet(generator, history, state, faults, profiler, pass, packet)) {
+                if (transmitted + packet.length > actual) {
+                    lost_bytes += actual - transmitted;
+                    transmitted = actual;
+                    break;
+                }
+                transmitted += packet.length;
+                useful_bytes += packet.length;
+                scheduler.confirm_sent();
+            }
+            scheduler.end_pass();
+            capacity_bytes += actual;
+            passes++;
+        }
+    }
+
+    float efficiency() const {
+        return (capacity_bytes == 0) ? 0.0f : static_cast < float > (useful_bytes) / static_cast < float > (capacity_bytes);
+    }
+
+    private: static uint32_t next_random(uint32_t & seed) { //LCG, so a run is repeatable from its seed
+        seed = seed * 1664525u + 1013904223u;
+        return seed >> 8;
+    }
+};
+class HostSimulator {
+    //truth model for closing the loop on the host: rigid body dynamics of the bus on a circular orbit in a tilt free
+    //dipole field. the ADCS code gets "perfect" sensors from it, noise can be added by the caller
+    public:
+    static constexpr double EARTH_RADIUS_KM = 6371.2;
+    static constexpr double EARTH_MU = 398600.4418; //km^3/s^2
+    static constexpr double DIPOLE_FIELD_T = 3.0e-5; //equatorial surface field of the dipole
+
+    Quaternion attitude { 1.0f, 0.0f, 0.0f, 0.0f };
+    Vector3 rate {}; //rad/s body
+    Vector3 inertia = PointingController::INERTIA;
+    Vector3 disturbance_torque {}; //Nm body, constant
+    double time_s = 0.0;
+    double altitude_km = 500.0;
+    double inclination_deg = 97.4;
+
+    //with a TLE loaded the orbit comes from the same SGP4 the flight code uses(time_s counts from the TLE epoch),
+    //otherwise it is the circular orbit below
+    Sgp4 orbit;
+
+    std::array < double, 3 > position_km() const {
+        if (orbit.valid) {
+            Sgp4::Vector3d r, v;
+            if (orbit.propagate(time_s / 60.0, r, v)) return r;
+        }
+        const double r = EARTH_RADIUS_KM + altitude_km;
+        const double u = std::sqrt(EARTH_MU / (r * r * r)) * time_s; //argument of latitude
+        const double i = inclination_deg * 3.14159265358979 / 180.0;
+        return { r * std::cos(u), r * std::sin(u) * std::cos(i), r * std::sin(u) * std::sin(i) };
+    }
+
+    Vector3 magnetic_field_inertial() const {
+        //B = B0 (Re/r)^3 (3(m.r)r - m), dipole m pointing to -z
+        const std::array < double, 3 > p = position_km();
+        const double r = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        const double scale = DIPOLE_FIELD_T * std::pow(EARTH_RADIUS_KM / r, 3.0);
+        const double m_dot_r = -p[2] / r;
+        return { static_cast < float > (scale * 3.0 * m_dot_r * p[0] / r), static_cast < float > (scale * 3.0 * m_dot_r * p[1] / r),
+            static_cast < float > (scale * (3.0 * m_dot_r * p[2] / r + 1.0)) };
+    }
+
+    Vector3 magnetometer() const {
+        return rotate_to_body(attitude, magnetic_field_inertial());
+    }
+
+    Vector3 sun_direction_inertial { 1.0f, 0.0f, 0.0f };
+    bool in_eclipse = false;
+
+    std::array < float, SunSensorArray::SENSOR_COUNT > sun_sensors(const SunSensorArray & array) const {
+        //cosine law photodiodes, nothing in eclipse
+        std::array < float, SunSensorArray::SENSOR_COUNT > currents {};
+        if (in_eclipse) return currents;
+        const Vector3 s = rotate_to_body(attitude, sun_direction_inertial);
+        for (uint8_t k = 0; k < SunSensorArray::SENSOR_COUNT; k++) currents[k] = std::max(0.0f, dot(array.normals[k], s));
+        return currents;
+    }
+
+    //reaction wheel model: each wheel follows its torque command(clipped to the motor limit) until it hits the speed limit
+    std::array < Vector3, ReactionWheelArray::WHEEL_COUNT > wheel_axes = ReactionWheelArray {}.spin_axes;
+    std::array < float, ReactionWheelArray::WHEEL_COUNT > wheel_speeds {};
+    std::array < float, ReactionWheelArray::WHEEL_COUNT > wheel_torques {}; //commanded, Nm
+
+    Vector3 wheel_momentum() const {
+        Vector3 h {};
+        for (uint8_t k = 0; k < ReactionWheelArray::WHEEL_COUNT; k++)
+            for (int i = 0; i < 3; i++) h[i] += wheel_axes[k][i] * ReactionWheelArray::WHEEL_INERTIA * wheel_speeds[k];
+        return h;
+    }
+
+    void step(const Vector3 & dipole, const Vector3 & extra_torque, float dt) {
+        //torquer torque m x B, the wheel reaction and whatever else the caller applies, integrated in 10ms sub steps
+        const Vector3 b = magnetometer();
+        const Vector3 magnetic_torque = cross(dipole, b);
+        const int sub_steps = std::max(1, static_cast < int > (dt / 0.01f));
+        const float h = dt / static_cast < float > (sub_steps);
+        for (int k = 0; k < sub_steps; k++) {
+            Vector3 wheel_reaction {};
+            for (uint8_t w = 0; w < ReactionWheelArray::WHEEL_COUNT; w++) {
+                float torque = std::min(std::max(wheel_torques[w], -ReactionWheelArray::MAX_TORQUE), ReactionWheelArray::MAX_TORQUE);
+                if (std::abs(wheel_speeds[w]) >= ReactionWheelArray::MAX_SPEED && torque * wheel_speeds[w] > 0.0f) torque = 0.0f;
+                wheel_speeds[w] += h * torque / ReactionWheelArray::WHEEL_INERTIA;
+                for (int i = 0; i < 3; i++) wheel_reaction[i] -= wheel_axes[w][i] * torque;
+            }
+            const Vector3 wheel_h = wheel_momentum();
+            const Vector3 momentum { inertia[0] * rate[0] + wheel_h[0], inertia[1] * rate[1] + wheel_h[1], inertia[2] * rate[2] + wheel_h[2] };
+            const Vector3 gyroscopic = cross(rate, momentum);
+            for (int i = 0; i < 3; i++) {
+                rate[i] += h * (magnetic_torque[i] + wheel_reaction[i] + extra_torque[i] + disturbance_torque[i] - gyroscopic[i]) / inertia[i];
+            }
+            attitude = quaternion_normalize(quaternion_multiply(attitude, { 1.0f, 0.5f * rate[0] * h, 0.5f * rate[1] * h, 0.5f * rate[2] * h }));
+        }
+        time_s += dt;
+    }
+};
+
+struct PointingSimulation {
+    //closed loop run of the pointing controller against the truth model, the controller stats are the result(settling time, rms error)
+    static PointingController::PointingStats run(PointingController & controller, HostSimulator & simulator, float duration_s, float control_dt) {
+        controller.set_sub_mode(controller.get_sub_mode(), 0);
+        for (float t = 0.0f; t < duration_s; t += control_dt) {
+            const PointingController::Command command = controller.compute(simulator.attitude, simulator.rate, simulator.magnetometer(),
+                static_cast < uint32_t > (simulator.time_s * 1000.0));
+            simulator.step(command.dipole, {}, control_dt);
+        }
+        return controller.stats;
+    }
+};
+struct WheelPointingSimulation {
+    //NOMINAL_POINTING on the wheels with torquer momentum dumping, against a constant disturbance that keeps loading the wheels
+    static PointingController::PointingStats run(PointingController & controller, ReactionWheelArray & wheels, HostSimulator & simulator,
+        float duration_s, float control_dt) {
+        controller.set_sub_mode(PointingController::SubMode::WHEEL, static_cast < uint32_t > (simulator.time_s * 1000.0));
+        for (float t = 0.0f; t < duration_s; t += control_dt) {
+            wheels.speeds = simulator.wheel_speeds;
+            const PointingController::Command command = controller.compute(simulator.attitude, simulator.rate, simulator.magnetometer(),
+                static_cast < uint32_t > (simulator.time_s * 1000.0), wheels.momentum());
+            wheels.command_torque(command.torque);
+            simulator.wheel_torques = wheels.torque_commands;
+            simulator.step(wheels.momentum_dump_dipole(simulator.magnetometer()), {}, control_dt);
+        }
+        return controller.stats;
+    }
+};
+
+struct SunAcquisitionSimulation {
+    //true if the 2 degree exit criterion was reached within max_duration_s, the time it took is in
+    //controller.acquisition_time_ms. the dipole goes through the allocator's coil current limits as in flight
+    static bool run(SunAcquisitionController & controller, SunSensorArray & sensors, HostSimulator & simulator, float max_duration_s, float control_dt) {
+        controller.start(static_cast < uint32_t > (simulator.time_s * 1000.0));
+        MagnetorquerAllocator allocator;
+        const double end = simulator.time_s + max_duration_s;
+        while (simulator.time_s < end && !controller.acquired) {
+            sensors.update(simulator.sun_sensors(sensors));
+            const Vector3 dipole = controller.compute_dipole(sensors, simulator.in_eclipse, simulator.rate, simulator.magnetometer(),
+                static_cast < uint32_t > (simulator.time_s * 1000.0));
+            simulator.step(allocator.allocate(dipole, UNLIMITED_POWER_W).dipole, {}, control_dt);
+        }
+        return controller.acquired;
+    }
+
+    static constexpr float UNLIMITED_POWER_W = 10.0f; //over what the three coils can draw, only the current limits act
+};
+
+struct DetumblingSimulation {
+    //B-dot from the simulator's initial rate until the rate is under exit_rate(rad/s), true if that was within
+    //max_duration_s, the time it took is in duration_s. the field is read every control_dt as the 10 Hz magnetometer is
+    float duration_s = 0.0f;
+
+    bool run(BdotController & controller, HostSimulator & simulator, float exit_rate, float max_duration_s, float control_dt) {
+        MagnetorquerAllocator allocator;
+        const double start = simulator.time_s;
+        while (norm(simulator.rate) >= exit_rate) {
+            if (simulator.time_s - start >= max_duration_s) return false;
+            const Vector3 dipole = controller.compute_dipole(simulator.magnetometer(), static_cast < uint32_t > (simulator.time_s * 1000.0 + 0.5));
+            simulator.step(allocator.allocate(dipole, SunAcquisitionSimulation::UNLIMITED_POWER_W).dipole, {}, control_dt);
+        }
+        duration_s = static_cast < float > (simulator.time_s - start);
+        return true;
+    }
+};
+
+struct RamNvm { //NVM in RAM for the host backends, it lives in the Hal so a state machine built from a copy of it sees a warm boot
+    NonVolatileMemory::ADCSState state {};
+    NonVolatileMemory::EstimatorCheckpoint checkpoint {};
+    NonVolatileMemory::GyroCalibrationRecord gyro_calibration {};
+    NonVolatileMemory::MagnetometerCalibrationRecord magnetometer_calibration {};
+    NonVolatileMemory::WatchdogDiagnostic watchdog_diagnostic {};
+
+    NonVolatileMemory::ADCSState read_persistent_state() {
+        return state;
+    }
+    void write(const NonVolatileMemory::ADCSState & value) {
+        state = value;
+    }
+    NonVolatileMemory::EstimatorCheckpoint read_estimator_checkpoint() {
+        return checkpoint;
+    }
+    void write_estimator_checkpoint(const NonVolatileMemory::EstimatorCheckpoint & value) {
+        checkpoint = value;
+    }
+    NonVolatileMemory::GyroCalibrationRecord read_gyro_calibration() {
+        return gyro_calibration;
+    }
+    void write_gyro_calibration(const NonVolatileMemory::GyroCalibrationRecord & value) {
+        gyro_calibration = value;
+    }
+    NonVolatileMemory::MagnetometerCalibrationRecord read_magnetometer_calibration() {
+        return magnetometer_calibration;
+    }
+    void write_magnetometer_calibration(const NonVolatileMemory::MagnetometerCalibrationRecord & value) {
+        magnetometer_calibration = value;
+    }
+    NonVolatileMemory::WatchdogDiagnostic read_watchdog_diagnostic() {
+        return watchdog_diagnostic;
+    }
+    void write_watchdog_diagnostic(const NonVolatileMemory::WatchdogDiagnostic & value) {
+        watchdog_diagnostic = value;
+    }
+};
+
+//simulation backend: the drivers read the HostSimulator truth model and feed the actuator commands back into it. simulated
+//time only moves while the state machine idles(stop mode and WFI), a cycle itself takes none
+struct SimulatedSpacecraft {
+    static constexpr uint8_t IMU_UNITS = 3;
+    static constexpr uint8_t MAGNETOMETER_UNITS = 3;
+
+    HostSimulator truth;
+    SunSensorArray sun_geometry; //face normals for the photodiode model
+    Vector3 coil_currents {}; //A, last command
+    float bus_power = 10.0f; //W
+    float battery_charge = 0.8f;
+    bool power_saving = false;
+    bool gyro_powered = true;
+    std::array < bool, IMU_UNITS > imu_failed {}; //a failed unit does not answer
+    std::array < bool, MAGNETOMETER_UNITS > magnetometer_failed {};
+    std::array < Vector3, IMU_UNITS > imu_offset {}; //rad/s added to one unit, to try the voting
+    uint16_t unit_resets = 0;
+    uint16_t system_resets = 0; //software and hardware resets asked for
+    uint32_t reset_cycles = read_cycle_counter(); //the craft "powers on" when it is made, a reset restarts the count
+    uint32_t packets_sent = 0;
+    bool transmit_pending = false;
+    uint32_t transmit_tag = 0;
+    bool link_lost = false;
+
+    uint32_t time_ms() const {
+        return static_cast < uint32_t > (truth.time_s * 1000.0 + 0.5);
+    }
+
+    void advance(uint32_t ms) {
+        Vector3 dipole;
+        for (int i = 0; i < 3; i++) dipole[i] = coil_currents[i] * MagnetorquerAllocator::DIPOLE_PER_AMP[i];
+        truth.step(dipole, {}, static_cast < float > (ms) * 0.001f);
+    }
+};
+
+class SimulatedImu: public UnitDriver < SimulatedImu, SimulatedSpacecraft::IMU_UNITS > {
+    public: SimulatedSpacecraft * craft = nullptr;
+
+    bool read_unit(uint8_t unit, Vector3 & rate) {
+        if (!craft->gyro_powered || craft->imu_failed[unit]) return false;
+        for (int i = 0; i < 3; i++) rate[i] = craft->truth.rate[i] + craft->imu_offset[unit][i];
+        return true;
+    }
+    void reset_unit(uint8_t) {
+        craft->unit_resets++;
+    }
+    void set_power(bool on) {
+        craft->gyro_powered = on;
+    }
+};
+
+class SimulatedMagnetometer: public UnitDriver < SimulatedMagnetometer, SimulatedSpacecraft::MAGNETOMETER_UNITS > {
+    public: SimulatedSpacecraft * craft = nullptr;
+
+    bool read_unit(uint8_t unit, Vector3 & field) {
+        if (craft->magnetometer_failed[unit]) return false;
+        field = craft->truth.magnetometer();
+        return true;
+    }
+    void reset_unit(uint8_t) {
+        craft->unit_resets++;
+    }
+};
+
+struct SimulatedSunSensors {
+    SimulatedSpacecraft * craft = nullptr;
+
+    std::array < float, SunSensorArray::SENSOR_COUNT > read() {
+        return craft->truth.sun_sensors(craft->sun_geometry);
+    }
+    void reset() {}
+};
+
+struct SimulatedEps {
+    SimulatedSpacecraft * craft = nullptr;
+
+    float read_power() {
+        return craft->bus_power;
+    }
+    float read_battery_charge() {
+        return craft->battery_charge;
+    }
+    void set_power_saving(bool on) {
+        craft->power_saving = on;
+    }
+};
+
+struct SimulatedTorquers {
+    SimulatedSpacecraft * craft = nullptr;
+
+    void set_coil_currents(const Vector3 & currents) {
+        craft->coil_currents = currents;
+    }
+    std::array < float, ReactionWheelArray::WHEEL_COUNT > read_wheel_speeds() {
+        return craft->truth.wheel_speeds;
+    }
+    void set_wheel_torques(const std::array < float, ReactionWheelArray::WHEEL_COUNT > & torques) {
+        craft->truth.wheel_torques = torques;
+    }
+};
+
+struct SimulatedPlatform {
+    SimulatedSpacecraft * craft = nullptr;
+
+    uint32_t time_ms() {
+        return craft->time_ms();
+    }
+    uint32_t reset_cycles() {
+        return craft->reset_cycles;
+    }
+    void set_cpu_clock(uint32_t) {}
+    void enter_stop_mode(uint32_t wakeup_ms) {
+        craft->advance(wakeup_ms);
+    }
+    void wait_for_interrupt() {
+        craft->advance(1); //the 1 ms tick
+    }
+    void software_reset() {
+        craft->system_resets++;
+        craft->reset_cycles = read_cycle_counter();
+    }
+    void hardware_reset() {
+        craft->system_resets++;
+        craft->reset_cycles = read_cycle_counter();
+    }
+};
+
+struct SimulatedRadio {
+    SimulatedSpacecraft * craft = nullptr;
+
+    void send(const TelemetryGenerator::Packet & packet) {
+        craft->packets_sent++;
+        craft->transmit_pending = true;
+        craft->transmit_tag = packet.tag();
+    }
+    bool transmit_done(const TelemetryGenerator::Packet & packet) { //the simulated link sends a packet within the cycle
+        const bool done = craft->transmit_pending && craft->transmit_tag == packet.tag();
+        if (done) craft->transmit_pending = false;
+        return done;
+    }
+    bool pass_lost() {
+        return craft->link_lost;
+    }
+};
+
+using SimulationHal = Hal < SimulatedImu, SimulatedMagnetometer, SimulatedSunSensors, SimulatedEps, SimulatedTorquers, RamNvm, SimulatedPlatform,
+    SimulatedRadio > ;
+
+inline SimulationHal make_simulation_hal(SimulatedSpacecraft & craft) {
+    SimulationHal hal {};
+    hal.imu.craft = & craft;
+    hal.magnetometer.craft = & craft;
+    hal.sun_sensors.craft = & craft;
+    hal.eps.craft = & craft;
+    hal.torquers.craft = & craft;
+    hal.platform.craft = & craft;
+    hal.radio.craft = & craft;
+    return hal;
+}
+
+//replay backend: recorded sensor data(telemetry history, a simulator run) fed back in frame by frame on the recorded
+//timeline. the state machine keeps its own cycle schedule and sees the last frame at or before its time, idling
+//only moves the clock, so a replay runs as fast as the host can go
+struct ReplayFrame {
+    static constexpr uint32_t FILE_MAGIC = 0x46524441; //"ADRF", see RecordFile
+    static constexpr uint8_t IMU_UNITS = 3;
+    static constexpr uint8_t MAGNETOMETER_UNITS = 3;
+
+    uint32_t time_ms;
+    std::array < Vector3, IMU_UNITS > gyro; //rad/s
+    std::array < Vector3, MAGNETOMETER_UNITS > field; //T
+    uint8_t units_valid; //bit per unit that answered, IMUs in the low bits then the magnetometers
+    std::array < float, SunSensorArray::SENSOR_COUNT > sun_currents;
+    float bus_power; //W
+    float battery_charge;
+    std::array < float, ReactionWheelArray::WHEEL_COUNT > wheel_speeds; //rad/s
+};
+
+struct ReplaySource {
+    //the frames and where the replay is in them, plus the last actuator commands that came back out
+    const ReplayFrame * frames = nullptr;
+    size_t frame_count = 0;
+    size_t index = 0;
+    uint32_t clock_ms = 0;
+    Vector3 coil_currents {};
+    std::array < float, ReactionWheelArray::WHEEL_COUNT > wheel_torques {};
+    uint16_t system_resets = 0;
+    uint32_t reset_cycles = read_cycle_counter();
+
+    void load(const ReplayFrame * data, size_t count) {
+        frames = data;
+        frame_count = count;
+        index = 0;
+        clock_ms = count > 0 ? data[0].time_ms : 0;
+    }
+
+    const ReplayFrame & frame() const {
+        return frames[index];
+    }
+
+    bool finished() const {
+        return frame_count == 0 || index + 1 >= frame_count;
+    }
+
+    void advance(uint32_t ms) {
+        clock_ms += ms;
+        while (index + 1 < frame_count && static_cast < int32_t > (frames[index + 1].time_ms - clock_ms) <= 0) index++;
+    }
+};
+
+class ReplayImu: public UnitDriver < ReplayImu, ReplayFrame::IMU_UNITS > {
+    public: ReplaySource * source = nullptr;
+
+    bool read_unit(uint8_t unit, Vector3 & rate) {
+        rate = source->frame().gyro[unit];
+        return (source->frame().units_valid >> unit) & 1u;
+    }
+    void reset_unit(uint8_t) {}
+    void set_power(bool) {} //the recording has whatever the gyro gave, the state machine skips reads while it is off
+};
+
+class ReplayMagnetometer: public UnitDriver < ReplayMagnetometer, ReplayFrame::MAGNETOMETER_UNITS > {
+    public: ReplaySource * source = nullptr;
+
+    bool read_unit(uint8_t unit, Vector3 & field) {
+        field = source->frame().field[unit];
+        return (source->frame().units_valid >> (ReplayFrame::IMU_UNITS + unit)) & 1u;
+    }
+    void reset_unit(uint8_t) {}
+};
+
+struct ReplaySunSensors {
+    ReplaySource * source = nullptr;
+
+    std::array < float, SunSensorArray::SENSOR_COUNT > read() {
+        return source->frame().sun_currents;
+    }
+    void reset() {}
+};
+
+struct ReplayEps {
+    ReplaySource * source = nullptr;
+
+    float read_power() {
+        return source->frame().bus_power;
+    }
+    float read_battery_charge() {
+        return source->frame().battery_charge;
+    }
+    void set_power_saving(bool) {}
+};
+
+struct ReplayTorquers {
+    ReplaySource * source = nullptr;
+
+    void set_coil_currents(const Vector3 & currents) {
+        source->coil_currents = currents;
+    }
+    std::array < float, ReactionWheelArray::WHEEL_COUNT > read_wheel_speeds() {
+        return source->frame().wheel_speeds;
+    }
+    void set_wheel_torques(const std::array < float, ReactionWheelArray::WHEEL_COUNT > & torques) {
+        source->wheel_torques = torques;
+    }
+};
+
+struct ReplayPlatform {
+    ReplaySource * source = nullptr;
+
+    uint32_t time_ms() {
+        return source->clock_ms;
+    }
+    uint32_t reset_cycles() {
+        return source->reset_cycles;
+    }
+    void set_cpu_clock(uint32_t) {}
+    void enter_stop_mode(uint32_t wakeup_ms) {
+        source->advance(wakeup_ms);
+    }
+    void wait_for_interrupt() {
+        source->advance(1);
+    }
+    void software_reset() {
+        source->system_resets++;
+        source->reset_cycles = read_cycle_counter();
+    }
+    void hardware_reset() {
+        source->system_resets++;
+        source->reset_cycles = read_cycle_counter();
+    }
+};
+
+struct ReplayRadio {
+    void send(const TelemetryGenerator::Packet &) {}
+    bool transmit_done(const TelemetryGenerator::Packet &) {
+        return true;
+    }
+    bool pass_lost() {
+        return false;
+    }
+};
+
+using ReplayHal = Hal < ReplayImu, ReplayMagnetometer, ReplaySunSensors, ReplayEps, ReplayTorquers, RamNvm, ReplayPlatform, ReplayRadio > ;
+
+inline ReplayHal make_replay_hal(ReplaySource & source) {
+    ReplayHal hal {};
+    hal.imu.source = & source;
+    hal.magnetometer.source = & source;
+    hal.sun_sensors.source = & source;
+    hal.eps.source = & source;
+    hal.torquers.source = & source;
+    hal.platform.source = & source;
+    return hal;
+}
+
+inline ReplayFrame record_replay_frame(const SimulatedSpacecraft & craft) {
+    //what the simulated sensors read right now, so a simulator run can be saved as a replay log
+    ReplayFrame frame {};
+    frame.time_ms = craft.time_ms();
+    const Vector3 field = craft.truth.magnetometer();
+    for (uint8_t unit = 0; unit < ReplayFrame::IMU_UNITS; unit++) {
+        for (int i = 0; i < 3; i++) frame.gyro[unit][i] = craft.truth.rate[i] + craft.imu_offset[unit][i];
+        if (craft.gyro_powered && !craft.imu_failed[unit]) frame.units_valid |= 1u << unit;
+    }
+    for (uint8_t unit = 0; unit < ReplayFrame::MAGNETOMETER_UNITS; unit++) {
+        frame.field[unit] = field;
+        if (!craft.magnetometer_failed[unit]) frame.units_valid |= 1u << (ReplayFrame::IMU_UNITS + unit);
+    }
+    frame.sun_currents = craft.truth.sun_sensors(craft.sun_geometry);
+    frame.bus_power = craft.bus_power;
+    frame.battery_charge = craft.battery_charge;
+    frame.wheel_speeds = craft.truth.wheel_speeds;
+    return frame;
+}
+
+class MappedFile {
+    //read only mmap of a whole file. a replay log of a few days of 10 Hz frames is hundreds of MB, mapping it lets the
+    //page cache stream it in behind the replay instead of reading it all up front
+    public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator = (const MappedFile &) = delete;
+    ~MappedFile() {
+        close();
+    }
+
+    bool open(const char * path) {
+        close();
+        const int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, & info) != 0 || info.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void * mapped = mmap(nullptr, static_cast < size_t > (info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); //the mapping keeps the file open
+        if (mapped == MAP_FAILED) return false;
+        madvise(mapped, static_cast < size_t > (info.st_size), MADV_SEQUENTIAL); //replays read front to back
+        bytes = static_cast < const uint8_t * > (mapped);
+        length = static_cast < size_t > (info.st_size);
+        return true;
+    }
+
+    void close() {
+        if (bytes) munmap(const_cast < uint8_t * > (bytes), length);
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const uint8_t * data() const {
+        return bytes;
+    }
+    size_t size() const {
+        return length;
+    }
+
+    private:
+    const uint8_t * bytes = nullptr;
+    size_t length = 0;
+};
+
+template < typename Record >
+struct RecordFile {
+    //file layout shared by replay logs and traces: a 16 byte header then the records back to back, in host byte order
+    //(the logs are made and replayed on the ground, they are not sent over the link)
+    static_assert(std::is_trivially_copyable_v < Record > , "records are written and mapped as raw bytes");
+    static constexpr uint16_t VERSION = 1;
+
+    struct Header {
+        uint32_t magic; //Record::FILE_MAGIC, so a trace is not replayed as a log
+        uint16_t version;
+        uint16_t record_size; //catches a log written by a build with a different record layout
+        uint32_t record_count;
+        uint32_t reserved;
+    };
+    static_assert(sizeof(Header) == 16);
+
+    static bool view(const MappedFile & file, const Record * & records, size_t & count) { //records point into the mapping
+        records = nullptr;
+        count = 0;
+        if (file.size() < sizeof(Header)) return false;
+        Header header;
+        std::memcpy( & header, file.data(), sizeof(Header));
+        if (header.magic != Record::FILE_MAGIC || header.version != VERSION || header.record_size != sizeof(Record)) return false;
+        if (header.record_count > (file.size() - sizeof(Header)) / sizeof(Record)) return false; //truncated
+        records = reinterpret_cast < const Record * > (file.data() + sizeof(Header)); //mmap is page aligned
+        count = header.record_count;
+        return true;
+    }
+};
+
+template < typename Record >
+class RecordWriter {
+    //streams records to a file, the count in the header is filled in by close()
+    public:
+    RecordWriter() = default;
+    RecordWriter(const RecordWriter &) = delete;
+    RecordWriter & operator = (const RecordWriter &) = delete;
+    ~RecordWriter() {
+        close();
+    }
+
+    bool open(const char * path) {
+        close();
+        file = std::fopen(path, "wb");
+        if (!file) return false;
+        count = 0;
+        failed = !write_header();
+        return !failed;
+    }
+
+    void append(const Record & record) {
+        if (!file) return;
+        if (std::fwrite( & record, sizeof(Record), 1, file) != 1) failed = true;
+        count++;
+    }
+
+    bool close() { //false if anything could not be written
+        if (!file) return !failed;
+        if (std::fseek(file, 0, SEEK_SET) != 0 || !write_header()) failed = true;
+        if (std::fclose(file) != 0) failed = true;
+        file = nullptr;
+        return !failed;
+    }
+
+    private:
+    bool write_header() {
+        typename RecordFile < Record > ::Header header { Record::FILE_MAGIC, RecordFile < Record > ::VERSION, sizeof(Record), count, 0 };
+        return std::fwrite( & header, sizeof(header), 1, file) == 1;
+    }
+
+    std::FILE * file = nullptr;
+    uint32_t count = 0;
+    bool failed = false;
+};
+
+struct HistoryReplay {
+    //replay log from downlinked TelemetryHistory blocks(decode_block, the blocks of a channel oldest first as find_blocks
+    //gives them, concatenated). the history has the rates and the bus power but no field, sun or battery: the
+    //magnetometers are written as not answering(a SENSOR_ANOMALY at the start of every such replay), the sun sensors as dark
+    //and the battery at BATTERY_CHARGE. a replay from it covers the gyro path, the rate and power faults and the mode logic
+    //on top of them, not the estimator
+    static constexpr float BATTERY_CHARGE = 0.8f;
+
+    struct Channel {
+        const TelemetryHistory::Sample * samples = nullptr;
+        size_t count = 0;
+    };
+
+    static uint32_t write(const std::array < Channel, 3 > & rate, const Channel & power, uint32_t period_ms, RecordWriter < ReplayFrame > & log) {
+        //one frame every period_ms over the span of the rate channels, each channel holds its last sample. returns the frames written
+        uint32_t start = UINT32_MAX, end = 0;
+        for (const Channel & channel: rate) {
+            if (channel.count == 0) return 0;
+            start = std::min(start, channel.samples[0].time);
+            end = std::max(end, channel.samples[channel.count - 1].time);
+        }
+        if (period_ms == 0) return 0;
+        std::array < size_t, 3 > rate_index {};
+        size_t power_index = 0;
+        uint32_t frames = 0;
+        for (uint32_t time = start; static_cast < int32_t > (end - time) >= 0; time += period_ms) {
+            ReplayFrame frame {};
+            frame.time_ms = time;
+            Vector3 value {};
+            for (int i = 0; i < 3; i++) value[i] = held(rate[i], time, rate_index[i]);
+            for (Vector3 & gyro: frame.gyro) gyro = value; //the history has the voted rate, every unit gives it
+            frame.units_valid = static_cast < uint8_t > ((1u << ReplayFrame::IMU_UNITS) - 1u);
+            frame.bus_power = power.count > 0 ? held(power, time, power_index) : FaultManager::LOW_POWER_THRESHOLD + 1.0f;
+            frame.battery_charge = BATTERY_CHARGE;
+            log.append(frame);
+            frames++;
+        }
+        return frames;
+    }
+
+    private:
+    static float held(const Channel & channel, uint32_t time, size_t & index) { //last sample at or before time(the first one before the channel starts)
+        while (index + 1 < channel.count && static_cast < int32_t > (channel.samples[index + 1].time - time) <= 0) index++;
+        return channel.samples[index].value;
+    }
+};
+
+struct TraceEvent {
+    //one thing the state machine did, as seen from outside it after a cycle
+    static constexpr uint32_t FILE_MAGIC = 0x52544441; //"ADTR"
+    static constexpr uint8_t VALUE_COUNT = 3 + ReactionWheelArray::WHEEL_COUNT;
+    enum class Kind: uint8_t {
+        MODE, //code is the new ADCSMode
+        FAULT, //code is the FaultType
+        ACTUATOR, //values are the coil currents(A) then the wheel torques(Nm) in force after the cycle
+        COUNT
+    };
+
+    uint32_t time_ms;
+    Kind kind;
+    uint8_t code;
+    uint16_t spare; //keeps the file layout free of padding
+    std::array < float, VALUE_COUNT > values;
+};
+
+class TraceComparator {
+    //diffs a run against a golden trace as it goes. each kind of event is merged against the golden events of the same
+    //kind by time, so one extra mode change is counted once instead of throwing every later event out of step
+    public:
+    struct KindReport {
+        uint32_t matched = 0;
+        uint32_t mismatched = 0; //same time, different code or values
+        uint32_t missing = 0; //in the golden trace, not in the run
+        uint32_t extra = 0; //in the run, not in the golden trace
+        bool diverged = false;
+        uint32_t first_divergence_ms = 0;
+    };
+    struct Report {
+        std::array < KindReport, static_cast < size_t > (TraceEvent::Kind::COUNT) > kinds {};
+        uint32_t cycles = 0;
+        float max_actuator_error = 0.0f; //largest difference over the matched actuator events
+        bool loaded = false; //log and golden trace were readable
+        bool passed() const {
+            if (!loaded) return false;
+            for (const KindReport & kind: kinds)
+                if (kind.mismatched || kind.missing || kind.extra) return false;
+            return true;
+        }
+        const KindReport & operator[](TraceEvent::Kind kind) const {
+            return kinds[static_cast < size_t > (kind)];
+        }
     };
 
-    public: static ADCSState read_persistent_state() {
-        /* NVM read implementation */ }
-    static void write(const ADCSState & state) {
-        /* NVM write implementation */ }
-    void save_persistent_state(ADCSState state) {
-        NonVolatileMemory::write((ADCSState) state);
+    uint32_t time_tolerance_ms = 0; //a replay is deterministic, so by default events have to land on the same cycle
+    float actuator_tolerance = 1.0e-6f; //absolute, plus the relative part below
+    float actuator_relative_tolerance = 1.0e-4f;
+
+    void begin(const TraceEvent * events, size_t count) {
+        golden = events;
+        golden_count = count;
+        cursors = {};
+        report = Report {};
     }
-};
 
-enum class ADCSMode: uint8_t { //this stores the mode the ADCS currently is in
-    DETUMBLING,
-    SUN_ACQUISITION,
-    NOMINAL_POINTING,
-    SAFE_MODE,
-    FAULT_RECOVERY
-};
+    void compare(const TraceEvent & event) {
+        const TraceEvent::Kind kind = event.kind;
+        KindReport & result = report.kinds[static_cast < size_t > (kind)];
+        const TraceEvent * expected = next_golden(kind);
+        while (expected && static_cast < int64_t > (expected->time_ms) + time_tolerance_ms < event.time_ms) { //the run skipped it
+            result.missing++;
+            diverge(result, expected->time_ms);
+            consume(kind);
+            expected = next_golden(kind);
+        }
+        if (!expected || static_cast < int64_t > (expected->time_ms) > static_cast < int64_t > (event.time_ms) + time_tolerance_ms) {
+            result.extra++;
+            diverge(result, event.time_ms);
+            return;
+        }
+        if (matches( * expected, event)) result.matched++;
+        else {
+            result.mismatched++;
+            diverge(result, event.time_ms);
+        }
+        consume(kind);
+    }
 
-struct ADCSState {
-    ADCSMode current_mode;
-    uint32_t mode_entry_time; //time at which that state was saved
-    std::array < float, 3 > angular_velocity; //in all 3 directions
-    float power_level;
-    static ADCSState read_persistent_state() {
-        /* NVM read implementation */ }
-};
+    void finish() { //whatever is left in the golden trace never happened in the run
+        for (size_t kind = 0; kind < report.kinds.size(); kind++) {
+            const TraceEvent * expected;
+            while ((expected = next_golden(static_cast < TraceEvent::Kind > (kind))) != nullptr) {
+                report.kinds[kind].missing++;
+                diverge(report.kinds[kind], expected->time_ms);
+                consume(static_cast < TraceEvent::Kind > (kind));
+            }
+        }
+    }
 
-class FaultManager {
-    public: enum class FaultType {
-        NONE,
-        HIGH_ANGULAR_RATE,
-        LOW_POWER,
-        SENSOR_ANOMALY,
-        CRITICAL,
-        SOFTWARE_RESET_REQUIRED
-    };
+    Report report;
 
-    FaultType check_faults(const ADCSState & state) {
-        if (check_angular_rate(state)) return FaultType::HIGH_ANGULAR_RATE;
-        if (check_power_level(state)) return FaultType::LOW_POWER;
-        if (check_sensors()) return FaultType::SENSOR_ANOMALY;
-        return FaultType::NONE;
+    private:
+    const TraceEvent * next_golden(TraceEvent::Kind kind) { //skips the other kinds, each kind keeps its own cursor
+        size_t & cursor = cursors[static_cast < size_t > (kind)];
+        while (cursor < golden_count && golden[cursor].kind != kind) cursor++;
+        return cursor < golden_count ? & golden[cursor] : nullptr;
     }
 
-    private: bool check_angular_rate(const ADCSState & state) {
-        constexpr float MAX_ANGULAR_RATE = 0.1f; // rad/s
-        return (std::abs(state.angular_velocity[0]) > MAX_ANGULAR_RATE) ||
-            (std::abs(state.angular_velocity[1]) > MAX_ANGULAR_RATE) ||
-            (std::abs(state.angular_velocity[2]) > MAX_ANGULAR_RATE);
+    void consume(TraceEvent::Kind kind) {
+        cursors[static_cast < size_t > (kind)]++;
     }
 
-    bool check_power_level(const ADCSState & state) {
-        constexpr float LOW_POWER_THRESHOLD = 4.0f; // Watts
-        return state.power_level < LOW_POWER_THRESHOLD;
+    bool matches(const TraceEvent & expected, const TraceEvent & event) {
+        if (expected.code != event.code) return false;
+        if (event.kind != TraceEvent::Kind::ACTUATOR) return true;
+        bool within = true;
+        for (uint8_t i = 0; i < TraceEvent::VALUE_COUNT; i++) {
+            const float error = std::abs(event.values[i] - expected.values[i]);
+            report.max_actuator_error = std::max(report.max_actuator_error, error);
+            if (!(error <= actuator_tolerance + actuator_relative_tolerance * std::abs(expected.values[i]))) within = false; //NaN fails too
+        }
+        return within;
     }
 
-    bool check_sensors() {
-        /* Sensor consistency check implementation */
-        return false;
+    static void diverge(KindReport & result, uint32_t time_ms) {
+        if (result.diverged) return;
+        result.diverged = true;
+        result.first_divergence_ms = time_ms;
     }
+
+    const TraceEvent * golden = nullptr;
+    size_t golden_count = 0;
+    std::array < size_t, static_cast < size_t > (TraceEvent::Kind::COUNT) > cursors {};
 };
 
-class StateMachine {
+#endif
+
+template < typename Hardware >
+class BasicStateMachine {
+    //the whole ADCS, built against one hardware backend(FlightHal on the satellite, the simulation and replay ones on the
+    //host). every sensor read and actuator command goes through hal
     public:
-    ADCSState current_state;
+    struct BootStats { //how long it took from reset to the first control output, to compare cold and warm boots
+        bool warm_boot = false;
+        bool control_reached = false;
+        uint32_t boot_start_cycles = 0;
+        uint32_t boot_to_control_cycles = 0;
+        uint32_t boot_to_control_us() const {
+            return boot_to_control_cycles / (CPU_CLOCK_HZ / 1000000);
+        }
+    };
+
+    static constexpr uint32_t WARM_BOOT_MAX_AGE_MS = 10000; //a saved state older than this is not trusted for a warm boot
+    static constexpr uint32_t PERSIST_HEARTBEAT_PERIOD_MS = 2000; //state is also saved at this rate so that it is fresh when a WDT reset hits(assumes FRAM type NVM, flash would wear out)
+    static constexpr uint32_t ESTIMATOR_CHECKPOINT_PERIOD_MS = 60000; //the estimator changes slowly, so its checkpoint is written much less often
+    static constexpr uint32_t CALIBRATION_SAVE_PERIOD_MS = 600000; //gyro and magnetometer calibrations change even slower
+    static constexpr uint32_t HOUSEKEEPING_PERIOD_MS = 1000;
+    static constexpr uint16_t PACKED_SAMPLE_PERIOD_MS = 200; //the bit packed housekeeping is sampled 5x faster than the full packet
+    static constexpr float SUN_SENSOR_SIGMA = 0.05f; //rad, coarse photodiode sun vector
+    static constexpr float MAGNETOMETER_SIGMA = 0.02f; //rad, field direction
+    static constexpr uint8_t IMU_COUNT = decltype(Hardware::imu)::UNITS; //redundant units, voted by RedundantVectorSensor
+    static constexpr uint8_t MAGNETOMETER_COUNT = decltype(Hardware::magnetometer)::UNITS;
+    static constexpr float POWER_RESTORE_HYSTERESIS = 1.0f; //W over the LOW_POWER threshold before SAFE_MODE is left
+    static constexpr float DETUMBLING_EXIT_RATE = 0.0873f; //rad/s, the 5 deg/s of the README, SunAcquisitionController is tuned for entry at it
+    //the rate has to stay under it this long. without a gyro only the rate across B is measured, the hold gives the field
+    //some time to turn in the body first
+    static constexpr uint32_t DETUMBLING_EXIT_HOLD_MS = 60000;
+    //single frame method used to start the MEKF in each mode(indexed by ADCSMode), picked from AttitudeSolverBenchmark:
+    //TRIAD is about half the cycles and, with the sun sensor as the trusted vector, nearly as accurate for our 2 vectors,
+    //so it is used where the cycle budget is tight. ESOQ2 weights both vectors optimally and costs about the same as QUEST
+    //without its ill conditioning, so it is used where accuracy matters(NOMINAL_POINTING and coming out of FAULT_RECOVERY)
+    static constexpr AttitudeSolver::Method BOOTSTRAP_METHOD[5] = {
+        AttitudeSolver::Method::TRIAD, //DETUMBLING
+        AttitudeSolver::Method::TRIAD, //SUN_ACQUISITION
+        AttitudeSolver::Method::ESOQ2, //NOMINAL_POINTING
+        AttitudeSolver::Method::TRIAD, //SAFE_MODE
+        AttitudeSolver::Method::ESOQ2 //FAULT_RECOVERY
+    };
+
+    Hardware hal;
+    ADCSState current_state {}; //zeroed(DETUMBLING): the constructor's first update_sensor_data indexes forecast_min_charge by the mode before the saved one is restored
     FaultManager fault_checker;
-    WatchdogTimer watchdog;
+    WatchdogSupervisor watchdog;
+    BootStats boot_stats;
+    AttitudeEstimator estimator;
+    OrbitPropagator orbit;
+    MagneticFieldReference field_reference;
+    SunReference sun_reference;
+    PowerScheduler power_scheduler;
+    GyroCalibration gyro_calibration;
+    MagnetometerCalibration magnetometer_calibration;
+    CycleProfiler profiler;
+    PowerStateManager power_state;
+    TicklessIdle idle;
+    TelemetryGenerator telemetry;
+    TelemetryHistory history;
+    DownlinkScheduler downlink;
+    PointingController pointing;
+    SunSensorArray sun_sensors;
+    //tolerances are what two healthy units can differ by: bias and scale factor spread for the gyros, hard iron and
+    //mounting for the magnetometers
+    RedundantVectorSensor < IMU_COUNT > gyro_voter { 0.01f, 0.05f }; //rad/s
+    RedundantVectorSensor < MAGNETOMETER_COUNT > magnetometer_voter { 2.0e-6f, 0.05f }; //tesla
+    MagnetorquerAllocator torquer_allocator;
+    ReactionWheelArray wheels;
+    BdotController bdot;
+    SunAcquisitionController sun_acquisition;
+    uint32_t last_persist_time = 0;
+    uint32_t last_checkpoint_time = 0;
+    uint32_t last_calibration_save_time = 0;
+    uint32_t last_sensor_time = 0; //last gyro reading
+    uint32_t last_field_time = 0;
+    Vector3 raw_gyro {}; //held between readings at the power profile's rate
+    bool rate_measured = false; //angular_velocity is from a gyro vote or the field rate, not just the zero it starts at
+    bool rate_low = false; //under DETUMBLING_EXIT_RATE since rate_low_since
+    uint32_t rate_low_since = 0;
+    uint32_t last_housekeeping_time = 0;
+    uint32_t last_packed_sample_time = 0;
+    FaultManager::FaultType last_fault = FaultManager::FaultType::NONE;
 
-    StateMachine() { //default constructor to Loads the last saved state from non-volatile memory (so the satellite resumes from its last mode after a reset).
+    explicit BasicStateMachine(Hardware hardware = {}): hal(hardware) { //default constructor to Loads the last saved state from non-volatile memory (so the satellite resumes from its last mode after a reset).
         //Initializes the watchdog timer to prevent system failures.
-        current_state.read_persistent_state();
+        boot_stats.boot_start_cycles = hal.platform.reset_cycles(); //from the reset itself, the startup code and static init count too
+        for (uint8_t u = 0; u < IMU_COUNT; u++) gyro_voter.set_fitted(u, hal.imu.fitted(u));
+        for (uint8_t u = 0; u < MAGNETOMETER_COUNT; u++) magnetometer_voter.set_fitted(u, hal.magnetometer.fitted(u));
+        const NonVolatileMemory::ADCSState saved_state = hal.nvm.read_persistent_state();
+        restore_calibrations(); //valid after any reset, and the safety check below should see corrected readings
+        update_sensor_data(); //fresh sensor read, so is_state_safe judges the satellite as it is now and not as it was when saved
         //check if the current state is corrupted of not
-        if (is_corrupt(current_state.current_mode)) {
+        if (saved_state.timestamp != 0 && is_corrupt(saved_state)) { //timestamp 0 is a slot never written, that is a cold boot below
             //using the checksum logic we check if the state data is corrupt or not
             current_state.current_mode = ADCSMode::SAFE_MODE;
-        } else if (!is_state_safe(current_state.current_mode)) {
+        } else if (!is_state_safe(saved_state.current_mode)) {
             current_state.current_mode = ADCSMode::SAFE_MODE;
+        } else if (is_warm_boot_possible(saved_state)) {
+            //warm boot: we were reset only moments ago(typically a WDT reset) and the satellite is still in a state where the saved mode can run,
+            //so we skip the diagnostics and resume the saved mode directly instead of detumbling all over again
+            current_state.current_mode = saved_state.current_mode;
+            current_state.mode_entry_time = saved_state.mode_entry_time;
+            boot_stats.warm_boot = true;
+            restore_estimator_checkpoint();
         } else {
             current_state.current_mode = ADCSMode::DETUMBLING; //as we start from detumbling.
+            current_state.mode_entry_time = get_current_time();
+        }
+        if (!boot_stats.warm_boot) {
+            run_startup_diagnostics();
+        }
+        watchdog.initialize(hal.nvm, get_current_time());
+        apply_power_profile();
+    }
+
+    uint32_t cycle_period_ms() const {
+        return power_state.profile().cycle_period_ms;
+    }
+
+    void idle_until_next_cycle() { //called by main between cycles
+        const TicklessIdle::Plan plan = idle.plan(get_current_time(), cycle_period_ms(), current_state.current_mode);
+        if (plan.stop_ms > 0) {
+            hal.platform.enter_stop_mode(plan.stop_ms);
         }
-        watchdog.initialize();
+        while (static_cast < int32_t > (get_current_time() - plan.release) < 0) {
+            hal.platform.wait_for_interrupt();
+        }
+        idle.woke(get_current_time());
     }
 
     void run_cycle() {
         //this function is run continuously by the main's while(1) loop
+        profiler.start();
         update_sensor_data();
         check_state_transition();
         execute_mode_entry(current_state.current_mode);
+        if (!boot_stats.control_reached) { //first control output since the reset
+            boot_stats.boot_to_control_cycles = read_cycle_counter() - boot_stats.boot_start_cycles;
+            boot_stats.control_reached = true;
+        }
         check_for_software_reset();
         check_for_hardware_reset();
         manage_faults();
-        watchdog.refresh_watchdog(); //if we get stuck in any of the 4 functions we get a reset. 
+        if (get_current_time() - last_persist_time >= PERSIST_HEARTBEAT_PERIOD_MS) {
+            save_persistent_state(); //keeps the saved state fresh for a warm boot
+        }
+        if (estimator.initialized && get_current_time() - last_checkpoint_time >= ESTIMATOR_CHECKPOINT_PERIOD_MS) {
+            save_estimator_checkpoint();
+        }
+        if (get_current_time() - last_calibration_save_time >= CALIBRATION_SAVE_PERIOD_MS) {
+            save_calibrations();
+        }
+        if (get_current_time() - last_housekeeping_time >= HOUSEKEEPING_PERIOD_MS) {
+            generate_telemetry();
+        }
+        if (get_current_time() - last_packed_sample_time >= PACKED_SAMPLE_PERIOD_MS) {
+            sample_packed_telemetry();
+        }
+        record_history(); //every channel keeps its own rate, so this is called every cycle
+        service_downlink();
+        profiler.stop();
+        power_state.end_cycle(profiler.last_cycles);
+        current_state.avionics_power_mw = power_state.average_power_mw[static_cast < uint8_t > (power_state.active_mode())];
+        current_state.idle_fraction = idle.sleep_fraction(power_state.active_mode());
+        if (power_state.active_mode() != current_state.current_mode) {
+            apply_power_profile(); //any mode change, the transitions and the fault handling alike
+        }
+        watchdog.service(hal.nvm, get_current_time()); //if we get stuck in any of the 4 functions(or one of them skips its check in) we get a reset. 
     }
 
     void update_sensor_data() {
-        current_state.angular_velocity = read_imu();
-        current_state.power_level = read_power_system();
+        const uint32_t now = get_current_time();
+        orbit.update(now); //usually nothing, one SGP4 step every OrbitPropagator::STEP_MS
+        field_reference.update(now, orbit); //same, one IGRF evaluation every MagneticFieldReference::REFRESH_MS
+        sun_reference.update(now, orbit); //and one ephemeris + eclipse prediction every SunReference::REFRESH_MS
+        //each sensor is read at the rate of the mode's power profile, the last reading is held in between
+        const bool gyro_sampled = power_state.due(PowerStateManager::Sensor::GYRO, now);
+        if (gyro_sampled) raw_gyro = read_voted_gyro();
+        current_state.power_level = hal.eps.read_power();
+        current_state.battery_charge = hal.eps.read_battery_charge();
+        power_scheduler.update(now, current_state.battery_charge, current_state.power_level, sun_reference); //orbit forecast every PowerScheduler::UPDATE_PERIOD_MS
+        current_state.forecast_min_charge = power_scheduler.forecast_min_charge[static_cast < uint8_t > (current_state.current_mode)];
+        const bool gyro_measured = power_state.powered(PowerStateManager::Sensor::GYRO) && gyro_voter.has_value;
+        Vector3 raw_field {};
+        //no magnetometer fitted or read is not a sample: the last field is kept and nothing is fitted to it
+        const bool field_sampled = power_state.due(PowerStateManager::Sensor::MAGNETOMETER, now) && read_voted_magnetometer(raw_field);
+        if (field_sampled) {
+            magnetometer_calibration.update(raw_field, norm(reference_magnetic_field_inertial()), raw_gyro);
+            const Vector3 previous_field = current_state.magnetic_field;
+            current_state.magnetic_field = magnetometer_calibration.correct(raw_field);
+            current_state.magnetometer_residual_rms = { magnetometer_calibration.residual_before_rms, magnetometer_calibration.residual_after_rms };
+            if (!gyro_measured) {
+                //gyro off(or none fitted): the rate perpendicular to the field is all the fault checks and the damping get
+                if (last_field_time != 0 && norm(previous_field) > 0.0f) {
+                    raw_gyro = GyroCalibration::field_rate(previous_field, current_state.magnetic_field, (now - last_field_time) * 0.001f);
+                    current_state.angular_velocity = raw_gyro;
+                    rate_measured = true;
+                }
+            }
+            last_field_time = now;
+        }
+        if (gyro_sampled && gyro_measured) {
+            gyro_calibration.update(raw_gyro, current_state.magnetic_field, now);
+            current_state.angular_velocity = gyro_calibration.correct(raw_gyro); //everything downstream(fault checks, DETUMBLING exit) sees the corrected rate
+            rate_measured = true;
+        }
+        const bool sun_sampled = power_state.due(PowerStateManager::Sensor::SUN_SENSORS, now);
+        if (sun_sampled) {
+            sun_sensors.update(hal.sun_sensors.read());
+        }
+        current_state.wheel_speeds = hal.torquers.read_wheel_speeds();
+        wheels.speeds = current_state.wheel_speeds;
+        if (!estimator.initialized) {
+            bootstrap_attitude();
+        } else if (!gyro_measured) {
+            estimator.initialized = false; //nothing to propagate with, it starts again from a single frame solution
+        } else if (gyro_sampled && last_sensor_time != 0) {
+            estimator.propagate(current_state.angular_velocity, (now - last_sensor_time) * 0.001f);
+            gyro_calibration.absorb_estimator_bias(estimator);
+        }
+        if (estimator.initialized) {
+            correct_estimator(sun_sampled, field_sampled);
+        }
+        if (gyro_sampled) last_sensor_time = now;
+        reset_isolated_sensors();
+        current_state.isolated_sensors = static_cast < uint8_t > (gyro_voter.isolated_mask() | (magnetometer_voter.isolated_mask() << IMU_COUNT));
+        current_state.sensor_anomaly = gyro_voter.anomaly || magnetometer_voter.anomaly || innovation_anomaly();
+        current_state.innovation_nis_mean = { estimator.monitors[0].mean(), estimator.monitors[1].mean() };
+        watchdog.check_in(WatchdogToken::SENSORS);
+    }
+
+    void correct_estimator(bool sun_sampled, bool field_sampled) {
+        //fresh readings only, each one is gated and tested on its innovation inside the estimator
+        if (sun_sampled && sun_sensors.sun_visible) {
+            const Vector3 reference = reference_sun_inertial();
+            if (norm(reference) > 0.0f) {
+                estimator.update_vector(AttitudeEstimator::Measurement::SUN, sun_sensors.sun_vector, reference, SUN_SENSOR_SIGMA);
+            }
+        }
+        const float field_norm = norm(current_state.magnetic_field);
+        if (field_sampled && field_norm > 0.0f) {
+            const Vector3 reference = reference_magnetic_field_inertial();
+            const float reference_norm = norm(reference);
+            if (reference_norm > 0.0f) {
+                const Vector3 & b = current_state.magnetic_field;
+                estimator.update_vector(AttitudeEstimator::Measurement::MAGNETOMETER, { b[0] / field_norm, b[1] / field_norm, b[2] / field_norm },
+                    { reference[0] / reference_norm, reference[1] / reference_norm, reference[2] / reference_norm }, MAGNETOMETER_SIGMA);
+            }
+        }
+    }
+
+    bool innovation_anomaly() {
+        //one source failing its window test is that sensor. both at once is more likely the estimator itself having gone
+        //off(a bad restore, a gyro jump), so it is restarted from a single frame solution and no sensor is blamed.
+        //a fast drift shows on the sensor that drifts(0.05 rad in under a minute at 1e-3 rad/s). a very slow one is taken
+        //up by the bias states while the two vectors hold still in the body, and can come out on the other sensor
+        //instead: resetting that one is harmless, and the drift is caught once the vectors move with the orbit
+        const bool sun_failed = estimator.monitors[static_cast < uint8_t > (AttitudeEstimator::Measurement::SUN)].failed();
+        const bool field_failed = estimator.monitors[static_cast < uint8_t > (AttitudeEstimator::Measurement::MAGNETOMETER)].failed();
+        if (sun_failed && field_failed) {
+            estimator.reset();
+            return false;
+        }
+        return sun_failed || field_failed;
+    }
+
+    Vector3 read_voted_gyro() {
+        std::array < Vector3, IMU_COUNT > readings {};
+        std::array < bool, IMU_COUNT > read_ok {};
+        for (uint8_t u = 0; u < IMU_COUNT; u++) read_ok[u] = hal.imu.read(u, readings[u]);
+        return gyro_voter.vote(readings, read_ok);
+    }
+
+    bool read_voted_magnetometer(Vector3 & field) {
+        std::array < Vector3, MAGNETOMETER_COUNT > readings {};
+        std::array < bool, MAGNETOMETER_COUNT > read_ok {};
+        for (uint8_t u = 0; u < MAGNETOMETER_COUNT; u++) read_ok[u] = hal.magnetometer.read(u, readings[u]);
+        field = magnetometer_voter.vote(readings, read_ok);
+        return magnetometer_voter.has_value;
+    }
+
+    void reset_isolated_sensors() {
+        //a unit voted out is reset on its own, the others carry on(no SENSOR_ANOMALY, no full sensor reset)
+        for (uint8_t u = 0; u < IMU_COUNT; u++) {
+            if (!gyro_voter.needs_reset(u)) continue;
+            hal.imu.reset(u);
+            gyro_voter.unit_reset(u);
+        }
+        for (uint8_t u = 0; u < MAGNETOMETER_COUNT; u++) {
+            if (!magnetometer_voter.needs_reset(u)) continue;
+            hal.magnetometer.reset(u);
+            magnetometer_voter.unit_reset(u);
+        }
+    }
+
+    void bootstrap_attitude() {
+        //the MEKF has nothing to start from after a cold boot, so it takes a single frame solution over the sun and field
+        //vectors as soon as both are there(not in eclipse). the initial variance grows as the two vectors get closer together
+        if (!sun_sensors.sun_visible || norm(current_state.magnetic_field) == 0.0f) return;
+        const Vector3 sun_reference_vector = reference_sun_inertial();
+        const Vector3 field_reference_vector = reference_magnetic_field_inertial();
+        if (norm(sun_reference_vector) == 0.0f || norm(field_reference_vector) == 0.0f) return; //no orbit yet, nothing to solve against
+        const VectorObservation observations[2] = {
+            { sun_sensors.sun_vector, sun_reference_vector, 1.0f / (SUN_SENSOR_SIGMA * SUN_SENSOR_SIGMA) },
+            { current_state.magnetic_field, field_reference_vector, 1.0f / (MAGNETOMETER_SIGMA * MAGNETOMETER_SIGMA) }
+        };
+        const AttitudeSolver::Solution solution = AttitudeSolver::solve(BOOTSTRAP_METHOD[static_cast < uint8_t > (current_state.current_mode)], observations, 2);
+        if (!solution.valid) return;
+        const float sin_separation = norm(cross(sun_sensors.sun_vector, current_state.magnetic_field)) / norm(current_state.magnetic_field);
+        estimator.initialize(solution.attitude,
+            (SUN_SENSOR_SIGMA * SUN_SENSOR_SIGMA + MAGNETOMETER_SIGMA * MAGNETOMETER_SIGMA) / (sin_separation * sin_separation));
+    }
+
+    void apply_power_profile() {
+        power_state.apply(current_state.current_mode);
+        const PowerStateManager::Profile & profile = power_state.profile();
+        hal.platform.set_cpu_clock(profile.cpu_clock_hz);
+        hal.imu.set_power(power_state.powered(PowerStateManager::Sensor::GYRO));
+        watchdog.set_window(profile.cycle_period_ms / 2, 2u * profile.cycle_period_ms);
     }
 
     void check_state_transition() {
@@ -123,12 +5607,21 @@ class StateMachine {
             execute_mode_exit(current_state.current_mode);
             current_state.current_mode = new_mode;
             current_state.mode_entry_time = get_current_time();
+            if (new_mode == ADCSMode::SUN_ACQUISITION) {
+                sun_acquisition.start(current_state.mode_entry_time);
+            }
             execute_mode_entry(new_mode);
             save_persistent_state(); //save the state after every mode change
         }
+        watchdog.check_in(WatchdogToken::STATE_TRANSITION);
     }
 
     ADCSMode evaluate_transition_conditions() {
+        //the mode logic says where we want to go, the power scheduler can hold that back or step down for the orbit ahead
+        return power_scheduler.limit(requested_mode(), current_state.current_mode);
+    }
+
+    ADCSMode requested_mode() {
         ADCSMode previous_operational_mode = current_state.current_mode;
         // Simplified transition logic
         switch (current_state.current_mode) {
@@ -145,7 +5638,7 @@ class StateMachine {
             break;
 
         case ADCSMode::SAFE_MODE:
-            if (power_restored()) return previous_operational_mode;
+            if (power_restored()) return ADCSMode::SUN_ACQUISITION; //the attitude was let go, so it starts over from the sun
             break;
 
         case ADCSMode::FAULT_RECOVERY:
@@ -158,18 +5651,20 @@ class StateMachine {
     void manage_faults() {
         const auto fault = fault_checker.check_faults(current_state); //auto allows it to automatically infer the datatype
         if (fault != FaultManager::FaultType::NONE) {
+            fault_checker.record_fault(fault);
+            if (fault != last_fault) { //a fault that stays on is one event, not one per cycle
+                downlink.queue_fault_event(static_cast < uint8_t > (fault), current_state.current_mode, get_current_time());
+            }
             handle_fault(fault);
         }
+        last_fault = fault;
+        watchdog.check_in(WatchdogToken::FAULTS);
     }
 
     void handle_fault(FaultManager::FaultType fault) {
-        ADCSMode previous_operational_mode = current_state.current_mode;
-
-        previous_operational_mode = current_state.current_mode;
-
         switch (fault) {
         case FaultManager::FaultType::HIGH_ANGULAR_RATE:
-            engage_magnetorquers();
+            run_detumbling(); //B-dot from this cycle on, whatever the mode had commanded
             current_state.current_mode = ADCSMode::DETUMBLING;
             break;
 
@@ -187,16 +5682,24 @@ class StateMachine {
         case FaultManager::FaultType::CRITICAL:
             execute_hardware_reset();
             break;
-
+        case FaultManager::FaultType::NONE: //process_faults only calls this with a fault
+            break;
         }
     }
 
     void execute_mode_entry(ADCSMode mode) {
+        if (mode == ADCSMode::SAFE_MODE) {
+            power_system_slowdown(); //also when the scheduler steps down to it, not only on the LOW_POWER fault
+        }
         execute_state_behavior(mode);
     }
 
     void execute_mode_exit(ADCSMode mode) {
         /*mode exit logic depending on the hardware(turns off the mode specific actions)*/
+        if (mode == ADCSMode::SAFE_MODE) {
+            torquer_allocator.power_saving = false;
+            hal.eps.set_power_saving(false);
+        }
     }
 
     void execute_state_behavior(ADCSMode mode) {
@@ -216,51 +5719,227 @@ class StateMachine {
         default:
             break;
         }
+        watchdog.check_in(WatchdogToken::MODE_BEHAVIOR);
     }
 
-    bool is_corrupt(ADCSMode mode) {
-        /*the logic is to store the sum of all state parameters in checksum when we are writing the state in the memory, and then when we read it, we calculate checksum again, and check if the value of checksum has changed. if it has changes that means that the state was corrupted and thus we must start again*/
+    bool is_corrupt(const NonVolatileMemory::ADCSState & saved_state) {
+        /*the logic is to store a CRC of the state in checksum when we are writing the state in the memory, and then when we read it, we calculate it again, and check if the value of checksum has changed. if it has changes that means that the state was corrupted and thus we must start again*/
+        return saved_state.current_mode > ADCSMode::FAULT_RECOVERY || saved_state.checksum != saved_state.compute_checksum();
     }
 
     bool is_state_safe(ADCSMode mode) {
         //maybe the current state of the satellite is such that the angular velocity is very high, but the last saved state was Nominal pointing... clearly we cant run nominal pointing mode with high angular velocity thus we much check if the last state is safe to be implemented, or else start from the beginning. 
+        //needs current_state to hold a fresh sensor read
+        switch (mode) {
+        case ADCSMode::DETUMBLING:
+        case ADCSMode::SAFE_MODE:
+            return true;
+        case ADCSMode::SUN_ACQUISITION:
+        case ADCSMode::NOMINAL_POINTING:
+            return fault_checker.check_faults(current_state) == FaultManager::FaultType::NONE;
+        case ADCSMode::FAULT_RECOVERY:
+            return false; //a half finished recovery is never resumed
+        }
+        return false;
+    }
+
+    bool is_warm_boot_possible(const NonVolatileMemory::ADCSState & saved_state) {
+        //only a recent record is trusted, anything older means we were off for a while and need the full diagnostics
+        const uint32_t age = get_current_time() - saved_state.timestamp;
+        return saved_state.timestamp != 0 && age <= WARM_BOOT_MAX_AGE_MS;
     }
 
     void save_persistent_state() {
         NonVolatileMemory::ADCSState nvm_state {
             .current_mode = (current_state.current_mode),
-                .timestamp = current_state.mode_entry_time
+                .mode_entry_time = current_state.mode_entry_time,
+                .angular_velocity = current_state.angular_velocity,
+                .power_level = current_state.power_level,
+                .timestamp = get_current_time(),
+                .checksum = 0
         };
-        NonVolatileMemory::write(nvm_state);
+        nvm_state.checksum = nvm_state.compute_checksum();
+        hal.nvm.write(nvm_state);
+        last_persist_time = nvm_state.timestamp;
     }
 
-    // Hardware interaction placeholders
-    std::array < float,3 > read_imu() {
-        /* IMU read implementation */
-        return {};
+    void generate_telemetry() {
+        last_housekeeping_time = get_current_time();
+        downlink.request_state(); //built from the state at the time it goes down
     }
-    float read_power_system() {
-        /* EPS read implementation */
-        return 0.0f;
+
+    void sample_packed_telemetry() {
+        last_packed_sample_time = get_current_time();
+        TelemetryGenerator::Packet packet;
+        if (telemetry.add_packed_sample(current_state, last_packed_sample_time, PACKED_SAMPLE_PERIOD_MS, packet)) {
+            downlink.queue_packed(packet);
+        }
+    }
+
+    void record_history() {
+        const uint32_t now = get_current_time();
+        history.record(TelemetryHistory::Channel::ANGULAR_RATE_X, now, current_state.angular_velocity[0]);
+        history.record(TelemetryHistory::Channel::ANGULAR_RATE_Y, now, current_state.angular_velocity[1]);
+        history.record(TelemetryHistory::Channel::ANGULAR_RATE_Z, now, current_state.angular_velocity[2]);
+        history.record(TelemetryHistory::Channel::POWER_LEVEL, now, current_state.power_level);
+        history.record(TelemetryHistory::Channel::MODE, now, static_cast < float > (current_state.current_mode));
+        history.record(TelemetryHistory::Channel::ATTITUDE_W, now, estimator.attitude[0]);
+        history.record(TelemetryHistory::Channel::ATTITUDE_X, now, estimator.attitude[1]);
+        history.record(TelemetryHistory::Channel::ATTITUDE_Y, now, estimator.attitude[2]);
+        history.record(TelemetryHistory::Channel::ATTITUDE_Z, now, estimator.attitude[3]);
+    }
+
+    bool send_history(TelemetryHistory::Channel channel, uint32_t from, uint32_t to) {
+        //ground command: download one channel for a time range, it goes down over the next passes after the fault events and the state
+        return downlink.request_history(channel, from, to);
+    }
+
+    void set_pointing_target(const Quaternion & target_attitude, const Vector3 & target_rate, PointingController::SubMode sub_mode) {
+        //ground command(or the payload scheduler): where NOMINAL_POINTING points and with which gain set
+        pointing.target_attitude = quaternion_normalize(target_attitude);
+        pointing.target_rate = target_rate;
+        pointing.set_sub_mode(sub_mode, get_current_time());
+    }
+
+    bool upload_tle(const char * line1, const char * line2) {
+        //ground command: new two line elements for the orbit propagator, rejected if a checksum does not match
+        return orbit.load_tle(line1, line2);
+    }
+
+    void set_time_reference(uint32_t onboard_ms, double julian_date) {
+        //ground command: the UTC julian date that goes with an on-board time, the time base for the orbit(and everything
+        //that hangs off it)
+        orbit.set_time_reference(onboard_ms, julian_date);
+    }
+
+    void begin_downlink_pass(uint32_t budget_bytes) {
+        //ground command(or the pass predictor) at the start of a pass, budget is the bytes the link can carry in it
+        downlink.begin_pass(budget_bytes);
+    }
+
+    void service_downlink() {
+        if (!downlink.pass_active()) return;
+        if (hal.radio.pass_lost()) {
+            downlink.end_pass();
+            return;
+        }
+        const TelemetryGenerator::Packet * sent = downlink.in_flight_packet();
+        if (sent && hal.radio.transmit_done( * sent)) downlink.confirm_sent(); //only for our packet, not one left over from the last pass
+        TelemetryGenerator::Packet packet;
+        if (downlink.next_packet(telemetry, history, current_state, fault_checker, profiler, get_current_time(), packet)) {
+            hal.radio.send(packet);
+        }
+    }
+
+    void save_estimator_checkpoint() {
+        last_checkpoint_time = get_current_time();
+        hal.nvm.write_estimator_checkpoint(estimator.make_checkpoint(last_checkpoint_time));
+    }
+
+    void restore_estimator_checkpoint() {
+        const NonVolatileMemory::EstimatorCheckpoint checkpoint = hal.nvm.read_estimator_checkpoint();
+        if (checkpoint.timestamp == 0 || checkpoint.checksum != checkpoint.compute_checksum()) {
+            return; //nothing usable saved, the estimator starts from scratch
+        }
+        const float elapsed_s = (get_current_time() - checkpoint.timestamp) * 0.001f;
+        estimator.restore_checkpoint(checkpoint, elapsed_s);
+        last_checkpoint_time = checkpoint.timestamp;
+    }
+
+    void save_calibrations() {
+        last_calibration_save_time = get_current_time();
+        hal.nvm.write_gyro_calibration(gyro_calibration.make_record(last_calibration_save_time));
+        if (magnetometer_calibration.fit_count > 0) {
+            hal.nvm.write_magnetometer_calibration(magnetometer_calibration.make_record(last_calibration_save_time));
+        }
+    }
+
+    void restore_calibrations() {
+        //a record that was never written(or is corrupt) leaves the datasheet values in place
+        const NonVolatileMemory::GyroCalibrationRecord gyro = hal.nvm.read_gyro_calibration();
+        if (gyro.timestamp != 0 && gyro.checksum == gyro.compute_checksum()) {
+            gyro_calibration.restore(gyro);
+        }
+        const NonVolatileMemory::MagnetometerCalibrationRecord magnetometer = hal.nvm.read_magnetometer_calibration();
+        if (magnetometer.timestamp != 0 && magnetometer.checksum == magnetometer.compute_checksum()) {
+            magnetometer_calibration.restore(magnetometer);
+        }
+    }
+
+    Vector3 reference_magnetic_field_inertial() { //IGRF at the orbit position, TEME, tesla. zero until there is a TLE and a time reference
+        Vector3 b {};
+        field_reference.field(get_current_time(), b);
+        return b;
+    }
+
+    Vector3 reference_sun_inertial() { //sun ephemeris, TEME unit vector. zero until there is a TLE and a time reference
+        Vector3 s {};
+        sun_reference.direction(s);
+        return s;
+    }
+
+    void engage_magnetorquers(const Vector3 & dipole) {
+        //every dipole command goes through the allocator, so no mode can pull the bus below the LOW_POWER threshold
+        const MagnetorquerAllocator::Allocation allocation = torquer_allocator.allocate(dipole, torquer_allocator.power_budget(current_state.power_level));
+        hal.torquers.set_coil_currents(allocation.currents);
+    }
+    uint32_t get_current_time() {
+        return hal.platform.time_ms();
     }
-    void engage_magnetorquers() {
-        /* Actuator control */ }
-    uint16_t get_current_time() {
-        /*code to fetch time*/ }
+    void run_startup_diagnostics() {
+        /*full sensor self tests and actuator checks, this is the slow part of the boot that a warm boot skips*/ }
     void angular_rate_stable() {
         /*check current_state.angular_velocity according to appropriate data*/ }
-    bool is_angular_rate_stable() {}
-    bool sun_vectors_aligned() {}
-    bool power_restored() {}
-    bool fault_recovery_complete() {} //returns true if fault recovery is complete
+    bool is_angular_rate_stable() {
+        //a rate that was never measured(no gyro, no field yet) is not a low one
+        const uint32_t now = get_current_time();
+        if (!rate_measured || norm(current_state.angular_velocity) >= DETUMBLING_EXIT_RATE) {
+            rate_low = false;
+            return false;
+        }
+        if (!rate_low) rate_low_since = now;
+        rate_low = true;
+        return now - rate_low_since >= DETUMBLING_EXIT_HOLD_MS;
+    }
+    bool sun_vectors_aligned() {
+        return sun_acquisition.aligned(get_current_time());
+    }
+    bool power_restored() {
+        //the bus is back over the fault threshold with some margin and the orbit ahead can afford sun pointing again
+        return current_state.power_level >= FaultManager::LOW_POWER_THRESHOLD + POWER_RESTORE_HYSTERESIS &&
+            power_scheduler.allows(ADCSMode::SUN_ACQUISITION, ADCSMode::SAFE_MODE);
+    }
+    bool fault_recovery_complete() { //returns true if fault recovery is complete
+        return false; //no recovery sequence yet(nothing enters FAULT_RECOVERY), stays put rather than falling off the end
+    }
     void reset_sensor_array() {
-        /*software reset implementation*/ }
+        //only reached when a voter has no usable majority left, so every unit of that sensor is reset and the vote starts over
+        if (gyro_voter.anomaly) {
+            for (uint8_t u = 0; u < IMU_COUNT; u++) hal.imu.reset(u);
+            gyro_voter.reset();
+        }
+        InnovationMonitor & field_monitor = estimator.monitors[static_cast < uint8_t > (AttitudeEstimator::Measurement::MAGNETOMETER)];
+        if (magnetometer_voter.anomaly || field_monitor.failed()) {
+            for (uint8_t u = 0; u < MAGNETOMETER_COUNT; u++) hal.magnetometer.reset(u);
+            magnetometer_voter.reset();
+            field_monitor.reset();
+        }
+        InnovationMonitor & sun_monitor = estimator.monitors[static_cast < uint8_t > (AttitudeEstimator::Measurement::SUN)];
+        if (sun_monitor.failed()) {
+            hal.sun_sensors.reset();
+            sun_monitor.reset();
+        }
+    }
     void power_system_slowdown() {
-        /*The EPS will be adjusted. to power only the most important things*/ }
+        hal.eps.set_power_saving(true);
+        torquer_allocator.power_saving = true; //the torquers are one of the big loads, they drop to SAFE_MODE_POWER_LIMIT
+    }
     void execute_software_reset() {
-        /*the implementation is complicated, but we will be reseting the sensors by rebooting their drivers*/ }
+        hal.platform.software_reset();
+    }
     void execute_hardware_reset() {
-        /*the implementation is complicated. but my idea is to have another external circuit or microcontroller to whom we give a command to turn off the power to the main circuit, and then turn it on again after a delay*/ }
+        hal.platform.hardware_reset();
+    }
         public:
     void check_for_software_reset(){}//carefully decide the conditions for this reset and run execute_software_reset
     void check_for_hardware_reset(){}//carefully decide the conditions for this reset and run execute_hardware_reset
@@ -269,7 +5948,8 @@ class StateMachine {
 
     //the functions that execute the specific modes...
     void run_detumbling() {
-        //detumbling logic
+        //B-dot on the calibrated field, last_field_time tells it whether the reading is a new one
+        engage_magnetorquers(bdot.compute_dipole(current_state.magnetic_field, last_field_time));
         return;//once done
     }
     void run_safe_mode() {
@@ -285,41 +5965,560 @@ class StateMachine {
     }
     void run_nominal_pointing() {
         //nominal pointing logic
+        const bool use_wheels = pointing.get_sub_mode() == PointingController::SubMode::WHEEL && wheels.available();
+        const PointingController::Command command = pointing.compute(estimator.attitude, estimator.angular_rate(current_state.angular_velocity),
+            current_state.magnetic_field, get_current_time(), use_wheels ? wheels.momentum() : Vector3 {});
+        if (use_wheels) {
+            wheels.command_torque(command.torque);
+            hal.torquers.set_wheel_torques(wheels.torque_commands);
+            engage_magnetorquers(wheels.momentum_dump_dipole(current_state.magnetic_field));
+        } else {
+            engage_magnetorquers(command.dipole);
+        }
         return;//once done
     }
     void run_sun_acquisition() {
         //sun acquisition logic
+        const Vector3 dipole = sun_acquisition.compute_dipole(sun_sensors, sun_reference.in_eclipse(get_current_time()), current_state.angular_velocity, current_state.magnetic_field, get_current_time());
+        engage_magnetorquers(dipole);
         return;//once done
     }
     //these functions have all the implementation, and when that implementation is done, we simply go back to the run_cycle() function, and then we check the fault... so the faults are checked after we implement the whole mode.
 
 };
 
-class WatchdogTimer {
+#ifdef ADCS_HOST_BUILD
+struct ReplayRegression {
+    //regression test for run_cycle: a replay log(memory mapped) is run through a fresh state machine as fast as the
+    //host goes, and the mode changes, faults and actuator commands it produces are written out as a trace and/or
+    //diffed against a golden trace from a known good build. setup applies what the ground would have sent before the
+    //recording started(TLE, time reference), since those are not in the frames
+    using Machine = BasicStateMachine < ReplayHal > ;
+
+    template < typename Setup >
+    static TraceComparator::Report run(const char * log_path, const char * golden_path, const char * trace_path, Setup setup,
+        TraceComparator comparator = {}) { //golden_path or trace_path can be null
+        MappedFile log;
+        const ReplayFrame * frames;
+        size_t frame_count;
+        if (!log.open(log_path) || !RecordFile < ReplayFrame > ::view(log, frames, frame_count)) return comparator.report;
+
+        MappedFile golden;
+        const TraceEvent * golden_events = nullptr;
+        size_t golden_count = 0;
+        if (golden_path && (!golden.open(golden_path) || !RecordFile < TraceEvent > ::view(golden, golden_events, golden_count))) return comparator.report;
+        comparator.begin(golden_events, golden_count);
+
+        RecordWriter < TraceEvent > trace;
+        if (trace_path && !trace.open(trace_path)) return comparator.report;
+
+        ReplaySource source;
+        source.load(frames, frame_count);
+        Machine adcs(make_replay_hal(source));
+        setup(adcs);
+
+        ADCSMode mode = adcs.current_state.current_mode;
+        FaultManager::FaultType fault = FaultManager::FaultType::NONE;
+        uint32_t cycles = 0;
+        auto emit = [ & ](TraceEvent::Kind kind, uint8_t code) {
+            TraceEvent event {};
+            event.time_ms = source.clock_ms;
+            event.kind = kind;
+            event.code = code;
+            if (kind == TraceEvent::Kind::ACTUATOR) {
+                for (int i = 0; i < 3; i++) event.values[i] = source.coil_currents[i];
+                for (uint8_t i = 0; i < ReactionWheelArray::WHEEL_COUNT; i++) event.values[3 + i] = source.wheel_torques[i];
+            }
+            if (golden_path) comparator.compare(event);
+            if (trace_path) trace.append(event);
+        };
+        while (!source.finished()) {
+            adcs.run_cycle();
+            cycles++;
+            //seen once per cycle, a mode that is entered and left within one cycle does not show up
+            if (adcs.current_state.current_mode != mode) {
+                mode = adcs.current_state.current_mode;
+                emit(TraceEvent::Kind::MODE, static_cast < uint8_t > (mode));
+            }
+            if (adcs.last_fault != fault) {
+                fault = adcs.last_fault;
+                if (fault != FaultManager::FaultType::NONE) emit(TraceEvent::Kind::FAULT, static_cast < uint8_t > (fault)); //same rule as the downlinked fault events
+            }
+            emit(TraceEvent::Kind::ACTUATOR, 0); //every cycle, so a command that changes at a different cycle is seen
+            adcs.idle_until_next_cycle();
+        }
+        if (golden_path) comparator.finish();
+        comparator.report.cycles = cycles;
+        comparator.report.loaded = !trace_path || trace.close();
+        return comparator.report;
+    }
+};
+#endif
+
+#ifdef ADCS_HOST_BUILD
+class HostChecks {
+    //what main runs in the host build instead of the flight loop: the benchmarks and simulations above, each checked for
+    //what it was written to show. the exit status is nonzero if any check fails, so the host build doubles as the test
+    //run. timings are printed, not checked, the host counter is nanoseconds and depends on the machine
     public:
-        //implementation of the WDT(depending on which type of WDT we use)
-        void initialize() {
-            /*watchdog implementation*/
+    int run(const char * golden_trace_path, bool update_golden) {
+        telemetry();
+        downlink();
+        pointing();
+        wheels();
+        solvers();
+        orbit();
+        geomagnetic_field();
+        scalar_precision();
+        sun_acquisition();
+        detumbling();
+        replay(golden_trace_path, update_golden);
+        std::printf("%d check(s) failed\n", failures);
+        return failures == 0 ? 0 : 1;
+    }
+
+    private: int failures = 0;
+
+    void check(const char * what, bool passed) {
+        std::printf("%-4s %s\n", passed ? "ok" : "FAIL", what);
+        if (!passed) failures++;
+    }
+
+    static void report(const char * what, double value, const char * unit) {
+        std::printf("     %s: %.5g %s\n", what, value, unit);
+    }
+
+    void telemetry() {
+        //housekeeping is built in the caller's DMA buffer, and the ground decoder gets the state back bit for bit
+        ADCSState state {};
+        state.current_mode = ADCSMode::SUN_ACQUISITION;
+        state.mode_entry_time = 1234;
+        state.angular_velocity = { 0.01f, -0.02f, 0.03f };
+        state.power_level = 7.5f;
+        state.battery_charge = 0.8f;
+        FaultManager faults;
+        faults.record_fault(FaultManager::FaultType::LOW_POWER);
+        CycleProfiler profiler;
+        TelemetryGenerator generator;
+        alignas(32) std::array < uint8_t, TelemetryGenerator::MAX_PACKET_SIZE > buffer {};
+        const TelemetryGenerator::Packet packet = generator.build_housekeeping(state, faults, profiler, 5000, buffer.data());
+        check("telemetry: housekeeping is built in the buffer it is given", packet.data == buffer.data() &&
+            packet.length == TelemetryGenerator::HOUSEKEEPING_PACKET_SIZE);
+        TelemetryDecoder::Housekeeping decoded {};
+        const bool decoded_ok = TelemetryDecoder::decode_housekeeping(packet.data, packet.length, decoded);
+        check("telemetry: decoded housekeeping matches the state", decoded_ok && decoded.time == 5000 &&
+            decoded.mode == state.current_mode && decoded.mode_entry_time == state.mode_entry_time &&
+            decoded.angular_velocity == state.angular_velocity && decoded.power_level == state.power_level &&
+            decoded.battery_charge == state.battery_charge &&
+            decoded.fault_counts[static_cast < uint8_t > (FaultManager::FaultType::LOW_POWER) - 1] == 1);
+        buffer[TelemetryGenerator::PRIMARY_HEADER_SIZE + 2] ^= 0x10;
+        check("telemetry: a corrupted packet fails its CRC", !TelemetryDecoder::decode_housekeeping(packet.data, packet.length, decoded));
+        report("telemetry: housekeeping encoding", generator.benchmark_bytes_per_us(state, faults, profiler, 1000), "bytes/us");
+    }
+
+    void downlink() {
+        //fault events go before the current state and both before history, and history cut off at the end of a pass
+        //resumes from its cursor, so over enough passes every block goes down exactly once
+        static TelemetryHistory history;
+        static DownlinkScheduler scheduler;
+        static TelemetryGenerator generator;
+        const ADCSState state {};
+        const FaultManager faults;
+        const CycleProfiler profiler;
+        uint32_t seed = 2;
+        constexpr uint32_t SAMPLES = 36000;
+        constexpr uint32_t LAST_TIME = 1000 + 100 * (SAMPLES - 1); //asking up to the last sample lets the open block go too
+        for (uint32_t k = 0; k < SAMPLES; k++) {
+            seed = seed * 1664525u + 1013904223u;
+            const uint32_t time = 1000 + 100 * k;
+            history.record(TelemetryHistory::Channel::ANGULAR_RATE_X, time, 0.01f * (static_cast < float > (seed >> 16) / 32768.0f - 1.0f));
+            history.record(TelemetryHistory::Channel::MODE, time, static_cast < float > (k / 5000));
         }
-    void refresh_watchdog() {
-        /*watchdog implementation*/
+        for (uint8_t i = 0; i < 5; i++) scheduler.queue_fault_event(2, ADCSMode::SAFE_MODE, i);
+        scheduler.request_history(TelemetryHistory::Channel::ANGULAR_RATE_X, 0, LAST_TIME);
+        scheduler.request_history(TelemetryHistory::Channel::MODE, 0, LAST_TIME);
+
+        using PacketClass = DownlinkScheduler::PacketClass;
+        const auto sent = [](const DownlinkScheduler & s, PacketClass c) { return s.pass_stats.packets_sent[static_cast < uint8_t > (c)]; };
+        scheduler.begin_pass(5 * TelemetryGenerator::FAULT_EVENT_PACKET_SIZE + TelemetryGenerator::HOUSEKEEPING_PACKET_SIZE + 2000);
+        bool in_order = true;
+        TelemetryGenerator::Packet packet;
+        while (scheduler.next_packet(generator, history, state, faults, profiler, 0, packet)) {
+            scheduler.confirm_sent();
+            if (sent(scheduler, PacketClass::CURRENT_STATE) > 0 && sent(scheduler, PacketClass::FAULT_EVENT) < 5) in_order = false;
+            if (sent(scheduler, PacketClass::HISTORY) > 0 && sent(scheduler, PacketClass::CURRENT_STATE) == 0) in_order = false;
+        }
+        scheduler.end_pass();
+        uint32_t pass_bytes = 0;
+        for (uint32_t bytes: scheduler.pass_stats.bytes_sent) pass_bytes += bytes;
+        check("downlink: fault events, then current state, then history", in_order && sent(scheduler, PacketClass::FAULT_EVENT) == 5 &&
+            sent(scheduler, PacketClass::CURRENT_STATE) == 1 && sent(scheduler, PacketClass::HISTORY) > 0 &&
+            pass_bytes <= scheduler.pass_stats.budget_bytes);
+
+        uint32_t history_packets = sent(scheduler, PacketClass::HISTORY);
+        DownlinkPassSimulation simulation;
+        for (uint16_t pass = 1; pass < 100; pass++) { //until the history is all down, the efficiency is over passes with a backlog
+            simulation.run(scheduler, generator, history, state, faults, profiler, 1, 2000, 20000, pass);
+            if (sent(scheduler, PacketClass::HISTORY) == 0) break;
+            history_packets += sent(scheduler, PacketClass::HISTORY);
+        }
+        static const TelemetryHistory::Block * blocks[TelemetryHistory::BLOCK_COUNT];
+        const uint32_t block_count = history.find_blocks(TelemetryHistory::Channel::ANGULAR_RATE_X, 0, LAST_TIME, 0, blocks, TelemetryHistory::BLOCK_COUNT) +
+            history.find_blocks(TelemetryHistory::Channel::MODE, 0, LAST_TIME, 0, blocks, TelemetryHistory::BLOCK_COUNT);
+        check("downlink: passes cut mid packet resume, every history block sent once", simulation.lost_bytes > 0 && history_packets == block_count);
+        report("downlink: useful bytes over pass capacity", simulation.efficiency(), "");
+    }
+
+    void pointing() {
+        //the tuning the gain comment quotes: a 30 deg error settles in ~12000s on COARSE and ~9500s on FINE(10% margin),
+        //and stays well inside the 2 deg settle threshold after that, in float and in Q31
+        constexpr std::array < float, 2 > SETTLING_LIMIT_S { 13200.0f, 10450.0f };
+        for (uint8_t m = 0; m < 2; m++) {
+            PointingController controller;
+            controller.set_sub_mode(static_cast < PointingController::SubMode > (m), 0);
+            HostSimulator simulator;
+            simulator.attitude = quaternion_normalize(Quaternion { 0.966f, 0.2588f, 0.0f, 0.0f });
+            simulator.rate = { 0.002f, -0.001f, 0.001f };
+            const PointingController::PointingStats stats = PointingSimulation::run(controller, simulator, 20000.0f, 0.5f);
+            check(m == 0 ? "pointing: COARSE settles a 30 deg error in time" : "pointing: FINE settles a 30 deg error in time",
+                stats.settling_time_ms != 0 && stats.settling_time_ms <= SETTLING_LIMIT_S[m] * 1000.0f && stats.last_error_deg < 1.0f);
+            report(m == 0 ? "pointing: COARSE settling time" : "pointing: FINE settling time", stats.settling_time_ms / 1000.0, "s");
+        }
+    }
+
+    void wheels() {
+        //the allocation gives back the requested body torque with all four wheels and with any one of them off, and on a
+        //constant disturbance the wheels hold the attitude while the torquers keep their speed under the dumping threshold
+        const Vector3 request { 1.0e-4f, -2.0e-4f, 5.0e-5f };
+        const auto allocation_error = [ & request](const ReactionWheelArray & array) {
+            float error = 0.0f;
+            for (int i = 0; i < 3; i++) {
+                float torque = 0.0f;
+                for (uint8_t k = 0; k < ReactionWheelArray::WHEEL_COUNT; k++) torque -= array.spin_axes[k][i] * array.torque_commands[k];
+                error = std::max(error, std::abs(torque - request[i]));
+            }
+            return error;
+        };
+        ReactionWheelArray allocation;
+        allocation.command_torque(request);
+        bool allocated = allocation_error(allocation) < 1.0e-8f;
+        for (uint8_t off = 0; off < ReactionWheelArray::WHEEL_COUNT; off++) {
+            ReactionWheelArray three;
+            three.set_enabled(off, false);
+            three.command_torque(request);
+            allocated = allocated && three.available() && three.torque_commands[off] == 0.0f && allocation_error(three) < 1.0e-8f;
+        }
+        check("wheels: torque allocation with four wheels and with any three", allocated);
+
+        ReactionWheelArray array;
+        PointingController controller;
+        HostSimulator simulator;
+        simulator.attitude = quaternion_normalize(Quaternion { 0.966f, 0.2588f, 0.0f, 0.0f });
+        simulator.disturbance_torque = { 2.0e-7f, -1.0e-7f, 1.5e-7f };
+        float fastest = 0.0f, worst_error_deg = 0.0f;
+        bool dumped = false;
+        for (uint16_t chunk = 0; chunk < 60; chunk++) { //30000s, a little over one dump cycle at this disturbance
+            const PointingController::PointingStats stats = WheelPointingSimulation::run(controller, array, simulator, 500.0f, 0.5f);
+            if (simulator.time_s > 5000.0) worst_error_deg = std::max(worst_error_deg, stats.max_error_deg);
+            dumped = dumped || array.dumping;
+            for (float speed: simulator.wheel_speeds) fastest = std::max(fastest, std::abs(speed));
+        }
+        check("wheels: pointing held on the wheels under a constant disturbance", worst_error_deg < 1.0f);
+        check("wheels: momentum dumped before the speed limit", dumped &&
+            fastest < 1.05f * ReactionWheelArray::DUMP_START_FRACTION * ReactionWheelArray::MAX_SPEED);
+        report("wheels: pointing error after the first 5000s, worst", worst_error_deg, "deg");
+        report("wheels: fastest wheel", fastest, "rad/s");
+    }
+
+    void solvers() {
+        //QUEST and ESOQ2 find the same optimal attitude, with more than two vectors it beats TRIAD(which only uses two),
+        //and none of the three breaks down near a 180 deg rotation
+        constexpr std::array < const char * , 3 > NAMES { "TRIAD", "QUEST", "ESOQ2" };
+        bool same_optimum = true, better_than_triad = true, bounded = true;
+        for (uint8_t count = 2; count <= 4; count++) {
+            const std::array < AttitudeSolverBenchmark::Result, 3 > results = AttitudeSolverBenchmark::run(2000, count);
+            const float triad = results[0].max_error_deg, quest = results[1].max_error_deg, esoq2 = results[2].max_error_deg;
+            same_optimum = same_optimum && std::abs(quest - esoq2) < 0.01f;
+            if (count > 2) better_than_triad = better_than_triad && quest < triad;
+            for (const AttitudeSolverBenchmark::Result & result: results) bounded = bounded && result.max_error_deg > 0.0f && result.max_error_deg < 10.0f;
+            if (count == 2) {
+                for (uint8_t m = 0; m < 3; m++) {
+                    std::printf("     solvers: %s, 2 vectors: %u ns average, %u ns max, worst error %.3f deg\n", NAMES[m],
+                        results[m].average_cycles, results[m].max_cycles, results[m].max_error_deg);
+                }
+            }
+        }
+        check("solvers: QUEST and ESOQ2 reach the same optimum", same_optimum);
+        check("solvers: QUEST beats TRIAD with three and four vectors", better_than_triad);
+        check("solvers: worst errors of all methods within the sensor noise", bounded);
+
+        const Quaternion truth = quaternion_normalize(Quaternion { 0.001f, 0.3f, 0.9f, 0.1f });
+        const VectorObservation observations[2] {
+            { rotate_to_body(truth, { 1.0f, 0.0f, 0.0f }), { 1.0f, 0.0f, 0.0f }, 1.0f },
+            { rotate_to_body(truth, { 0.0f, 1.0f, 0.3f }), { 0.0f, 1.0f, 0.3f }, 1.0f }
+        };
+        bool near_180 = true;
+        for (uint8_t m = 0; m < 3; m++) {
+            const AttitudeSolver::Solution solution = AttitudeSolver::solve(static_cast < AttitudeSolver::Method > (m), observations, 2);
+            const float cos_half = std::abs(solution.attitude[0] * truth[0] + solution.attitude[1] * truth[1] + solution.attitude[2] * truth[2] +
+                solution.attitude[3] * truth[3]);
+            near_180 = near_180 && solution.valid && cos_half > 0.99999f;
+        }
+        check("solvers: all methods solve a rotation near 180 deg", near_180);
+    }
+
+    void orbit() {
+        //SGP4 against the Vallado(2006) test vectors for satellite 00005, and the interpolation between the 10 s steps
+        //against SGP4 itself over an orbit of the control loop(the ~100 m the OrbitPropagator comment expects)
+        struct Expected {
+            double minutes;
+            Sgp4::Vector3d position_km;
+            Sgp4::Vector3d velocity_km_s;
+        };
+        constexpr std::array < Expected, 3 > VALLADO_00005 { {
+            { 0.0, { 7022.46529266, -1400.08296755, 0.03995155 }, { 1.893841015, 6.405893759, 4.534807250 } },
+            { 360.0, { -7154.03120202, -3783.17682504, -3536.19412294 }, { 4.741887409, -4.151817765, -2.093935425 } },
+            { 720.0, { -7134.59340119, 6531.68641334, 3260.27186483 }, { -4.113793027, -2.911922039, -2.557327851 } }
+        } };
+        Sgp4 sgp4;
+        bool matches = sgp4.load_tle("1 00005U 58002B   00179.78495062  .00000023  00000-0  28098-4 0  4753",
+            "2 00005  34.2682 348.7242 1859667 331.7664  19.3264 10.82419157413667");
+        for (const Expected & expected: VALLADO_00005) {
+            Sgp4::Vector3d r, v;
+            matches = matches && sgp4.propagate(expected.minutes, r, v);
+            for (int i = 0; i < 3; i++) {
+                matches = matches && std::abs(r[i] - expected.position_km[i]) < 1.0e-4 && std::abs(v[i] - expected.velocity_km_s[i]) < 1.0e-7;
+            }
+        }
+        check("orbit: SGP4 matches the Vallado 00005 vectors to 1e-4 km", matches);
+
+        static OrbitPropagator propagator;
+        propagator.load_tle("1 25544U 98067A   08264.51782528 -.00002182  00000-0 -11606-4 0  2927",
+            "2 25544  51.6416 247.4627 0006703 130.5360 325.0288 15.72125391563537");
+        propagator.set_time_reference(0, propagator.sgp4.epoch_julian_date);
+        float worst_km = 0.0f;
+        bool interpolated = true;
+        for (uint32_t now = 0; now < 5600000; now += 100) { //one ISS orbit at 10 Hz
+            propagator.update(now);
+            Vector3 position, velocity;
+            Sgp4::Vector3d r, v;
+            interpolated = interpolated && propagator.position(now, position, velocity) && propagator.sgp4.propagate(now / 60000.0, r, v);
+            for (int i = 0; i < 3; i++) worst_km = std::max(worst_km, static_cast < float > (std::abs(position[i] - r[i])));
+        }
+        check("orbit: interpolation between SGP4 steps within 0.2 km", interpolated && worst_km < 0.2f);
+        report("orbit: worst interpolation error", worst_km * 1000.0f, "m");
+        const OrbitPropagatorBenchmark::Result cost = OrbitPropagatorBenchmark::run(propagator, 100, 1000);
+        std::printf("     orbit: SGP4 step %u ns, interpolation %u ns, %u ns per 10 Hz cycle\n", cost.sgp4_cycles, cost.interpolation_cycles,
+            cost.per_cycle_cycles);
+    }
+
+    void geomagnetic_field() {
+        //the full model against the IGRF-13 potential differentiated numerically(an independent evaluation, no recurrences),
+        //the truncation errors against the table above DEFAULT_ORDER, and the cached field in the control loop against
+        //the model evaluated at the same instant(the < 30 nT the MagneticFieldReference comment allows)
+        struct Expected {
+            std::array < double, 3 > position_km;
+            std::array < double, 3 > field_nt;
+        };
+        constexpr std::array < Expected, 5 > POTENTIAL_GRADIENT { {
+            { { 6871.2, 0.0, 0.0 }, { 10887.360, -1931.075, 21682.064 } },
+            { { 1000.0, -4000.0, 5500.0 }, { -10922.473, 32711.610, -27780.472 } },
+            { { -3000.0, 2000.0, -6000.0 }, { -25058.238, 13564.631, -39565.299 } },
+            { { 4083.9, -993.6, 5243.6 }, { -36212.550, 7170.326, -19184.019 } },
+            { { 100.0, 200.0, 6800.0 }, { -2250.077, -1851.538, -47160.354 } }
+        } };
+        const GeomagneticField < double > full;
+        bool matches = true;
+        for (const Expected & expected: POTENTIAL_GRADIENT) {
+            const std::array < double, 3 > b = full.field_ecef(expected.position_km);
+            for (int i = 0; i < 3; i++) matches = matches && std::abs(b[i] * 1.0e9 - expected.field_nt[i]) < 0.01;
+        }
+        check("field: order 13 model matches the IGRF-13 potential gradient to 0.01 nT", matches);
+
+        const auto results = GeomagneticFieldBenchmark::run(2000);
+        bool falls = true;
+        for (uint8_t k = 1; k < results.size(); k++) falls = falls && results[k].rms_error_nt <= results[k - 1].rms_error_nt;
+        const GeomagneticFieldBenchmark::Result & chosen = results[MagneticFieldReference::DEFAULT_ORDER - GeomagneticFieldBenchmark::MIN_ORDER];
+        check("field: truncation error falls with the order, float at order 13 under 1 nT", falls && results.back().rms_error_nt < 1.0f);
+        check("field: DEFAULT_ORDER within the accuracy it was picked for", chosen.rms_error_nt < 70.0f && chosen.max_angle_error_deg < 0.5f);
+        std::printf("     field: order %u: %.1f nT rms, %.3f deg worst, %u ns float, %u ns double\n", chosen.order, chosen.rms_error_nt,
+            chosen.max_angle_error_deg, chosen.float_cycles, chosen.double_cycles);
+
+        static OrbitPropagator propagator;
+        propagator.load_tle("1 25544U 98067A   08264.51782528 -.00002182  00000-0 -11606-4 0  2927",
+            "2 25544  51.6416 247.4627 0006703 130.5360 325.0288 15.72125391563537");
+        propagator.set_time_reference(0, propagator.sgp4.epoch_julian_date);
+        MagneticFieldReference reference;
+        float worst_nt = 0.0f;
+        bool cached = true;
+        for (uint32_t now = 0; now < 5600000; now += 100) {
+            propagator.update(now);
+            reference.update(now, propagator);
+            Vector3 b, position, velocity;
+            if (now < 2 * MagneticFieldReference::REFRESH_MS) continue; //two evaluations to extrapolate from
+            cached = cached && reference.field(now, b) && propagator.position(now, position, velocity);
+            const float gmst = static_cast < float > (Sgp4::gmst(propagator.julian_date(now)));
+            const float c = std::cos(gmst), s = std::sin(gmst);
+            const Vector3 b_ecef = reference.model.field_ecef({ c * position[0] + s * position[1], -s * position[0] + c * position[1], position[2] });
+            const Vector3 truth { c * b_ecef[0] - s * b_ecef[1], s * b_ecef[0] + c * b_ecef[1], b_ecef[2] };
+            for (int i = 0; i < 3; i++) worst_nt = std::max(worst_nt, std::abs(b[i] - truth[i]) * 1.0e9f);
+        }
+        check("field: cached field in the control loop within 30 nT of the model", cached && worst_nt < 30.0f);
+        report("field: worst cached field error", worst_nt, "nT");
+    }
+
+    void scalar_precision() {
+        //saturation instead of wrap round, and the comparison the README quotes: Q31 as accurate as float for the
+        //kinematics and far closer than Q16.16 in the PD law, Q15 saturating there, the float MEKF as good as the double one
+        constexpr std::array < const char * , 5 > NAMES { "float", "double", "Q31", "Q16.16", "Q15" };
+        check("precision: fixed point saturates at the limits", (Q31::from_float(0.9f) + Q31::from_float(0.9f)).raw == Q31::MAX &&
+            (Q31::from_float(-0.9f) - Q31::from_float(0.9f)).raw == Q31::MIN && (-Q15 { Q15::MIN }).raw == Q15::MAX &&
+            (FixedQ16::from_float(200.0f) * FixedQ16::from_float(200.0f)).raw == FixedQ16::MAX && (Q31::from_float(0.5f) / Q31 { 0 }).raw == Q31::MAX);
+
+        using Format = ScalarPrecisionBenchmark::Format;
+        const auto results = ScalarPrecisionBenchmark::run(1000);
+        const auto result = [ & results](Format format) { return results[static_cast < uint8_t > (format)]; };
+        check("precision: Q31 kinematics as accurate as float", result(Format::Q31).kinematics_error_deg <= 2.0f * result(Format::FLOAT).kinematics_error_deg);
+        check("precision: Q31 PD law over 10 times closer than Q16.16", 10.0f * result(Format::Q31).torque_error < result(Format::Q16_16).torque_error);
+        check("precision: Q15 and Q16.16 too coarse for the kinematics, Q15 saturates in the PD law",
+            result(Format::Q16_16).kinematics_error_deg > 0.1f && result(Format::Q15).kinematics_error_deg > 0.1f && result(Format::Q15).torque_error > 0.5f);
+        for (uint8_t f = 0; f < NAMES.size(); f++) {
+            std::printf("     precision: %-6s kinematics %.2e deg, torque %.2e, %u ns propagate, %u ns PD law\n", NAMES[f],
+                results[f].kinematics_error_deg, results[f].torque_error, results[f].kinematics_cycles, results[f].control_cycles);
+        }
+        const ScalarPrecisionBenchmark::EstimatorResult estimator = ScalarPrecisionBenchmark::run_estimator(1000);
+        check("precision: float MEKF within 0.01 deg of the double one", std::abs(estimator.float_error_deg - estimator.double_error_deg) < 0.01f);
+        std::printf("     precision: MEKF error %.4f deg float, %.4f deg double\n", estimator.float_error_deg, estimator.double_error_deg);
+    }
+
+    static float random(uint32_t & seed) { //LCG in [-1, 1], the same cases on every run
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast < float > (seed >> 8) / 16777216.0f * 2.0f - 1.0f;
+    }
+
+    static HostSimulator tumbling(uint32_t & seed, float rate) { //random attitude, rate about a random axis, random point in the orbit
+        HostSimulator simulator;
+        simulator.attitude = quaternion_normalize(Quaternion { random(seed), random(seed), random(seed), random(seed) });
+        const Vector3 axis { random(seed), random(seed), random(seed) };
+        const float length = norm(axis);
+        for (int i = 0; i < 3; i++) simulator.rate[i] = rate * axis[i] / length;
+        simulator.time_s = 3000.0 * (random(seed) + 1.0f);
+        return simulator;
+    }
+
+    void sun_acquisition() {
+        //the cases the README numbers come from: 100 entries at the 5 deg/s DETUMBLING exit rate, all acquired within 168 min
+        uint32_t seed = 12345;
+        float longest_min = 0.0f, total_min = 0.0f;
+        bool acquired = true;
+        for (uint8_t k = 0; k < 100; k++) {
+            HostSimulator simulator = tumbling(seed, 0.0873f);
+            SunAcquisitionController controller;
+            SunSensorArray sensors;
+            acquired = acquired && SunAcquisitionSimulation::run(controller, sensors, simulator, 6.0f * 3600.0f, 0.2f);
+            longest_min = std::max(longest_min, controller.acquisition_time_ms / 60000.0f);
+            total_min += controller.acquisition_time_ms / 60000.0f;
+        }
+        check("sun acquisition: every entry at 5 deg/s acquires within 168 min", acquired && longest_min <= 168.5f);
+        report("sun acquisition: mean time", total_min / 100.0f, "min");
+    }
+
+    void detumbling() {
+        //the README cases: 30 random tumbles at 0.3 rad/s, B-dot gets every one under the 5 deg/s exit within 38 min
+        uint32_t seed = 777;
+        float longest_min = 0.0f, total_min = 0.0f;
+        bool detumbled = true;
+        for (uint8_t k = 0; k < 30; k++) {
+            HostSimulator simulator = tumbling(seed, 0.3f);
+            BdotController controller;
+            DetumblingSimulation simulation;
+            detumbled = detumbled && simulation.run(controller, simulator, 0.0873f, 6.0f * 3600.0f, 0.1f);
+            longest_min = std::max(longest_min, simulation.duration_s / 60.0f);
+            total_min += simulation.duration_s / 60.0f;
+        }
+        check("detumbling: every 0.3 rad/s tumble under 5 deg/s within 38 min", detumbled && longest_min <= 38.5f);
+        report("detumbling: mean time", total_min / 30.0f, "min");
+    }
+
+    void replay(const char * golden_path, bool update_golden) {
+        //the run_cycle regression: 600 s of simulated flight recorded with record_replay_frame and replayed against the
+        //golden trace checked in from a known good build(update_golden writes it again, after a change that is meant to
+        //alter the trace). a copy of the log with a bus power dip has to fail, so the comparison is known to bite
+        char log_path[64], dipped_log_path[64];
+        std::snprintf(log_path, sizeof(log_path), "%s/adcs_replay_%d.log", P_tmpdir, static_cast < int > (getpid()));
+        std::snprintf(dipped_log_path, sizeof(dipped_log_path), "%s/adcs_replay_dip_%d.log", P_tmpdir, static_cast < int > (getpid()));
+        static constexpr const char * TLE_LINE_1 = "1 25544U 98067A   08264.51782528 -.00002182  00000-0 -11606-4 0  2927";
+        static constexpr const char * TLE_LINE_2 = "2 25544  51.6416 247.4627 0006703 130.5360 325.0288 15.72125391563537";
+        const auto setup = [](auto & adcs) { //what the ground sent before the recording started
+            adcs.upload_tle(TLE_LINE_1, TLE_LINE_2);
+            adcs.set_time_reference(1000, 2454732.0);
+        };
+
+        static SimulatedSpacecraft craft;
+        craft.truth.time_s = 1.0;
+        craft.truth.rate = { 0.004f, -0.003f, 0.002f };
+        craft.truth.attitude = quaternion_normalize(Quaternion { 0.9f, 0.1f, 0.3f, -0.2f });
+        static BasicStateMachine < SimulationHal > adcs(make_simulation_hal(craft));
+        setup(adcs);
+        RecordWriter < ReplayFrame > log, dipped_log;
+        bool recorded = log.open(log_path) && dipped_log.open(dipped_log_path);
+        for (uint32_t k = 0; recorded && k < 6000; k++) {
+            ReplayFrame frame = record_replay_frame(craft);
+            log.append(frame);
+            if (k >= 3000 && k < 3400) frame.bus_power = 2.0f;
+            dipped_log.append(frame);
+            adcs.run_cycle();
+            adcs.idle_until_next_cycle();
+        }
+        recorded = log.close() && dipped_log.close() && recorded;
+        check("replay: simulated flight recorded", recorded);
+
+        if (update_golden) {
+            const TraceComparator::Report written = ReplayRegression::run(log_path, nullptr, golden_path, setup);
+            check("replay: golden trace written", written.loaded && written.cycles > 0);
+            std::printf("     replay: %u cycles written to %s\n", written.cycles, golden_path);
+        } else {
+            const auto start = std::chrono::steady_clock::now();
+            const TraceComparator::Report replayed = ReplayRegression::run(log_path, golden_path, nullptr, setup);
+            const double elapsed_us = std::chrono::duration < double, std::micro > (std::chrono::steady_clock::now() - start).count();
+            check("replay: run_cycle matches the golden trace", replayed.passed());
+            for (const TraceComparator::KindReport & kind: replayed.kinds) {
+                if (kind.diverged) std::printf("     replay: first divergence at %u ms\n", kind.first_divergence_ms);
+            }
+            if (!replayed.loaded) std::printf("     replay: %s could not be read\n", golden_path);
+            const TraceComparator::Report dipped = ReplayRegression::run(dipped_log_path, golden_path, nullptr, setup);
+            check("replay: a bus power dip does not match the golden trace", dipped.loaded && !dipped.passed());
+            report("replay: time per cycle", elapsed_us / std::max < uint32_t > (replayed.cycles, 1), "us");
+        }
+        std::remove(log_path);
+        std::remove(dipped_log_path);
     }
 };
+#endif
 
+using StateMachine = BasicStateMachine < FlightHal > ;
+
+#ifdef ADCS_HOST_BUILD
+int main(int argc, char ** argv) {
+    //adcs_host [--update-golden] [golden trace], run from the repository root for the default trace
+    bool update_golden = false;
+    const char * golden_trace_path = "replay/golden_trace.bin";
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--update-golden") == 0) update_golden = true;
+        else golden_trace_path = argv[i];
+    }
+    return HostChecks {}.run(golden_trace_path, update_golden);
+}
+#else
 int main() {
-    int main_loop_delay_period;
-    StateMachine adcs;
+    static StateMachine adcs; //static so it(and the TelemetryHistory ring in it) lands in .bss and not on the stack
 
     while (true) {
         adcs.run_cycle(); //we are running this function continuously 
-        //here i am assuming that run_cycle will not take a substantial amount of time to execute
-        //atleast it should take more that the difference between the main loop delay and WDT duration
-        delay(main_loop_delay_period); // RTOS-compatible delay
+        adcs.idle_until_next_cycle(); //sleeps until the next release, the period follows the mode(PowerStateManager)
     }
 
     return 0;
 }
+#endif
 
-void delay(int a) {
-    //delay mechanism implementation
-}